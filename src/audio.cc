@@ -22,10 +22,47 @@
 #include <sndfile.h>
 #include <map>
 #include <algorithm>
+#include <chrono>
 
 namespace
 {
 
+struct int24 { uint8_t bytes[3]; };
+
+// Kept simple so that the compiler can vectorize the common cases.
+template<typename T, typename F>
+void write_interleaved(
+    T* dst,
+    unsigned channels,
+    const int32_t* src,
+    unsigned long count,
+    F&& convert
+){
+    if(channels == 1)
+    {
+        for(unsigned long i = 0; i < count; ++i)
+            dst[i] = convert(src[i]);
+    }
+    else if(channels == 2)
+    {
+        for(unsigned long i = 0; i < count; ++i)
+        {
+            T s = convert(src[i]);
+            dst[2*i] = s;
+            dst[2*i+1] = s;
+        }
+    }
+    else
+    {
+        for(unsigned long i = 0; i < count; ++i)
+        {
+            T s = convert(src[i]);
+            for(unsigned c = 0; c < channels; ++c)
+                dst[i*channels+c] = s;
+        }
+    }
+}
+
 std::vector<std::pair<const PaHostApiInfo*, PaHostApiIndex>> get_host_apis()
 {
     static bool cached = false;
@@ -134,9 +171,14 @@ std::vector<uint64_t> get_samplerates(
 }
 
 audio_output::audio_output(uint64_t samplerate)
-:   samplerate(samplerate), ins(nullptr), stream(nullptr), record(false),
-    encode(false), encode_head(0), total_recorded_samples(0),
-    max_recording_samples(0), loop(samplerate)
+:   samplerate(samplerate), ins(nullptr), fading_ins(nullptr),
+    next_ins(nullptr), pending_ins(nullptr),
+    fade_length(std::max(CROSSFADE_TIME * samplerate, 1.0)), fade_timer(0),
+    stream(nullptr),
+    output_format(paInt32), output_channels(1), block_size(0), block_head(0),
+    record(false), encode(false), mute(false), idle(false), max_load(0),
+    xrun_count(0), callback_count(0), encode_head(0), total_recorded_samples(0),
+    max_recording_samples(0), loop(samplerate), effects(samplerate)
 {
 }
 
@@ -148,10 +190,19 @@ audio_output::~audio_output()
 void audio_output::open(
     double target_latency,
     int system_index,
-    int device_index
+    int device_index,
+    unsigned block_size
 ){
     close();
 
+    this->block_size = 1;
+    while(this->block_size < block_size) this->block_size <<= 1;
+    block.resize(this->block_size, 0);
+    fade_block.resize(this->block_size, 0);
+    // Start with an empty block so that the first callback renders one.
+    block_head = this->block_size;
+    effects.set_block_size(this->block_size);
+
     open_stream(
         target_latency,
         system_index,
@@ -169,6 +220,9 @@ void audio_output::close()
         stop();
         Pa_CloseStream(stream);
         ins = nullptr;
+        fading_ins = nullptr;
+        next_ins = nullptr;
+        pending_ins = nullptr;
         stream = nullptr;
     }
 }
@@ -190,8 +244,59 @@ void audio_output::set_instrument(instrument& i)
             "Instrument samplerate doesn't match audio output!"
         );
 
-    ins = &i;
-    loop.set_instrument(ins);
+    loop.set_instrument(&i);
+
+    // Nothing is rendering, so the instrument can just be replaced.
+    if(!stream || Pa_IsStreamActive(stream) != 1 || !ins)
+    {
+        ins = &i;
+        fading_ins = nullptr;
+        next_ins = nullptr;
+        pending_ins = nullptr;
+        return;
+    }
+
+    pending_ins = &i;
+    flush_instrument();
+}
+
+bool audio_output::flush_instrument()
+{
+    if(!pending_ins) return true;
+    if(next_ins) return false;
+    next_ins = pending_ins;
+    pending_ins = nullptr;
+    return true;
+}
+
+bool audio_output::is_using(const instrument& i) const
+{
+    // Checked in the order the instrument moves through them, so that it
+    // can't be missed while it moves.
+    return pending_ins == &i || next_ins == &i || ins == &i ||
+        fading_ins == &i;
+}
+
+void audio_output::set_mute(bool mute)
+{
+    this->mute = mute;
+}
+
+audio_output::load_stats audio_output::get_load_stats() const
+{
+    return {max_load, xrun_count, callback_count};
+}
+
+bool audio_output::is_idle() const
+{
+    return idle;
+}
+
+void audio_output::reset_load_stats()
+{
+    max_load = 0;
+    xrun_count = 0;
+    callback_count = 0;
 }
 
 void audio_output::start_recording(
@@ -286,11 +391,37 @@ const looper& audio_output::get_looper() const
     return loop;
 }
 
+effects_chain& audio_output::get_effects()
+{
+    return effects;
+}
+
 uint64_t audio_output::get_samplerate() const
 {
     return samplerate;
 }
 
+unsigned audio_output::get_block_size() const
+{
+    return block_size;
+}
+
+double audio_output::get_block_latency() const
+{
+    return block_size/(double)samplerate;
+}
+
+double audio_output::get_latency() const
+{
+    double latency = get_block_latency();
+    if(stream)
+    {
+        const PaStreamInfo* info = Pa_GetStreamInfo(stream);
+        if(info) latency += info->outputLatency;
+    }
+    return latency;
+}
+
 std::vector<const char*> audio_output::get_available_systems()
 {
     std::vector<const char*> systems;
@@ -329,6 +460,78 @@ std::vector<uint64_t> audio_output::get_available_samplerates(
     return get_samplerates(index, target_latency);
 }
 
+audio_output::calibration audio_output::calibrate(
+    uint64_t samplerate,
+    int system_index,
+    int device_index,
+    instrument& worst_case,
+    double max_load,
+    double trial_length,
+    double max_duration,
+    std::atomic<double>* progress
+){
+    constexpr double try_latencies[] = {
+        0.002, 0.004, 0.006, 0.008, 0.012, 0.016, 0.024, 0.032, 0.048, 0.064,
+        0.096, 0.128
+    };
+    constexpr unsigned try_block_sizes[] = {32, 64, 128, 256};
+    constexpr unsigned latency_count =
+        sizeof(try_latencies)/sizeof(*try_latencies);
+    auto trial_duration = std::chrono::duration<double>(trial_length);
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(max_duration)
+        );
+
+    for(unsigned i = 0; i < latency_count; ++i)
+    {
+        double latency = try_latencies[i];
+        if(progress) *progress = i / (double)latency_count;
+        if(std::chrono::steady_clock::now() > deadline) break;
+
+        for(unsigned block_size: try_block_sizes)
+        {
+            // The block alone can't take more than the whole latency budget.
+            if(block_size > latency * samplerate) break;
+
+            audio_output out(samplerate);
+            try
+            {
+                out.open(latency, system_index, device_index, block_size);
+            }
+            catch(const std::runtime_error&)
+            {
+                continue;
+            }
+
+            for(unsigned i = 0; i < worst_case.get_polyphony(); ++i)
+                worst_case.press_voice(i, (i*7)%24-12);
+
+            out.set_mute(true);
+            out.set_instrument(worst_case);
+            out.start();
+            // Let the stream settle before measuring, startup often glitches.
+            std::this_thread::sleep_for(trial_duration*0.25);
+            out.reset_load_stats();
+            std::this_thread::sleep_for(trial_duration);
+            out.stop();
+
+            load_stats stats = out.get_load_stats();
+            if(
+                stats.callbacks != 0 &&
+                stats.xruns == 0 &&
+                stats.max_load < max_load
+            ) return {latency, block_size, true};
+        }
+    }
+
+    return {
+        try_latencies[latency_count-1],
+        try_block_sizes[sizeof(try_block_sizes)/sizeof(*try_block_sizes)-1],
+        false
+    };
+}
+
 void audio_output::open_stream(
     double target_latency,
     int system_index,
@@ -353,18 +556,50 @@ void audio_output::open_stream(
             ->defaultLowOutputLatency;
     }
 
-    params.channelCount = 1;
     params.hostApiSpecificStreamInfo = NULL;
-    params.sampleFormat = paInt32;
     params.suggestedLatency = target_latency;
 
+    // PortAudio doesn't tell which formats are native and also accepts ones
+    // it has to convert, so this only picks the first supported layout in
+    // order of preference. Float and 16-bit are tried first since hosts most
+    // often take those as is, and stereo since mono is commonly expanded.
+    constexpr PaSampleFormat try_formats[] = {
+        paFloat32, paInt16, paInt32, paInt24
+    };
+    int max_channels = Pa_GetDeviceInfo(params.device)->maxOutputChannels;
+    output_format = paInt32;
+    output_channels = 1;
+    bool found = false;
+    for(int channels = std::min(max_channels, 2); channels > 0; --channels)
+    {
+        params.channelCount = channels;
+        for(PaSampleFormat format: try_formats)
+        {
+            params.sampleFormat = format;
+            if(
+                Pa_IsFormatSupported(nullptr, &params, samplerate)
+                == paFormatIsSupported
+            ){
+                output_format = format;
+                output_channels = channels;
+                found = true;
+                break;
+            }
+        }
+        if(found) break;
+    }
+    params.channelCount = output_channels;
+    params.sampleFormat = output_format;
+
+    // Samples are clamped during synthesis, so clipping and dithering by
+    // PortAudio would just be an extra pass.
     PaError err = Pa_OpenStream(
         &stream,
         nullptr,
         &params,
         samplerate,
         paFramesPerBufferUnspecified,
-        paNoFlag,
+        paClipOff|paDitherOff,
         callback,
         userdata
     );
@@ -374,6 +609,50 @@ void audio_output::open_stream(
         );
 }
 
+void audio_output::render_block()
+{
+    // Start switching to a new instrument
+    instrument* next = next_ins;
+    if(next && !fading_ins)
+    {
+        fading_ins = ins.load();
+        ins = next;
+        next_ins = nullptr;
+        fade_timer = fade_length;
+    }
+
+    int32_t* b = block.data();
+    memset(b, 0, block_size * sizeof(*b));
+    ins.load()->synthesize(b, block_size);
+
+    instrument* fading = fading_ins;
+    if(fading)
+    {
+        int32_t* f = fade_block.data();
+        memset(f, 0, block_size * sizeof(*f));
+        fading->synthesize(f, block_size);
+
+        for(unsigned i = 0; i < block_size; ++i)
+        {
+            if(fade_timer > 0) fade_timer--;
+            b[i] = (
+                (int64_t)b[i] * (int64_t)(fade_length - fade_timer) +
+                (int64_t)f[i] * (int64_t)fade_timer
+            ) / (int64_t)fade_length;
+        }
+        if(fade_timer == 0) fading_ins = nullptr;
+    }
+
+    // Handle loops
+    loop.apply(b, block_size);
+
+    effects.apply(b, block_size);
+    block_head = 0;
+
+    idle = !fading_ins && ins.load()->is_silent() && loop.is_silent() &&
+        effects.is_silent();
+}
+
 void audio_output::handle_recording()
 {
     while(record)
@@ -472,47 +751,125 @@ void audio_output::handle_encoding()
     }
 }
 
+void audio_output::write_output(
+    void* output,
+    unsigned long offset,
+    const int32_t* samples,
+    unsigned long count
+){
+    switch(output_format)
+    {
+    case paFloat32:
+        write_interleaved(
+            static_cast<float*>(output) + offset * output_channels,
+            output_channels, samples, count,
+            [](int32_t s){ return s * (1.0f/2147483648.0f); }
+        );
+        break;
+    case paInt16:
+        write_interleaved(
+            static_cast<int16_t*>(output) + offset * output_channels,
+            output_channels, samples, count,
+            [](int32_t s){ return (int16_t)(s >> 16); }
+        );
+        break;
+    case paInt24:
+        write_interleaved(
+            static_cast<int24*>(output) + offset * output_channels,
+            output_channels, samples, count,
+            [](int32_t s){
+                return int24{{
+                    (uint8_t)(s >> 8), (uint8_t)(s >> 16), (uint8_t)(s >> 24)
+                }};
+            }
+        );
+        break;
+    default:
+        write_interleaved(
+            static_cast<int32_t*>(output) + offset * output_channels,
+            output_channels, samples, count,
+            [](int32_t s){ return s; }
+        );
+        break;
+    }
+}
+
+void audio_output::record_samples(const int32_t* samples, unsigned long count)
+{
+    int32_t* d = ring_buffer.data.data();
+    size_t ds = ring_buffer.data.size();
+    uint64_t head = ring_buffer.head;
+    size_t sz = count * sizeof(*samples);
+
+    // Assume ring buffer is large enough that it cannot be wrapped twice.
+    if (head + count >= ds)
+    {
+        size_t part1 = ds - head;
+        size_t part1_sz = part1 * sizeof(*samples);
+        memcpy(d + head, samples, part1_sz);
+        memcpy(d, samples + part1, sz - part1_sz);
+        head = head + count - ds;
+    }
+    else
+    {
+        memcpy(d + head, samples, sz);
+        head += count;
+    }
+    ring_buffer.head = head;
+}
+
 int audio_output::stream_callback(
     const void*,
     void* output,
     unsigned long framecount,
     const PaStreamCallbackTimeInfo*,
-    PaStreamCallbackFlags,
+    PaStreamCallbackFlags flags,
     void* data
 ){
+    auto callback_start = std::chrono::steady_clock::now();
     audio_output* self = static_cast<audio_output*>(data);
-    int32_t* o = static_cast<int32_t*>(output);
-    size_t sz = framecount * sizeof(*o);
-    memset(o, 0, sz);
-    self->ins->synthesize(o, framecount);
+    bool record = self->record;
 
-    // Handle loops
-    self->loop.apply(o, framecount);
-
-    // Handle recording final output
-    if(self->record)
+    // Serve the requested frames from the current block, rendering new blocks
+    // whenever it runs out. The samples are converted straight into the
+    // stream's native layout.
+    for(unsigned long i = 0; i < framecount;)
     {
-        int32_t* d = self->ring_buffer.data.data();
-        size_t ds = self->ring_buffer.data.size();
-        uint64_t head = self->ring_buffer.head;
-        
-        // Assume ring buffer is large enough that it cannot be wrapped twice.
-        if (head + framecount >= ds)
-        {
-            size_t part1 = ds - head;
-            size_t part1_sz = part1 * sizeof(*o);
-            memcpy(d + head, o, part1_sz);
-            memcpy(d, o + part1, sz - part1_sz);
-            head = head + framecount - ds;
-        }
-        else
+        if(self->block_head == self->block_size) self->render_block();
+        unsigned long count = std::min(
+            framecount - i,
+            (unsigned long)(self->block_size - self->block_head)
+        );
+        const int32_t* samples = self->block.data() + self->block_head;
+
+        // Handle recording final output
+        if(record) self->record_samples(samples, count);
+
+        // The block has been consumed at this point, so muting can just
+        // clear it.
+        if(self->mute)
         {
-            memcpy(d + head, o, sz);
-            head += framecount;
+            memset(
+                self->block.data() + self->block_head, 0,
+                count * sizeof(int32_t)
+            );
         }
-        self->ring_buffer.head = head;
-        self->recording_cv.notify_one();
+        self->write_output(output, i, samples, count);
+
+        self->block_head += count;
+        i += count;
     }
 
+    if(record) self->recording_cv.notify_one();
+
+    // Measure how much of the deadline was used.
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - callback_start
+    ).count();
+    double load = elapsed * self->samplerate / framecount;
+    if(load > self->max_load) self->max_load = load;
+    if(flags & paOutputUnderflow) self->xrun_count++;
+    self->callback_count++;
+
     return 0;
 }
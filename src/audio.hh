@@ -22,6 +22,7 @@
 #include "instrument.hh"
 #include "encoder.hh"
 #include "looper.hh"
+#include "effects.hh"
 #include <cstdint>
 #include <stdexcept>
 #include <string>
@@ -34,19 +35,59 @@
 class audio_output
 {
 public:
+    static constexpr double CROSSFADE_TIME = 0.02;
+
+    struct load_stats
+    {
+        // Longest callback duration relative to the time the callback's frames
+        // last, so 1.0 means the deadline was just barely met.
+        double max_load;
+        uint64_t xruns;
+        uint64_t callbacks;
+    };
+
+    struct calibration
+    {
+        double target_latency;
+        unsigned block_size;
+        bool stable;
+    };
+
     explicit audio_output(uint64_t samplerate = 44100);
     ~audio_output();
 
+    // block_size is the internal render block length in samples. It's rounded
+    // up to the next power of two.
     void open(
         double target_latency = 0.030,
         int system_index = -1,
-        int device_index = -1
+        int device_index = -1,
+        unsigned block_size = 64
     );
     void close();
     void start();
     void stop();
-    // This must be called only when audio output is stopped!
+    // Can be called while audio output is running. The new instrument fades
+    // in while the previous one fades out over CROSSFADE_TIME. Only one switch
+    // runs at a time, a later instrument is sent by flush_instrument() once
+    // the previous switch is done. An instrument must be kept alive until
+    // is_using() returns false for it.
     void set_instrument(instrument& i);
+    // Retries sending an instrument that set_instrument() had to hold back.
+    // Returns true if nothing is left pending.
+    bool flush_instrument();
+    // True if the instrument is playing, fading out or waiting to be played.
+    bool is_using(const instrument& i) const;
+
+    // Rendering is still done as usual when muted, only the output is silent.
+    void set_mute(bool mute);
+
+    load_stats get_load_stats() const;
+    void reset_load_stats();
+
+    // True while the instrument, loops and effects are all silent, so that
+    // blocks are just zero-filled.
+    bool is_idle() const;
 
     void start_recording(
         encoder::format fmt = encoder::WAV,
@@ -64,7 +105,15 @@ public:
     looper& get_looper();
     const looper& get_looper() const;
 
+    effects_chain& get_effects();
+
     uint64_t get_samplerate() const;
+    unsigned get_block_size() const;
+
+    // Latency added by rendering in fixed-size blocks, in seconds.
+    double get_block_latency() const;
+    // Total output latency reported by the stream plus block latency.
+    double get_latency() const;
 
     static std::vector<const char*> get_available_systems();
     static std::vector<const char*> get_available_devices(
@@ -74,6 +123,24 @@ public:
         int system_index, int device_index, double target_latency = 0.030
     );
 
+    // Sweeps latencies and block sizes on the given device while rendering
+    // the given instrument with all voices pressed, and returns the smallest
+    // combination that ran without xruns and with enough headroom. The
+    // instrument's voices are left pressed, and the device must not be in use
+    // by another audio_output. The sweep gives up after max_duration seconds.
+    // If progress is given, the finished fraction of the sweep is stored
+    // there, so that it can be shown while this runs on another thread.
+    static calibration calibrate(
+        uint64_t samplerate,
+        int system_index,
+        int device_index,
+        instrument& worst_case,
+        double max_load = 0.75,
+        double trial_length = 0.25,
+        double max_duration = 10.0,
+        std::atomic<double>* progress = nullptr
+    );
+
 private:
     friend class encoder;
 
@@ -85,6 +152,15 @@ private:
         void* userdata
     );
 
+    void render_block();
+    void write_output(
+        void* output,
+        unsigned long offset,
+        const int32_t* samples,
+        unsigned long count
+    );
+    void record_samples(const int32_t* samples, unsigned long count);
+
     void handle_recording();
     void handle_encoding();
 
@@ -98,10 +174,33 @@ private:
     );
 
     uint64_t samplerate;
-    instrument* ins;
+
+    // Only the audio thread changes ins and fading_ins while the stream is
+    // running, and it clears next_ins only after ins points to it. The other
+    // thread only sends next_ins when it's empty, and holds newer instruments
+    // in pending_ins meanwhile.
+    std::atomic<instrument*> ins, fading_ins, next_ins;
+    instrument* pending_ins;
+    uint64_t fade_length, fade_timer;
+    std::vector<int32_t> fade_block;
+
     PaStream *stream;
+    PaSampleFormat output_format;
+    int output_channels;
+
+    // The stream is served from fixed-size blocks, so that synthesis always
+    // sees the same sample count regardless of what PortAudio asks for.
+    unsigned block_size;
+    unsigned block_head;
+    std::vector<int32_t> block;
 
     std::atomic_bool record, encode;
+    std::atomic_bool mute;
+    std::atomic_bool idle;
+
+    std::atomic<double> max_load;
+    std::atomic_uint64_t xrun_count;
+    std::atomic_uint64_t callback_count;
 
     struct
     {
@@ -122,6 +221,7 @@ private:
     std::unique_ptr<std::thread> recording_thread;
 
     looper loop;
+    effects_chain effects;
 };
 
 #endif
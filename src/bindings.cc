@@ -31,7 +31,7 @@ namespace
 
     const char* const action_strings[] = {
         "KEY", "FREQUENCY_EXPT", "VOLUME_MUL", "PERIOD_FINE", "AMPLITUDE_MUL",
-        "ENVELOPE_ADJUST", "LOOP_CONTROL"
+        "ENVELOPE_ADJUST", "LOOP_CONTROL", "FILTER_ADJUST"
     };
 
     const char* const loop_control_strings[] = {
@@ -81,9 +81,75 @@ bind::bind(enum action a)
         loop.index = -1;
         loop.control = LOOP_RECORD;
         break;
+    case FILTER_ADJUST:
+        filter.which = 0;
+        filter.max_mul = 4.0;
+        break;
     }
 }
 
+bool bind::operator==(const bind& other) const
+{
+    if(
+        id != other.id || wait_assign != other.wait_assign ||
+        control != other.control || toggle != other.toggle ||
+        cumulative != other.cumulative || stacking != other.stacking ||
+        action != other.action
+    ) return false;
+
+    switch(control)
+    {
+    case BUTTON_PRESS:
+        if(
+            button.index != other.button.index ||
+            button.active_state != other.button.active_state
+        ) return false;
+        break;
+    case AXIS_CONTINUOUS:
+    case AXIS_THRESHOLD:
+        if(
+            axis.index != other.axis.index ||
+            axis.invert != other.axis.invert ||
+            axis.threshold != other.axis.threshold ||
+            axis.origin != other.axis.origin
+        ) return false;
+        break;
+    default:
+        break;
+    }
+
+    switch(action)
+    {
+    case KEY:
+        return key_semitone == other.key_semitone;
+    case FREQUENCY_EXPT:
+        return frequency.max_expt == other.frequency.max_expt;
+    case VOLUME_MUL:
+        return volume.max_mul == other.volume.max_mul;
+    case PERIOD_FINE:
+        return period.modulator_index == other.period.modulator_index &&
+            period.max_fine == other.period.max_fine;
+    case AMPLITUDE_MUL:
+        return amplitude.modulator_index == other.amplitude.modulator_index &&
+            amplitude.max_mul == other.amplitude.max_mul;
+    case ENVELOPE_ADJUST:
+        return envelope.which == other.envelope.which &&
+            envelope.max_mul == other.envelope.max_mul;
+    case LOOP_CONTROL:
+        return loop.index == other.loop.index &&
+            loop.control == other.loop.control;
+    case FILTER_ADJUST:
+        return filter.which == other.filter.which &&
+            filter.max_mul == other.filter.max_mul;
+    }
+    return true;
+}
+
+bool bind::operator!=(const bind& other) const
+{
+    return !(*this == other);
+}
+
 json bind::serialize() const
 {
     json j;
@@ -147,6 +213,10 @@ json bind::serialize() const
         j["action"]["loop"]["control"] =
             loop_control_strings[(unsigned)loop.control];
         break;
+    case FILTER_ADJUST:
+        j["action"]["filter"]["which"] = filter.which;
+        j["action"]["filter"]["max_mul"] = filter.max_mul;
+        break;
     }
 
     return j;
@@ -237,6 +307,10 @@ bool bind::deserialize(const json& j)
                 loop.control = (enum loop_control)control_i;
             }
             break;
+        case FILTER_ADJUST:
+            j.at("action").at("filter").at("which").get_to(filter.which);
+            j.at("action").at("filter").at("max_mul").get_to(filter.max_mul);
+            break;
         }
     }
     catch(...)
@@ -540,10 +614,28 @@ void bindings::act(
     int axis_index,
     int button_index
 ){
-    for(const bind& b: binds)
+    if(index_outdated) update_index();
+
+    static const std::vector<unsigned> none;
+    const std::vector<unsigned>& axis_list =
+        axis_index >= 0 && axis_index < (int)axis_binds.size() ?
+        axis_binds[axis_index] : none;
+    const std::vector<unsigned>& button_list =
+        button_index >= 0 && button_index < (int)button_binds.size() ?
+        button_binds[button_index] : none;
+
+    // Both lists are in bind order, so merge them to act in the same order
+    // as the binds are listed.
+    auto ai = axis_list.begin();
+    auto bi = button_list.begin();
+    while(ai != axis_list.end() || bi != button_list.end())
     {
-        // Skip if this bind wasn't triggered
-        if(!b.triggered(axis_index, button_index)) continue;
+        unsigned i;
+        if(bi == button_list.end() || (ai != axis_list.end() && *ai < *bi))
+            i = *ai++;
+        else i = *bi++;
+
+        const bind& b = binds[i];
 
         double value = 0.0;
         if(!b.update_value(state, c, cid, value)) continue;
@@ -562,19 +654,50 @@ void bindings::act(
 
         // Perform actual action.
         handle_action(cid, state, loop, b, value);
+
+        double bend, amplitude;
+        if(
+            value && b.action == bind::KEY &&
+            b.control != bind::BUTTON_PRESS &&
+            c->get_axis_expression(b.axis.index, bend, amplitude)
+        ) state.set_key_expression(cid, b.id, bend, amplitude);
     }
 }
 
+bool bindings::is_coalescable(int axis_index)
+{
+    if(index_outdated) update_index();
+    if(axis_index < 0 || axis_index >= (int)axis_coalescable.size())
+        return true;
+    return axis_coalescable[axis_index];
+}
+
 bind& bindings::create_new_bind(enum bind::action action)
 {
     bind new_bind(action);
     new_bind.id = id_counter++;
     binds.push_back(new_bind);
+    index_outdated = true;
     return binds.back();
 }
 
-bind& bindings::get_bind(unsigned i) { return binds[i]; }
 const bind& bindings::get_bind(unsigned i) const { return binds[i]; }
+
+void bindings::set_bind(unsigned i, const bind& b)
+{
+    bind& old = binds[i];
+    // Only the fields update_index() looks at require rebuilding it.
+    int old_index = old.control == bind::BUTTON_PRESS ?
+        old.button.index : old.axis.index;
+    int new_index = b.control == bind::BUTTON_PRESS ?
+        b.button.index : b.axis.index;
+    if(
+        old.control != b.control || old_index != new_index ||
+        old.toggle != b.toggle || old.stacking != b.stacking ||
+        old.action != b.action
+    ) index_outdated = true;
+    old = b;
+}
 const std::vector<bind>& bindings::get_binds() const { return binds; }
 
 void bindings::move_bind(
@@ -587,6 +710,7 @@ void bindings::move_bind(
     if(i >= binds.size()) return;
 
     bind& b = binds[i];
+    index_outdated = true;
 
     if(movement == -2) erase_bind(i, cid, state);
     else if(movement == 1)
@@ -638,6 +762,7 @@ void bindings::erase_bind(unsigned i, uint32_t cid, control_state& state)
     auto it = binds.begin() + i;
     state.erase_action(cid, it->id);
     binds.erase(it);
+    index_outdated = true;
 }
 
 size_t bindings::bind_count() const
@@ -684,6 +809,7 @@ bool bindings::deserialize(const json& j)
         return false;
     }
 
+    update_index();
     return true;
 }
 
@@ -696,6 +822,10 @@ void bindings::clear()
     id_counter = 0;
     write_lock = false;
     binds.clear();
+    axis_binds.clear();
+    button_binds.clear();
+    axis_coalescable.clear();
+    index_outdated = false;
 }
 
 int bindings::handle_loop_event(
@@ -804,6 +934,16 @@ void bindings::handle_action(
                 lerp(1.0, b.envelope.max_mul, value)
         );
         break;
+    case bind::FILTER_ADJUST:
+        state.set_filter_adjust(
+            b.filter.which,
+            cid,
+            b.id,
+            b.cumulative ?
+                pow(b.filter.max_mul, value):
+                lerp(1.0, b.filter.max_mul, value)
+        );
+        break;
     case bind::LOOP_CONTROL:
         {
             if(!loop) return;
@@ -827,3 +967,48 @@ void bindings::handle_action(
         break;
     }
 }
+
+void bindings::update_index()
+{
+    for(auto& list: axis_binds) list.clear();
+    for(auto& list: button_binds) list.clear();
+
+    for(unsigned i = 0; i < binds.size(); ++i)
+    {
+        const bind& b = binds[i];
+        std::vector<std::vector<unsigned>>* table = nullptr;
+        int index = -1;
+        switch(b.control)
+        {
+        case bind::BUTTON_PRESS:
+            table = &button_binds;
+            index = b.button.index;
+            break;
+        case bind::AXIS_CONTINUOUS:
+        case bind::AXIS_THRESHOLD:
+            table = &axis_binds;
+            index = b.axis.index;
+            break;
+        default:
+            break;
+        }
+        if(!table || index < 0) continue;
+        if((unsigned)index >= table->size()) table->resize(index+1);
+        (*table)[index].push_back(i);
+    }
+
+    axis_coalescable.assign(axis_binds.size(), true);
+    for(unsigned index = 0; index < axis_binds.size(); ++index)
+    {
+        for(unsigned i: axis_binds[index])
+        {
+            const bind& b = binds[i];
+            if(
+                b.control != bind::AXIS_CONTINUOUS || b.toggle ||
+                b.stacking || b.action == bind::KEY ||
+                b.action == bind::LOOP_CONTROL
+            ) axis_coalescable[index] = false;
+        }
+    }
+    index_outdated = false;
+}
@@ -32,6 +32,10 @@ struct bind
     json serialize() const;
     bool deserialize(const json& j);
 
+    // Only compares the union members that are in use.
+    bool operator==(const bind& other) const;
+    bool operator!=(const bind& other) const;
+
     // Do not modify this manually, it's set by bindings::create_new_bind and
     // used for internal bookkeeping.
     control_state::action_id id;
@@ -81,7 +85,8 @@ struct bind
         PERIOD_FINE,
         AMPLITUDE_MUL,
         ENVELOPE_ADJUST,
-        LOOP_CONTROL
+        LOOP_CONTROL,
+        FILTER_ADJUST
     } action;
 
     enum loop_control
@@ -134,6 +139,16 @@ struct bind
             double max_mul;
         } envelope;
 
+        // FILTER_ADJUST (discrete jumps to max, must be positive)
+        struct
+        {
+            // Which filter parameter?
+            // 0 - cutoff
+            // 1 - resonance
+            unsigned which;
+            double max_mul;
+        } filter;
+
         // LOOP_CONTROL (discrete only)
         struct
         {
@@ -213,9 +228,14 @@ public:
         int button_index
     );
 
+    // True if only the latest value of the axis matters, so that several
+    // changes to it can be acted on as one. False if a bind of the axis
+    // reacts to each edge, like keys, thresholds and toggles do.
+    bool is_coalescable(int axis_index);
+
     bind& create_new_bind(enum bind::action action = bind::KEY);
-    bind& get_bind(unsigned i);
     const bind& get_bind(unsigned i) const;
+    void set_bind(unsigned i, const bind& b);
     const std::vector<bind>& get_binds() const;
     // 1 - move up
     // 0 - keep
@@ -251,6 +271,8 @@ private:
         const bind& b,
         double input_value
     );
+    // Rebuilds the lists of binds triggered by each axis and button.
+    void update_index();
 
     bool write_lock;
     std::string name;
@@ -258,6 +280,12 @@ private:
     std::string device_type, device_name;
     std::vector<bind> binds;
     control_state::action_id id_counter;
+
+    // Indices of the binds each axis and button triggers, in bind order.
+    // Changes only mark the index outdated and act() rebuilds it when needed.
+    std::vector<std::vector<unsigned>> axis_binds, button_binds;
+    std::vector<bool> axis_coalescable;
+    bool index_outdated;
 };
 
 #endif
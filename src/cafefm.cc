@@ -28,13 +28,14 @@
 #include <stdexcept>
 #include <string>
 #include <cstring>
+#include <algorithm>
 
 /* Significant parts related to GUI rendering copied from here (public domain):
  * https://github.com/vurtun/nuklear/blob/2891c6afbc5781b700cbad6f6d771f1f214f6b56/demo/sdl_opengl3/main.c
  */
 #define MAX_VERTEX_MEMORY 512 * 1024
 #define MAX_ELEMENT_MEMORY 128 * 1024
-#define CARRIER_HEIGHT 120
+#define CARRIER_HEIGHT 190
 #define INSTRUMENT_HEADER_HEIGHT 110
 #define LOOPS_HEADER_HEIGHT 40
 #define LOOP_HEIGHT 40
@@ -42,7 +43,14 @@
 #define MIN_WINDOW_HEIGHT 600
 #define MAX_BINDING_NAME_LENGTH 128
 #define MAX_INSTRUMENT_NAME_LENGTH 128
+#define MAX_IMPULSE_RESPONSE_PATH_LENGTH 512
 #define SIDE_PLUS_SIZE 0.05
+// Range of notes that can be picked for keys in the GUI.
+#define MIN_KEY_SEMITONE -45
+#define KEY_COUNT 96
+// Startup glitches after opening the stream don't count as xruns for
+// adaptive latency during this time.
+#define LATENCY_SETTLE_MS 2000
 
 using namespace std::string_literals;
 
@@ -243,6 +251,43 @@ namespace
         nk_fill_rect(out, inner, style->rounding, c);
     }
 
+    // Returns true if a note was picked.
+    bool note_combo(struct nk_context* ctx, int& semitone, float width)
+    {
+        static const std::vector<std::string> note_list = generate_note_list(
+            MIN_KEY_SEMITONE, MIN_KEY_SEMITONE + KEY_COUNT
+        );
+
+        std::string note_name = generate_semitone_name(semitone);
+        bool picked = false;
+
+        bool was_open = ctx->current->popup.win;
+        if(nk_combo_begin_label(ctx, note_name.c_str(), nk_vec2(width, -200)))
+        {
+            nk_layout_row_dynamic(ctx, 30, 1);
+            unsigned match_i = 0;
+            for(unsigned i = 0; i < note_list.size(); ++i)
+            {
+                if(note_list[i] == note_name) match_i = i;
+                if(nk_combo_item_label(
+                    ctx, note_list[i].c_str(), NK_TEXT_LEFT
+                )){
+                    semitone = MIN_KEY_SEMITONE + i;
+                    picked = true;
+                }
+            }
+
+            if(!was_open)
+            {
+                struct nk_window *win = ctx->current;
+                if(win) win->scrollbar.y = 34*match_i;
+            }
+
+            nk_combo_end(ctx);
+        }
+        return picked;
+    }
+
     constexpr const char* const protips[] = {
         "The modulator indices are only useful in bindings. They may change "
         "when you make modifications, so the same modulator may have a "
@@ -258,7 +303,7 @@ namespace
         "latency.",
         "Have multiple cores? Good for you.",
         "44100 is almost always enough. However, if you do hear artifacts with "
-        "high frequency noises, lifting the samplerate could help.",
+        "high frequency noises, oversampling in the options could help.",
         "The bit depth outputted by this program is 32 bits and cannot be "
         "changed.",
         "Looking for documentation? You're looking at it right now.",
@@ -267,6 +312,9 @@ namespace
         "not work on your system or this program.",
         "Oscillators shown horizontally are summed to each other, and in "
         "vertical configurations the one below is modulating the one above.",
+        "Right-click a modulator to let it modulate other oscillators too. "
+        "It's only shown below the first one, and its Mul and Div are "
+        "relative to that.",
         "Phase often has minimal effect on the sound, but may sometimes "
         "affect the perceived pitch and timbre slightly.",
         "Looking for keyboard shortcuts? Exhaustive list: Alt + F4.",
@@ -304,8 +352,9 @@ cafefm::cafefm()
 :   win(nullptr), bindings_delete_popup_open(false),
     instrument_delete_popup_open(false), save_recording_state(0),
     selected_controller(nullptr), controller_id_counter(0),
-    keyboard_grabbed(false), mouse_grabbed(false), master_volume(0.5),
-    vis(1024)
+    keyboard_grabbed(false), mouse_grabbed(false),
+    lowest_key(MIN_KEY_SEMITONE), highest_key(MIN_KEY_SEMITONE+KEY_COUNT-1),
+    master_volume(0.5), vis(1024), input_should_quit(false)
 {
     SDL_GL_SetAttribute(
         SDL_GL_CONTEXT_FLAGS,
@@ -502,10 +551,26 @@ void cafefm::load()
     }
 
     previous_update_time = std::chrono::steady_clock::now();
+    previous_latency_check = previous_update_time;
+    base_latency = -1;
+    adapted_latency = -1;
+    latency_pending = false;
+    xrun_intervals = 0;
+    quiet_intervals = 0;
+
+    start_input_thread();
 }
 
 void cafefm::unload()
 {
+    stop_input_thread();
+    if(calibration_thread)
+    {
+        calibration_thread->join();
+        calibration_thread.reset();
+        calibration_instrument.reset();
+    }
+
     selected_controller = nullptr;
 
     available_controllers.clear();
@@ -559,21 +624,17 @@ bool cafefm::update()
     auto cb = [this](
         controller* c, int axis_index, int button_index
     ){
-        for(auto& data: available_controllers)
-        {
-            if(data->active && data->controller.get() == c)
-            {
-                handle_controller(data.get(), axis_index, button_index);
-                break;
-            }
-        }
+        handle_controller_change(c, axis_index, button_index);
     };
 
     // Handle controllers that poll themselves
     for(unsigned i = 0; i < available_controllers.size(); ++i)
     {
         auto& c = available_controllers[i];
-        if(!c->controller->poll(cb, c->active)) disconnect_controller(i);
+        std::unique_lock<std::mutex> lock(control_mutex);
+        bool connected = c->controller->poll(cb, c->active);
+        lock.unlock();
+        if(!connected) disconnect_controller(i);
     }
 
     // Handle SDL-related controllers
@@ -641,21 +702,44 @@ bool cafefm::update()
         for(unsigned i = 0; i < available_controllers.size(); ++i)
         {
             auto& c = available_controllers[i];
-            if(!c->controller->handle_event(e, cb)) disconnect_controller(i);
+            std::unique_lock<std::mutex> lock(control_mutex);
+            bool connected = c->controller->handle_event(e, cb);
+            lock.unlock();
+            if(!connected) disconnect_controller(i);
         }
 
         if(!handled) nk_sdl_handle_event(&e);
     }
 
     // Apply controls
-    for(auto& data: available_controllers)
     {
-        if(data->active) control.update(data->id, data->binds, dt);
+        std::unique_lock<std::mutex> lock(control_mutex);
+        for(auto& data: available_controllers)
+        {
+            dispatch_pending_axes(data.get());
+            if(data->active) control.update(data->id, data->binds, dt);
+        }
+        apply_controls();
     }
-    control.apply(*fm, master_volume, ins_state);
+    output->get_effects().flush();
+
+    output->flush_instrument();
+    for(auto it = retired_mixers.begin(); it != retired_mixers.end();)
+    {
+        if(output->is_using(*it->mixer)) ++it;
+        else it = retired_mixers.erase(it);
+    }
+
+    finish_calibration();
+    if(opts.adaptive_latency && !calibration_thread) adapt_latency();
     return !quit;
 }
 
+bool cafefm::is_idle() const
+{
+    return output && output->is_idle();
+}
+
 void cafefm::handle_controller(
     controller_data* c, int axis_index, int button_index
 ){
@@ -679,6 +763,21 @@ void cafefm::handle_controller(
         ) latest_input_axis = axis_index;
     }
 
+    // Continuous axes can change far more often than the changes are used,
+    // so they're only acted on once per dispatch. Buttons and edges of axes
+    // are still handled one by one, in order.
+    if(button_index < 0 && c->binds.is_coalescable(axis_index))
+    {
+        if(axis_index >= (int)c->axis_pending.size())
+            c->axis_pending.resize(axis_index+1, false);
+        if(!c->axis_pending[axis_index])
+        {
+            c->axis_pending[axis_index] = true;
+            c->pending_axes.push_back(axis_index);
+        }
+        return;
+    }
+
     c->binds.act(
         c->controller.get(),
         c->id,
@@ -689,6 +788,127 @@ void cafefm::handle_controller(
     );
 }
 
+void cafefm::handle_controller_change(
+    controller* c, int axis_index, int button_index
+){
+    for(auto& data: available_controllers)
+    {
+        if(data->active && data->controller.get() == c)
+        {
+            handle_controller(data.get(), axis_index, button_index);
+            break;
+        }
+    }
+}
+
+void cafefm::dispatch_pending_axes(controller_data* c)
+{
+    for(int axis_index: c->pending_axes)
+    {
+        c->axis_pending[axis_index] = false;
+        if(!c->active) continue;
+        c->binds.act(
+            c->controller.get(),
+            c->id,
+            control,
+            output ? &output->get_looper() : nullptr,
+            axis_index,
+            -1
+        );
+    }
+    c->pending_axes.clear();
+}
+
+void cafefm::apply_controls()
+{
+    for(applied_part& p: applied_parts)
+        control.apply(*p.ins, applied_master_volume, p.state);
+    control.apply_keys(*mixer);
+}
+
+void cafefm::update_applied_parts()
+{
+    applied_parts.resize(extra_parts.size() + 1);
+    applied_parts[0].ins = fm.get();
+    applied_parts[0].state = ins_state;
+    for(unsigned i = 0; i < extra_parts.size(); ++i)
+    {
+        applied_parts[i+1].ins = extra_parts[i].ins.get();
+        applied_parts[i+1].state = extra_parts[i].state;
+    }
+    applied_master_volume = master_volume;
+}
+
+void cafefm::start_input_thread()
+{
+    input_should_quit = false;
+    input_thread.reset(new std::thread(&cafefm::input_handler, this));
+}
+
+void cafefm::stop_input_thread()
+{
+    if(!input_thread) return;
+    {
+        std::unique_lock<std::mutex> lock(input_mutex);
+        input_should_quit = true;
+    }
+    input_cv.notify_one();
+    input_thread->join();
+    input_thread.reset();
+}
+
+void cafefm::notify_input(controller* c)
+{
+    {
+        std::unique_lock<std::mutex> lock(input_mutex);
+        if(std::find(
+            input_controllers.begin(), input_controllers.end(), c
+        ) == input_controllers.end()) input_controllers.push_back(c);
+    }
+    input_cv.notify_one();
+}
+
+void cafefm::input_handler()
+{
+    auto cb = [this](
+        controller* c, int axis_index, int button_index
+    ){
+        handle_controller_change(c, axis_index, button_index);
+    };
+
+    std::vector<controller*> notified;
+    std::unique_lock<std::mutex> lock(input_mutex);
+    for(;;)
+    {
+        input_cv.wait(lock, [&]{
+            return input_should_quit || input_controllers.size();
+        });
+        if(input_should_quit) return;
+        notified.swap(input_controllers);
+        lock.unlock();
+
+        {
+            std::unique_lock<std::mutex> control_lock(control_mutex);
+            // The controller may have been disconnected since it notified.
+            // Disconnections are left for update() to handle.
+            for(controller* c: notified)
+            {
+                for(auto& data: available_controllers)
+                {
+                    if(data->controller.get() != c) continue;
+                    c->poll(cb, data->active);
+                    dispatch_pending_axes(data.get());
+                    break;
+                }
+            }
+            apply_controls();
+        }
+
+        notified.clear();
+        lock.lock();
+    }
+}
+
 void cafefm::gui_keyboard_grab()
 {
     nk_style_set_font(ctx, &medium_font->handle);
@@ -854,22 +1074,43 @@ unsigned cafefm::gui_adsr()
         nk_style_set_font(ctx, &small_font->handle);
         if(nk_group_begin(ctx, "Carrier Waveform", NK_WINDOW_NO_SCROLLBAR))
         {
-            nk_layout_row_dynamic(ctx, 30, 1);
+            nk_layout_row_template_begin(ctx, 30);
+            nk_layout_row_template_push_dynamic(ctx);
+            nk_layout_row_template_push_static(ctx, 90);
+            nk_layout_row_template_end(ctx);
             int new_polyphony = nk_propertyi(
                 ctx,
                 "#Polyphony",
                 1,
                 ins_state.polyphony,
-                64, 1, 1
+                fm->get_max_polyphony(), 1, 1
             );
             if((unsigned)new_polyphony != ins_state.polyphony)
             {
-                output->stop();
                 ins_state.polyphony = new_polyphony;
+                std::unique_lock<std::mutex> lock(control_mutex);
                 fm->set_polyphony(ins_state.polyphony);
-                output->start();
             }
 
+            // Which voice is replaced when all are in use.
+            static const char* const stealing_strings[] = {
+                "Oldest", "Quietest", "Retrigger"
+            };
+            voice_allocator::policy stealing =
+                (voice_allocator::policy)nk_combo(
+                    ctx, stealing_strings,
+                    sizeof(stealing_strings)/sizeof(*stealing_strings),
+                    ins_state.voice_stealing, 25, nk_vec2(90, 200)
+                );
+            if(stealing != ins_state.voice_stealing)
+            {
+                ins_state.voice_stealing = stealing;
+                std::unique_lock<std::mutex> lock(control_mutex);
+                fm->set_voice_stealing(stealing);
+            }
+
+            nk_layout_row_dynamic(ctx, 30, 1);
+            double old_tuning = ins_state.tuning_frequency;
             nk_property_double(
                 ctx,
                 "#Tuning (Hz)",
@@ -877,6 +1118,34 @@ unsigned cafefm::gui_adsr()
                 &ins_state.tuning_frequency,
                 880.0f, 0.5f, 0.5f, 1
             );
+            if(ins_state.tuning_frequency != old_tuning)
+                mask |= CHANGE_REQUIRE_APPLY;
+
+            // Changing the number of copies needs new voices, but the
+            // detune can be changed while playing.
+            nk_layout_row_template_begin(ctx, 30);
+            nk_layout_row_template_push_static(ctx, 110);
+            nk_layout_row_template_push_dynamic(ctx);
+            nk_layout_row_template_end(ctx);
+            int new_unison = nk_propertyi(
+                ctx, "#Unison", 1, ins_state.unison,
+                fm_instrument::MAX_UNISON, 1, 0.2f
+            );
+            if((unsigned)new_unison != ins_state.unison)
+            {
+                ins_state.unison = new_unison;
+                mask |= CHANGE_REQUIRE_RESET;
+            }
+            double detune = fixed_propertyd(
+                ctx, "#Detune (cents)", 0, ins_state.unison_detune, 100.0,
+                1.0, 0.1, 1
+            );
+            if(detune != ins_state.unison_detune)
+            {
+                ins_state.unison_detune = detune;
+                std::unique_lock<std::mutex> lock(control_mutex);
+                fm->set_unison(fm->get_unison(), detune);
+            }
 
             nk_layout_row_template_begin(ctx, 30);
             nk_layout_row_template_push_static(ctx, 90);
@@ -885,12 +1154,30 @@ unsigned cafefm::gui_adsr()
             nk_label(ctx, "Modulation:", NK_TEXT_LEFT);
             mask |= gui_modulation_mode();
 
+            // Shown in decibels, since the useful range spans several
+            // orders of magnitude. The minimum turns it off.
+            nk_layout_row_dynamic(ctx, 30, 1);
+            double error = ins_state.synth.get_max_control_error();
+            int error_db = error > 0 ? round(20.0 * log10(error)) : -120;
+            int new_error_db = nk_propertyi(
+                ctx, "#LFO error (dB)", -120, error_db, -20, 1, 0.2f
+            );
+            if(new_error_db != error_db)
+            {
+                ins_state.synth.set_max_control_error(
+                    new_error_db <= -120 ? 0.0 : pow(10.0, new_error_db/20.0)
+                );
+                mask |= CHANGE_REQUIRE_IMPORT;
+            }
+
             nk_group_end(ctx);
         }
 
         // ADSR controls
         if(nk_group_begin(ctx, "Carrier ADSR Control", NK_WINDOW_NO_SCROLLBAR))
         {
+            envelope old_adsr = ins_state.adsr;
+
             nk_layout_row_template_begin(ctx, 22);
             nk_layout_row_template_push_static(ctx, 110);
             nk_layout_row_template_push_dynamic(ctx);
@@ -927,6 +1214,8 @@ unsigned cafefm::gui_adsr()
             );
             ins_state.adsr.release_length = pow(release, expt)*opts.samplerate;
 
+            if(!(ins_state.adsr == old_adsr)) mask |= CHANGE_REQUIRE_APPLY;
+
             nk_group_end(ctx);
         }
 
@@ -957,7 +1246,7 @@ unsigned cafefm::gui_filter()
         nk_layout_row_template_begin(ctx, 30);
         nk_layout_row_template_push_static(ctx, 45);
         nk_layout_row_template_push_static(ctx, 120);
-        int max_order = 12;
+        int max_order = 16;
         switch(ins_state.filter.type)
         {
         case filter_state::NONE:
@@ -968,13 +1257,13 @@ unsigned cafefm::gui_filter()
             nk_layout_row_template_push_static(ctx, 140);
             break;
         case filter_state::BAND_PASS:
-            max_order = 4;
+            max_order = 8;
             nk_layout_row_template_push_static(ctx, 140);
             nk_layout_row_template_push_static(ctx, 140);
             nk_layout_row_template_push_static(ctx, 140);
             break;
         case filter_state::BAND_STOP:
-            max_order = 4;
+            max_order = 8;
             nk_layout_row_template_push_static(ctx, 140);
             nk_layout_row_template_push_static(ctx, 140);
             nk_layout_row_template_push_static(ctx, 140);
@@ -1043,6 +1332,252 @@ unsigned cafefm::gui_filter()
         }
         nk_group_end(ctx);
     }
+
+    voice_filter_state& vf = ins_state.voice_filter;
+    nk_layout_row_dynamic(ctx, 40, 1);
+    if(nk_group_begin(
+        ctx, "Voice filter", NK_WINDOW_NO_SCROLLBAR|NK_WINDOW_BORDER
+    )){
+        nk_layout_row_template_begin(ctx, 30);
+        nk_layout_row_template_push_static(ctx, 45);
+        nk_layout_row_template_push_static(ctx, 120);
+        if(vf.type != filter_state::NONE)
+        {
+            nk_layout_row_template_push_static(ctx, 140);
+            nk_layout_row_template_push_static(ctx, 140);
+            nk_layout_row_template_push_static(ctx, 140);
+        }
+        nk_layout_row_template_end(ctx);
+
+        nk_label(ctx, "Voice:", NK_TEXT_LEFT);
+
+        filter_state::filter_type old_type = vf.type;
+        vf.type = (filter_state::filter_type)nk_combo(
+            ctx,
+            filter_labels,
+            sizeof(filter_labels)/sizeof(const char*),
+            old_type,
+            20,
+            nk_vec2(120, 200)
+        );
+        if(vf.type != old_type) mask |= CHANGE_REQUIRE_IMPORT;
+
+        if(vf.type != filter_state::NONE)
+        {
+            double new_key_track = fixed_propertyd(
+                ctx, "#Key track", 0.25, vf.key_track, 64.0, 0.25, 0.05, 2
+            );
+            double new_envelope_depth = fixed_propertyd(
+                ctx, "#Envelope", -8.0, vf.envelope_depth, 8.0, 0.25, 0.05, 2
+            );
+            double new_resonance = fixed_propertyd(
+                ctx, "#Resonance", 0.1, vf.resonance, 20.0, 0.1, 0.02, 2
+            );
+            if(
+                new_key_track != vf.key_track ||
+                new_envelope_depth != vf.envelope_depth ||
+                new_resonance != vf.resonance
+            ){
+                vf.key_track = new_key_track;
+                vf.envelope_depth = new_envelope_depth;
+                vf.resonance = new_resonance;
+                mask |= CHANGE_REQUIRE_IMPORT;
+            }
+        }
+        nk_group_end(ctx);
+    }
+    return mask;
+}
+
+unsigned cafefm::gui_effects()
+{
+    unsigned mask = CHANGE_NONE;
+    effects_state& fx = ins_state.effects;
+    effects_state old_fx = fx;
+
+    nk_layout_row_dynamic(ctx, 153, 1);
+    if(nk_group_begin(
+        ctx, "Effects", NK_WINDOW_NO_SCROLLBAR|NK_WINDOW_BORDER
+    )){
+        nk_layout_row_template_begin(ctx, 30);
+        nk_layout_row_template_push_static(ctx, 90);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_end(ctx);
+
+        fx.delay.enabled = !nk_check_label(ctx, "Delay", !fx.delay.enabled);
+        fx.delay.time = fixed_propertyd(
+            ctx, "#Time", 0.01, fx.delay.time,
+            effects_chain::MAX_DELAY_TIME, 0.01, 0.005
+        );
+        fx.delay.feedback = fixed_propertyd(
+            ctx, "#Feedback", 0, fx.delay.feedback, 0.95, 0.05, 0.01
+        );
+        fx.delay.mix = fixed_propertyd(
+            ctx, "#Mix", 0, fx.delay.mix, 1.0, 0.05, 0.01
+        );
+        nk_label(ctx, "", NK_TEXT_LEFT);
+
+        fx.chorus.enabled = !nk_check_label(
+            ctx, "Chorus", !fx.chorus.enabled
+        );
+        fx.chorus.rate = fixed_propertyd(
+            ctx, "#Rate", 0.05, fx.chorus.rate, 10.0, 0.05, 0.01
+        );
+        fx.chorus.depth = fixed_propertyd(
+            ctx, "#Depth", 0, fx.chorus.depth,
+            effects_chain::MAX_CHORUS_DEPTH, 0.001, 0.0001, 4
+        );
+        fx.chorus.mix = fixed_propertyd(
+            ctx, "#Mix", 0, fx.chorus.mix, 1.0, 0.05, 0.01
+        );
+        nk_label(ctx, "", NK_TEXT_LEFT);
+
+        fx.reverb.enabled = !nk_check_label(
+            ctx, "Reverb", !fx.reverb.enabled
+        );
+        fx.reverb.size = fixed_propertyd(
+            ctx, "#Size", 0.1, fx.reverb.size,
+            effects_chain::MAX_REVERB_SIZE, 0.05, 0.01
+        );
+        fx.reverb.decay = fixed_propertyd(
+            ctx, "#Decay", 0.1, fx.reverb.decay, 20.0, 0.1, 0.01
+        );
+        fx.reverb.damping = fixed_propertyd(
+            ctx, "#Damping", 0, fx.reverb.damping, 0.95, 0.05, 0.01
+        );
+        fx.reverb.mix = fixed_propertyd(
+            ctx, "#Mix", 0, fx.reverb.mix, 1.0, 0.05, 0.01
+        );
+
+        nk_layout_row_template_begin(ctx, 30);
+        nk_layout_row_template_push_static(ctx, 90);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_dynamic(ctx);
+        nk_layout_row_template_push_static(ctx, 60);
+        nk_layout_row_template_end(ctx);
+
+        fx.convolution.enabled = !nk_check_label(
+            ctx, "Convolve", !fx.convolution.enabled
+        );
+        fx.convolution.mix = fixed_propertyd(
+            ctx, "#Mix", 0, fx.convolution.mix, 1.0, 0.05, 0.01
+        );
+        fx.convolution.non_uniform = !nk_check_label(
+            ctx, "Non-uniform", !fx.convolution.non_uniform
+        );
+
+        char path[MAX_IMPULSE_RESPONSE_PATH_LENGTH+1] = {0};
+        int path_len = std::min(
+            impulse_response_input.size(),
+            (size_t)MAX_IMPULSE_RESPONSE_PATH_LENGTH
+        );
+        strncpy(
+            path, impulse_response_input.c_str(),
+            MAX_IMPULSE_RESPONSE_PATH_LENGTH
+        );
+        nk_flags flags = nk_edit_string(
+            ctx, NK_EDIT_FIELD|NK_EDIT_SIG_ENTER, path, &path_len,
+            MAX_IMPULSE_RESPONSE_PATH_LENGTH, nk_filter_default
+        );
+        impulse_response_input = std::string(path, path_len);
+
+        if(
+            nk_button_label(ctx, "Load") ||
+            (flags & NK_EDIT_COMMITED)
+        ) fx.convolution.impulse_response = impulse_response_input;
+
+        nk_group_end(ctx);
+    }
+
+    if(fx != old_fx) mask |= CHANGE_REQUIRE_EFFECTS;
+    return mask;
+}
+
+unsigned cafefm::gui_parts()
+{
+    unsigned mask = CHANGE_NONE;
+    bool ranges_changed = false;
+    int erase_index = -1;
+
+    nk_layout_row_dynamic(ctx, 58 + 34 * extra_parts.size(), 1);
+    if(nk_group_begin(
+        ctx, "Parts", NK_WINDOW_NO_SCROLLBAR|NK_WINDOW_BORDER
+    )){
+        nk_layout_row_template_begin(ctx, 30);
+        nk_layout_row_template_push_dynamic(ctx);
+        nk_layout_row_template_push_static(ctx, 80);
+        nk_layout_row_template_push_static(ctx, 80);
+        nk_layout_row_template_push_static(ctx, 90);
+        nk_layout_row_template_push_static(ctx, 30);
+        nk_layout_row_template_end(ctx);
+
+        nk_label(ctx, "This instrument", NK_TEXT_LEFT);
+        ranges_changed |= note_combo(ctx, lowest_key, 80);
+        ranges_changed |= note_combo(ctx, highest_key, 80);
+        if(nk_button_label(ctx, "Add layer"))
+        {
+            part_data p;
+            p.state = ins_state;
+            p.lowest_key = MIN_KEY_SEMITONE;
+            p.highest_key = MIN_KEY_SEMITONE + KEY_COUNT - 1;
+            p.threaded = false;
+            extra_parts.emplace_back(std::move(p));
+            mask |= CHANGE_REQUIRE_RESET;
+        }
+        nk_label(ctx, "", NK_TEXT_LEFT);
+
+        for(unsigned i = 0; i < extra_parts.size(); ++i)
+        {
+            part_data& p = extra_parts[i];
+            if(nk_combo_begin_label(
+                ctx, p.state.name.c_str(), nk_vec2(ww-400, 200)
+            )){
+                for(const instrument_state& s: all_instruments)
+                {
+                    nk_layout_row_dynamic(ctx, 25, 1);
+                    if(nk_combo_item_label(
+                        ctx, s.name.c_str(), NK_TEXT_ALIGN_LEFT
+                    )){
+                        p.state = s;
+                        mask |= CHANGE_REQUIRE_RESET;
+                    }
+                }
+                nk_combo_end(ctx);
+            }
+
+            ranges_changed |= note_combo(ctx, p.lowest_key, 80);
+            ranges_changed |= note_combo(ctx, p.highest_key, 80);
+
+            bool threaded = !nk_check_label(ctx, "Thread", !p.threaded);
+            if(threaded != p.threaded)
+            {
+                p.threaded = threaded;
+                mask |= CHANGE_REQUIRE_RESET;
+            }
+
+            if(nk_button_label(ctx, "x")) erase_index = i;
+        }
+
+        nk_group_end(ctx);
+    }
+
+    if(erase_index >= 0)
+    {
+        drop_part(erase_index);
+        mask |= CHANGE_REQUIRE_RESET;
+    }
+    else if(ranges_changed && !(mask & CHANGE_REQUIRE_RESET))
+    {
+        std::unique_lock<std::mutex> lock(control_mutex);
+        update_part_ranges();
+    }
+
+    if(ranges_changed || (mask & CHANGE_REQUIRE_RESET)) store_parts();
+
     return mask;
 }
 
@@ -1154,6 +1689,61 @@ unsigned cafefm::gui_oscillator(
     return mask;
 }
 
+unsigned cafefm::gui_modulator_links(unsigned index, struct nk_rect bounds)
+{
+    unsigned mask = CHANGE_NONE;
+    fm_synth& synth = ins_state.synth;
+    if(!nk_contextual_begin(ctx, 0, nk_vec2(200, 300), bounds)) return mask;
+
+    // Oscillators that this one depends on can't be modulated by it.
+    std::vector<bool> blocked(synth.get_oscillator_count(), false);
+    std::vector<unsigned> stack = {index};
+    while(!stack.empty())
+    {
+        unsigned i = stack.back();
+        stack.pop_back();
+        if(blocked[i]) continue;
+        blocked[i] = true;
+        for(unsigned m: synth.get_oscillator(i).get_modulators())
+            stack.push_back(m);
+    }
+
+    unsigned parents = 0;
+    for(unsigned i = 0; i < synth.get_oscillator_count(); ++i)
+    {
+        const std::vector<unsigned>& mods =
+            synth.get_oscillator(i).get_modulators();
+        if(std::find(mods.begin(), mods.end(), index) != mods.end())
+            parents++;
+    }
+
+    nk_layout_row_dynamic(ctx, 25, 1);
+    nk_label(ctx, "Also modulates:", NK_TEXT_LEFT);
+    const std::vector<unsigned>& carriers = synth.get_carriers();
+    for(unsigned i = 0; i < synth.get_oscillator_count(); ++i)
+    {
+        if(blocked[i]) continue;
+        std::vector<unsigned>& mods = synth.get_oscillator(i).get_modulators();
+        auto it = std::find(mods.begin(), mods.end(), index);
+        bool linked = it != mods.end();
+        bool is_carrier =
+            std::find(carriers.begin(), carriers.end(), i) != carriers.end();
+        std::string label = (is_carrier ? "Carrier " : "Modulator ")
+            + std::to_string(i);
+        bool new_linked = !nk_check_label(ctx, label.c_str(), !linked);
+
+        // The last link can't be removed here, close the oscillator instead.
+        if(new_linked == linked || (linked && parents == 1)) continue;
+        if(new_linked) mods.push_back(index);
+        else mods.erase(it);
+        mask |= CHANGE_REQUIRE_FINISH | CHANGE_REQUIRE_IMPORT;
+        nk_contextual_close(ctx);
+        break;
+    }
+    nk_contextual_end(ctx);
+    return mask;
+}
+
 void cafefm::gui_instrument_editor()
 {
     unsigned mask = CHANGE_NONE;
@@ -1198,7 +1788,8 @@ void cafefm::gui_instrument_editor()
 
         if(nk_button_label(ctx, "Reset"))
         {
-            fm->release_all_voices();
+            std::unique_lock<std::mutex> lock(control_mutex);
+            mixer->release_all_voices();
             control.reset(selected_controller->id);
         }
 
@@ -1292,7 +1883,8 @@ void cafefm::gui_instrument_editor()
         nk_layout_row_template_end(ctx);
 
         nk_labelf(ctx, NK_TEXT_LEFT, "Master volume: %.2f", master_volume);
-        nk_slider_float(ctx, 0, &master_volume, 1.0f, 0.01f);
+        if(nk_slider_float(ctx, 0, &master_volume, 1.0f, 0.01f))
+            mask |= CHANGE_REQUIRE_APPLY;
 
         if(
             save_recording_state == 1 &&
@@ -1389,10 +1981,17 @@ void cafefm::gui_instrument_editor()
         // Filter
         mask |= gui_filter();
 
+        // Effects
+        mask |= gui_effects();
+
+        // Layers and splits
+        mask |= gui_parts();
+
         fm_synth::layout layout = ins_state.synth.generate_layout();
 
         int erase_index = -1;
         int add_parent = -2;
+        unsigned link_changes = CHANGE_NONE;
         int min_osc_width = 150;
         unsigned max_row_osc = ww/min_osc_width;
         std::map<int, double> modulator_width;
@@ -1456,6 +2055,7 @@ void cafefm::gui_instrument_editor()
                     {
                         modulator_width[m] = width;
                         nk_layout_row_push(ctx, width);
+                        struct nk_rect bounds = nk_widget_bounds(ctx);
                         bool erase = false;
                         mask |= gui_oscillator(
                             ins_state.synth.get_oscillator(m),
@@ -1467,6 +2067,8 @@ void cafefm::gui_instrument_editor()
                             l != 0 || group.oscillators.size() > 1
                         );
                         if(erase) erase_index = m;
+                        else if(l != 0 && link_changes == CHANGE_NONE)
+                            link_changes = gui_modulator_links(m, bounds);
                     }
                     if(has_side_plus)
                     {
@@ -1507,6 +2109,7 @@ void cafefm::gui_instrument_editor()
         }
 
         if(erase_index >= 0) ins_state.synth.erase_oscillator(erase_index);
+        mask |= link_changes;
 
         nk_group_end(ctx);
     }
@@ -1515,15 +2118,23 @@ void cafefm::gui_instrument_editor()
     if(mask & CHANGE_REQUIRE_FINISH)
         ins_state.synth.finish_changes();
 
-    if(mask & CHANGE_REQUIRE_IMPORT)
+    if(mask & (CHANGE_REQUIRE_IMPORT | CHANGE_REQUIRE_APPLY))
     {
-        control.apply(*fm, master_volume, ins_state);
-        fm->refresh_all_voices();
+        std::unique_lock<std::mutex> lock(control_mutex);
+        update_applied_parts();
+        if(mask & CHANGE_REQUIRE_IMPORT)
+        {
+            control.apply(*fm, master_volume, ins_state);
+            fm->refresh_all_voices();
+        }
     }
 
     if(mask & CHANGE_REQUIRE_RESET)
         reset_fm();
 
+    if(mask & CHANGE_REQUIRE_EFFECTS)
+        update_effects();
+
     if(mask)
     {
         ins_state.synth.update_period_lookup();
@@ -1560,15 +2171,15 @@ void cafefm::gui_bind_action_template(bind& b)
         nk_layout_row_template_push_static(ctx, 90);
         nk_layout_row_template_push_static(ctx, 90);
         break;
+    case bind::FILTER_ADJUST:
+        nk_layout_row_template_push_static(ctx, 90);
+        nk_layout_row_template_push_static(ctx, 150);
+        break;
     }
 }
 
 void cafefm::gui_bind_action(bind& b)
 {
-    static constexpr int min_semitone = -45;
-    static const std::vector<std::string> note_list =
-        generate_note_list(min_semitone, min_semitone + 96);
-
     static const char* envelope_index_names[] = {
         "Attack", "Decay", "Sustain", "Release"
     };
@@ -1577,34 +2188,14 @@ void cafefm::gui_bind_action(bind& b)
         "Record", "Clear", "Mute"
     };
 
+    static const char* filter_index_names[] = {
+        "Cutoff", "Resonance"
+    };
+
     switch(b.action)
     {
     case bind::KEY:
-        {
-            std::string note_name = generate_semitone_name(b.key_semitone);
-
-            bool was_open = ctx->current->popup.win;
-            if(nk_combo_begin_label(ctx, note_name.c_str(), nk_vec2(80, -200)))
-            {
-                nk_layout_row_dynamic(ctx, 30, 1);
-                unsigned match_i = 0;
-                for(unsigned i = 0; i < note_list.size(); ++i)
-                {
-                    if(note_list[i] == note_name) match_i = i;
-                    if(nk_combo_item_label(
-                        ctx, note_list[i].c_str(), NK_TEXT_LEFT
-                    )) b.key_semitone = min_semitone + i;
-                }
-
-                if(!was_open)
-                {
-                    struct nk_window *win = ctx->current;
-                    if(win) win->scrollbar.y = 34*match_i;
-                }
-
-                nk_combo_end(ctx);
-            }
-        }
+        note_combo(ctx, b.key_semitone, 80);
         break;
     case bind::FREQUENCY_EXPT:
         nk_property_double(
@@ -1708,6 +2299,16 @@ void cafefm::gui_bind_action(bind& b)
             }
         }
         break;
+    case bind::FILTER_ADJUST:
+        nk_combobox(
+            ctx, filter_index_names,
+            sizeof(filter_index_names)/sizeof(*filter_index_names),
+            (int*)&b.filter.which, 20, nk_vec2(90, 55)
+        );
+        nk_property_double(
+            ctx, "#Multiplier:", 0, &b.filter.max_mul, 32.0, 0.5, 0.25, 2
+        );
+        break;
     }
 }
 
@@ -2000,9 +2601,11 @@ nk_color cafefm::gui_bind_background_color(bind& b)
     if(!selected_controller) return bg;
 
     nk_color active = nk_rgb(30,25,23);
+    std::unique_lock<std::mutex> lock(control_mutex);
     double value = fabs(b.get_value(
         control, selected_controller->controller.get(), selected_controller->id
     ));
+    lock.unlock();
     value = std::min(1.0, value);
     bg.r = round(lerp(bg.r, active.r, value));
     bg.g = round(lerp(bg.g, active.g, value));
@@ -2090,7 +2693,8 @@ void cafefm::gui_bindings_editor()
 
         if(nk_button_label(ctx, "Reset"))
         {
-            fm->release_all_voices();
+            std::unique_lock<std::mutex> lock(control_mutex);
+            mixer->release_all_voices();
             control.reset();
         }
         // Show manager (Grab Keyboard, etc.)
@@ -2259,10 +2863,13 @@ void cafefm::gui_bindings_editor()
     // Actual bindings section
     if(nk_group_begin(ctx, "Bindings Group", NK_WINDOW_BORDER))
     {
-        bindings& binds = selected_controller->binds;
-
         if(selected_controller->active)
         {
+            // Only this thread modifies the binds, so they can be read
+            // without locking. Each bind is edited on a copy, and only
+            // written back if it changed.
+            bindings& binds = selected_controller->binds;
+
             struct {
                 const char* title;
                 enum bind::action action;
@@ -2273,6 +2880,7 @@ void cafefm::gui_bindings_editor()
                 {"Modulator period", bind::PERIOD_FINE},
                 {"Modulator amplitude", bind::AMPLITUDE_MUL},
                 {"Envelope", bind::ENVELOPE_ADJUST},
+                {"Filter", bind::FILTER_ADJUST},
                 {"Loops", bind::LOOP_CONTROL}
             };
             unsigned id = 0;
@@ -2290,7 +2898,7 @@ void cafefm::gui_bindings_editor()
                     int movement = 0;
                     for(unsigned i = 0; i < binds.bind_count(); ++i)
                     {
-                        auto& b = binds.get_bind(i);
+                        bind b = binds.get_bind(i);
                         if(b.action != a.action) continue;
                         int ret = gui_bind(b, i);
                         if(ret != 0)
@@ -2298,9 +2906,15 @@ void cafefm::gui_bindings_editor()
                             changed_index = i;
                             movement = ret;
                         }
+                        if(b != binds.get_bind(i))
+                        {
+                            std::unique_lock<std::mutex> lock(control_mutex);
+                            binds.set_bind(i, b);
+                        }
                     }
                     if(movement)
                     {
+                        std::unique_lock<std::mutex> lock(control_mutex);
                         binds.move_bind(
                             changed_index,
                             movement,
@@ -2311,7 +2925,10 @@ void cafefm::gui_bindings_editor()
                     }
                     nk_style_set_font(ctx, &huge_font->handle);
                     if(nk_button_symbol(ctx, NK_SYMBOL_PLUS))
+                    {
+                        std::unique_lock<std::mutex> lock(control_mutex);
                         binds.create_new_bind(a.action);
+                    }
                     nk_style_set_font(ctx, &small_font->handle);
                     nk_tree_pop(ctx);
                 }
@@ -2475,7 +3092,8 @@ void cafefm::gui_loops_editor()
 
         if(nk_button_label(ctx, "Reset"))
         {
-            fm->release_all_voices();
+            std::unique_lock<std::mutex> lock(control_mutex);
+            mixer->release_all_voices();
             control.reset();
         }
 
@@ -2503,7 +3121,7 @@ void cafefm::gui_options_editor()
     static unsigned help_state = 0;
     static unsigned about_state = 0;
 
-    nk_layout_row_template_begin(ctx, 555);
+    nk_layout_row_template_begin(ctx, 657);
     nk_layout_row_template_push_dynamic(ctx);
     nk_layout_row_template_push_static(ctx, 600);
     nk_layout_row_template_push_dynamic(ctx);
@@ -2545,6 +3163,11 @@ void cafefm::gui_options_editor()
             opts.device_index < 0 ? 0 : opts.device_index, 25, nk_vec2(440, 200)
         );
 
+        if(
+            new_opts.system_index != opts.system_index ||
+            new_opts.device_index != opts.device_index
+        ) new_opts.use_calibrated_latency();
+
         nk_label(ctx, "Samplerate:", NK_TEXT_LEFT);
 
         std::vector<uint64_t> samplerates =
@@ -2572,6 +3195,97 @@ void cafefm::gui_options_editor()
         nk_property_int(ctx, "#Milliseconds:", 0, &milliseconds, 1000, 1, 1);
         new_opts.target_latency = milliseconds/1000.0;
 
+        nk_label(ctx, "Render block size:", NK_TEXT_LEFT);
+
+        static const char* const block_size_strings[] = {
+            "16", "32", "64", "128", "256", "512", "1024"
+        };
+        unsigned block_size_index = 0;
+        while(
+            (16u << block_size_index) < opts.block_size &&
+            block_size_index+1 <
+                sizeof(block_size_strings)/sizeof(*block_size_strings)
+        ) block_size_index++;
+
+        new_opts.block_size = 16u << nk_combo(
+            ctx, block_size_strings,
+            sizeof(block_size_strings)/sizeof(*block_size_strings),
+            block_size_index, 25, nk_vec2(440, 200)
+        );
+
+        nk_label(ctx, "Oversampling:", NK_TEXT_LEFT);
+
+        static const char* const oversampling_strings[] = {
+            "Off", "2x", "4x"
+        };
+        unsigned oversampling_index = 0;
+        while((1u << oversampling_index) < opts.oversampling)
+            oversampling_index++;
+
+        new_opts.oversampling = 1u << nk_combo(
+            ctx, oversampling_strings,
+            sizeof(oversampling_strings)/sizeof(*oversampling_strings),
+            std::min(oversampling_index, 2u), 25, nk_vec2(440, 200)
+        );
+
+        nk_layout_row_template_begin(ctx, 30);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_dynamic(ctx);
+        nk_layout_row_template_push_dynamic(ctx);
+        nk_layout_row_template_end(ctx);
+
+        nk_label(ctx, "Latency tuning:", NK_TEXT_LEFT);
+
+        new_opts.adaptive_latency = !nk_check_label(
+            ctx, "Adapt to xruns", !opts.adaptive_latency
+        );
+
+        if(calibration_thread)
+        {
+            std::string progress_str = "Calibrating: " + std::to_string(
+                (int)round(calibration_progress*100.0)
+            ) + "%";
+            nk_label(ctx, progress_str.c_str(), NK_TEXT_CENTERED);
+            new_opts = opts;
+        }
+        else if(nk_button_label(ctx, "Calibrate"))
+        {
+            calibrate_latency();
+            new_opts = opts;
+        }
+
+        nk_label(ctx, "Load governor:", NK_TEXT_LEFT);
+
+        int budget = round(opts.cpu_budget*100.0);
+        nk_property_int(ctx, "#Budget %:", 0, &budget, 100, 5, 1);
+        new_opts.cpu_budget = budget/100.0;
+
+        new_opts.sine_fallback = !nk_check_label(
+            ctx, "Sine fallback", !opts.sine_fallback
+        );
+
+        nk_layout_row_template_begin(ctx, 30);
+        nk_layout_row_template_push_static(ctx, 140);
+        nk_layout_row_template_push_dynamic(ctx);
+        nk_layout_row_template_end(ctx);
+
+        nk_label(ctx, "Output latency:", NK_TEXT_LEFT);
+
+        std::string latency_str =
+            std::to_string((int)round(output->get_latency()*1000.0))
+            + " ms (block: "
+            + std::to_string((int)round(output->get_block_latency()*1000.0))
+            + " ms)";
+        nk_label(ctx, latency_str.c_str(), NK_TEXT_LEFT);
+
+        nk_label(ctx, "Governor actions:", NK_TEXT_LEFT);
+
+        fm_instrument::governor_stats governor = fm->get_governor_stats();
+        std::string governor_str =
+            std::to_string(governor.culled_voices) + " voices culled, "
+            + std::to_string(governor.sine_blocks) + " blocks of sines";
+        nk_label(ctx, governor_str.c_str(), NK_TEXT_LEFT);
+
         nk_label(ctx, "Recording format:", NK_TEXT_LEFT);
 
         new_opts.recording_format = (encoder::format)nk_combo(
@@ -2834,9 +3548,15 @@ void cafefm::connect_controller(controller* c)
 {
     if(!c) return;
 
-    available_controllers.emplace_back(new controller_data {
-        std::unique_ptr<controller>(c),
-        controller_id_counter++, {}, -1, {}, false
+    {
+        std::unique_lock<std::mutex> lock(control_mutex);
+        available_controllers.emplace_back(new controller_data {
+            std::unique_ptr<controller>(c),
+            controller_id_counter++, {}, -1, {}, false, {}, {}
+        });
+    }
+    c->set_input_callback([this](controller* source){
+        notify_input(source);
     });
 
     update_bindings_presets();
@@ -2844,53 +3564,60 @@ void cafefm::connect_controller(controller* c)
 
 void cafefm::disconnect_controller(unsigned index)
 {
-    controller_data* data = available_controllers[index].get();
-    available_controllers.erase(available_controllers.begin() + index);
-    if(selected_controller == data)
+    // The controller is only destroyed once the lock is released.
+    std::unique_ptr<controller_data> data;
     {
+        std::unique_lock<std::mutex> lock(control_mutex);
+        data = std::move(available_controllers[index]);
+        available_controllers.erase(available_controllers.begin() + index);
+        if(selected_controller != data.get()) return;
         selected_controller = nullptr;
-        if(available_controllers.size() > 0)
-            select_controller(available_controllers[0].get());
     }
+    if(available_controllers.size() > 0)
+        select_controller(available_controllers[0].get());
 }
 
 void cafefm::select_controller(controller_data* c)
 {
     if(!c) return;
-    selected_controller = c;
+    {
+        std::unique_lock<std::mutex> lock(control_mutex);
+        selected_controller = c;
+    }
     update_bindings_presets();
 }
 
 void cafefm::select_controller_preset(controller_data* c, unsigned index)
 {
-    // If active already, clear state to avoid stuck modifiers and keys.
-    if(c->active)
-    {
-        fm->release_all_voices();
-        control.reset(c->id);
-    }
-    else c->active = true;
-
     if(c->presets.size() == 0)
     {
         c->selected_preset = -1;
         create_new_bindings(c);
+        return;
     }
-    else
+
+    std::unique_lock<std::mutex> lock(control_mutex);
+    // If active already, clear state to avoid stuck modifiers and keys.
+    if(c->active)
     {
-        c->selected_preset = std::min(
-            index,
-            (unsigned)c->presets.size()-1
-        );
-        c->binds = c->presets[c->selected_preset];
+        mixer->release_all_voices();
+        control.reset(c->id);
     }
+    else c->active = true;
+
+    c->selected_preset = std::min(
+        index,
+        (unsigned)c->presets.size()-1
+    );
+    c->binds = c->presets[c->selected_preset];
 }
 
 void cafefm::deactivate_controller(controller_data* c)
 {
     if(!c->active) return;
 
-    fm->release_all_voices();
+    std::unique_lock<std::mutex> lock(control_mutex);
+    mixer->release_all_voices();
     control.reset(c->id);
     c->selected_preset = -1;
     c->active = false;
@@ -2916,9 +3643,10 @@ void cafefm::save_current_bindings(controller_data* c)
 
 void cafefm::create_new_bindings(controller_data* c)
 {
+    std::unique_lock<std::mutex> lock(control_mutex);
     if(c->active)
     {
-        fm->release_all_voices();
+        mixer->release_all_voices();
         control.reset(c->id);
     }
     else c->active = true;
@@ -3007,6 +3735,7 @@ void cafefm::select_instrument(unsigned index)
         );
         ins_state = all_instruments[selected_instrument_preset];
         master_volume = 1.0/ins_state.polyphony;
+        load_parts();
         reset_fm();
     }
 }
@@ -3052,6 +3781,7 @@ void cafefm::create_new_instrument()
     }
     ins_state.name = modified_name;
     master_volume = 1.0/ins_state.polyphony;
+    load_parts();
 
     reset_fm();
 }
@@ -3080,36 +3810,352 @@ void cafefm::reset_fm(bool refresh_only)
     bool open_output = !refresh_only;
     if(!output || output->get_samplerate() != opts.samplerate)
     {
-        output.reset(new audio_output(opts.samplerate));
+        std::unique_ptr<audio_output> new_output(
+            new audio_output(opts.samplerate)
+        );
+        {
+            std::unique_lock<std::mutex> lock(control_mutex);
+            output.swap(new_output);
+        }
         open_output = true;
     }
     if(open_output)
-        output->open(opts.target_latency, opts.system_index, opts.device_index);
+    {
+        output->open(
+            get_stream_latency(),
+            opts.system_index,
+            opts.device_index,
+            opts.block_size
+        );
+        latency_pending = false;
+    }
 
     output->get_looper().set_record_on_sound(opts.start_loop_on_sound);
     output->get_looper().set_record_align(opts.align_loop_record);
 
-    std::unique_ptr<fm_instrument> new_fm;
-    
-    new_fm.reset(ins_state.create_instrument(opts.samplerate));
-    if(ins_state.filter.type != filter_state::NONE)
-        new_fm->set_filter(ins_state.filter.design(opts.samplerate));
-    new_fm->set_volume(master_volume);
+    auto create_part = [&](
+        instrument_state& state,
+        const fm_instrument* old_ins
+    ){
+        fm_instrument* ins = state.create_instrument(
+            opts.samplerate, opts.oversampling
+        );
+        if(state.filter.type != filter_state::NONE)
+            ins->set_filter(state.filter.design(opts.samplerate));
+        ins->set_volume(master_volume);
+        ins->set_cpu_budget(opts.cpu_budget, opts.sine_fallback);
+        if(old_ins) ins->copy_state(*old_ins);
+        return ins;
+    };
 
-    if(fm) new_fm->copy_state(*fm);
-    fm.swap(new_fm);
+    std::unique_lock<std::mutex> lock(control_mutex);
+
+    // The previous instruments keep playing until the new ones have faded
+    // in, so they're retired instead of freed.
+    retired_mixer old;
+    for(auto& ins: dropped_parts) old.parts.emplace_back(std::move(ins));
+    dropped_parts.clear();
+    old.parts.emplace_back(create_part(ins_state, fm.get()));
+    fm.swap(old.parts.back());
     control.apply(*fm, master_volume, ins_state);
 
-    output->stop();
-    output->set_instrument(*fm);
-    output->start();
+    for(part_data& p: extra_parts)
+    {
+        old.parts.emplace_back(create_part(p.state, p.ins.get()));
+        p.ins.swap(old.parts.back());
+        control.apply(*p.ins, master_volume, p.state);
+    }
+
+    std::unique_ptr<part_mixer> new_mixer(new part_mixer(opts.samplerate));
+    new_mixer->add_part(*fm);
+    for(part_data& p: extra_parts)
+        new_mixer->add_part(*p.ins, INT_MIN, INT_MAX, p.threaded);
+    if(mixer)
+    {
+        // Keeps the keys that are held, so that releasing them still works.
+        // The parts only keep playing their notes if they're still the same
+        // parts.
+        new_mixer->copy_state(*mixer);
+        if(
+            mixer->get_samplerate() != opts.samplerate ||
+            mixer->get_part_count() != new_mixer->get_part_count()
+        ) new_mixer->release_all_voices();
+    }
+    mixer.swap(new_mixer);
+    old.mixer.swap(new_mixer);
+    update_part_ranges();
+    update_applied_parts();
+    lock.unlock();
+
+    impulse_response_input = ins_state.effects.convolution.impulse_response;
+    update_effects();
+
+    output->set_instrument(*mixer);
+    if(open_output)
+    {
+        output->start();
+        latency_settled_time = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(LATENCY_SETTLE_MS);
+    }
+    if(old.mixer) retired_mixers.emplace_back(std::move(old));
 
     ins_state.synth.update_period_lookup();
     vis.start_update(ins_state.synth);
 }
 
+void cafefm::update_part_ranges()
+{
+    // Keys outside the range of the GUI are played by the parts reaching the
+    // ends of it.
+    auto set_range = [&](unsigned index, int lowest, int highest){
+        mixer->set_part_range(
+            index,
+            lowest == MIN_KEY_SEMITONE ? INT_MIN : lowest,
+            highest == MIN_KEY_SEMITONE + KEY_COUNT - 1 ? INT_MAX : highest
+        );
+    };
+
+    set_range(0, lowest_key, highest_key);
+    for(unsigned i = 0; i < extra_parts.size(); ++i)
+        set_range(i + 1, extra_parts[i].lowest_key, extra_parts[i].highest_key);
+}
+
+void cafefm::load_parts()
+{
+    auto to_gui = [](int key){
+        return std::clamp(
+            key, MIN_KEY_SEMITONE, MIN_KEY_SEMITONE + KEY_COUNT - 1
+        );
+    };
+
+    lowest_key = to_gui(ins_state.lowest_key);
+    highest_key = to_gui(ins_state.highest_key);
+
+    while(extra_parts.size()) drop_part(extra_parts.size()-1);
+
+    // Layers of presets that no longer exist are skipped. The layers of a
+    // layer aren't played.
+    for(const instrument_state::layer& l: ins_state.layers)
+    {
+        auto it = std::find_if(
+            all_instruments.begin(), all_instruments.end(),
+            [&](const instrument_state& s){ return s.name == l.name; }
+        );
+        if(it == all_instruments.end()) continue;
+
+        part_data p;
+        p.state = *it;
+        p.lowest_key = to_gui(l.lowest_key);
+        p.highest_key = to_gui(l.highest_key);
+        p.threaded = l.threaded;
+        extra_parts.emplace_back(std::move(p));
+    }
+}
+
+void cafefm::store_parts()
+{
+    auto from_gui = [](int key){
+        if(key == MIN_KEY_SEMITONE) return INT_MIN;
+        if(key == MIN_KEY_SEMITONE + KEY_COUNT - 1) return INT_MAX;
+        return key;
+    };
+
+    ins_state.lowest_key = from_gui(lowest_key);
+    ins_state.highest_key = from_gui(highest_key);
+    ins_state.layers.clear();
+    for(const part_data& p: extra_parts)
+    {
+        ins_state.layers.push_back({
+            p.state.name,
+            from_gui(p.lowest_key),
+            from_gui(p.highest_key),
+            p.threaded
+        });
+    }
+}
+
+void cafefm::drop_part(unsigned index)
+{
+    // The mixer may still be playing the instrument until the next reset.
+    if(extra_parts[index].ins)
+        dropped_parts.emplace_back(std::move(extra_parts[index].ins));
+    extra_parts.erase(extra_parts.begin() + index);
+}
+
+void cafefm::update_effects()
+{
+    try
+    {
+        output->get_effects().set_state(ins_state.effects);
+    }
+    catch(const std::runtime_error& err)
+    {
+        std::cerr << err.what() << std::endl;
+    }
+}
+
+void cafefm::calibrate_latency()
+{
+    if(calibration_thread) return;
+
+    // The calibration needs exclusive access to the device.
+    output->close();
+
+    // Calibrate with the current instrument as the worst case, since that's
+    // what will actually be played.
+    calibration_instrument.reset(
+        ins_state.create_instrument(opts.samplerate, opts.oversampling)
+    );
+    if(ins_state.filter.type != filter_state::NONE)
+    {
+        calibration_instrument->set_filter(
+            ins_state.filter.design(opts.samplerate)
+        );
+    }
+
+    calibration_progress = 0.0;
+    calibration_done = false;
+    uint64_t samplerate = opts.samplerate;
+    int system_index = opts.system_index;
+    int device_index = opts.device_index;
+    calibration_thread.reset(new std::thread([=](){
+        calibration_result = audio_output::calibrate(
+            samplerate, system_index, device_index, *calibration_instrument,
+            0.75, 0.25, 10.0, &calibration_progress
+        );
+        calibration_done = true;
+    }));
+}
+
+void cafefm::finish_calibration()
+{
+    if(!calibration_thread || !calibration_done) return;
+    calibration_thread->join();
+    calibration_thread.reset();
+    calibration_instrument.reset();
+
+    const audio_output::calibration& c = calibration_result;
+    options new_opts(opts);
+    new_opts.target_latency = c.target_latency;
+    new_opts.block_size = c.block_size;
+    if(c.stable)
+    {
+        options::device_latency l = {c.target_latency, c.block_size};
+        new_opts.calibrated_latencies[new_opts.get_device_key()] = l;
+
+        // Only the calibration is saved, other unsaved changes aren't.
+        options saved_opts;
+        load_options(saved_opts);
+        saved_opts.calibrated_latencies[new_opts.get_device_key()] = l;
+        write_options(saved_opts);
+    }
+    apply_options(new_opts);
+}
+
+void cafefm::adapt_latency()
+{
+    constexpr double check_interval = 1.0;
+    constexpr double max_latency = 0.25;
+    constexpr double latency_step = 1.5;
+    // Latency is raised after this many intervals in a row had xruns, and
+    // lowered back towards the user's choice after this many had none.
+    constexpr unsigned raise_intervals = 3;
+    constexpr unsigned lower_intervals = 120;
+
+    if(opts.target_latency != base_latency)
+    {
+        // Picked by the user or by calibration.
+        base_latency = adapted_latency = opts.target_latency;
+        latency_pending = false;
+        xrun_intervals = 0;
+        quiet_intervals = 0;
+    }
+
+    // Reopening the stream is a dropout of its own, so it's only done when
+    // it can't be heard.
+    if(latency_pending)
+    {
+        if(output->is_idle() && !output->is_recording()) reopen_output();
+        return;
+    }
+
+    time_point now = std::chrono::steady_clock::now();
+    if(now < latency_settled_time)
+    {
+        output->reset_load_stats();
+        previous_latency_check = now;
+        return;
+    }
+
+    if(
+        std::chrono::duration<double>(now - previous_latency_check).count()
+        < check_interval
+    ) return;
+    previous_latency_check = now;
+
+    audio_output::load_stats stats = output->get_load_stats();
+    output->reset_load_stats();
+    if(stats.callbacks == 0) return;
+
+    // Load alone isn't a reason to change latency, since a longer buffer
+    // doesn't make rendering it any cheaper.
+    if(stats.xruns != 0)
+    {
+        xrun_intervals++;
+        quiet_intervals = 0;
+    }
+    else
+    {
+        quiet_intervals++;
+        xrun_intervals = 0;
+    }
+
+    double latency = adapted_latency;
+    if(xrun_intervals >= raise_intervals)
+    {
+        latency = std::min(
+            std::max(latency * latency_step, 0.004),
+            max_latency
+        );
+    }
+    else if(quiet_intervals >= lower_intervals)
+        latency = std::max(latency / latency_step, base_latency);
+    else return;
+
+    xrun_intervals = 0;
+    quiet_intervals = 0;
+    if(latency == adapted_latency) return;
+
+    adapted_latency = latency;
+    latency_pending = true;
+}
+
+double cafefm::get_stream_latency() const
+{
+    return opts.adaptive_latency && adapted_latency > 0 ?
+        adapted_latency : opts.target_latency;
+}
+
+void cafefm::reopen_output()
+{
+    output->open(
+        get_stream_latency(),
+        opts.system_index,
+        opts.device_index,
+        opts.block_size
+    );
+    latency_pending = false;
+    output->set_instrument(*mixer);
+    output->start();
+    latency_settled_time = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(LATENCY_SETTLE_MS);
+}
+
 void cafefm::apply_options(const options& new_opts)
 {
+    // The device is in use by the calibration until it's finished.
+    if(calibration_thread) return;
+
     ins_state.adsr = ins_state.adsr.convert(
         opts.samplerate, new_opts.samplerate
     );
@@ -20,6 +20,7 @@
 #define CAFEFM_HH
 #include <GL/glew.h>
 #include "fm.hh"
+#include "part_mixer.hh"
 #include "control_state.hh"
 #include "instrument_state.hh"
 #include "options.hh"
@@ -34,6 +35,10 @@
 #include <memory>
 #include <map>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 class cafefm
 {
@@ -45,6 +50,8 @@ public:
     void unload();
     void render();
     bool update();
+    // True while nothing is making sound, so input can be polled less often.
+    bool is_idle() const;
 
 private:
     using time_point = std::chrono::steady_clock::time_point;
@@ -53,6 +60,10 @@ private:
     static constexpr unsigned CHANGE_REQUIRE_IMPORT = 1;
     static constexpr unsigned CHANGE_REQUIRE_FINISH = 2;
     static constexpr unsigned CHANGE_REQUIRE_RESET = 4;
+    static constexpr unsigned CHANGE_REQUIRE_EFFECTS = 8;
+    // Applying the controls picks the change up, voices needn't be
+    // refreshed.
+    static constexpr unsigned CHANGE_REQUIRE_APPLY = 16;
 
     struct controller_data
     {
@@ -62,11 +73,53 @@ private:
         int selected_preset;
         bindings binds;
         bool active;
+        // Axes whose changes are merged until the next dispatch.
+        std::vector<int> pending_axes;
+        std::vector<bool> axis_pending;
+    };
+
+    // An instrument played along with the edited one, layered on top of it
+    // or split to a different part of the keyboard.
+    struct part_data
+    {
+        instrument_state state;
+        int lowest_key, highest_key;
+        bool threaded;
+        std::unique_ptr<fm_instrument> ins;
+    };
+
+    // An instrument with a copy of the state that controls are applied on.
+    struct applied_part
+    {
+        fm_instrument* ins;
+        instrument_state state;
+    };
+
+    // A mixer and the instruments of its parts, kept alive after being
+    // replaced until the audio thread has faded them out.
+    struct retired_mixer
+    {
+        std::vector<std::unique_ptr<fm_instrument>> parts;
+        std::unique_ptr<part_mixer> mixer;
     };
 
     void handle_controller(
         controller_data* c, int axis_index, int button_index
     );
+    void handle_controller_change(
+        controller* c, int axis_index, int button_index
+    );
+    // Acts on the latest values of the axes whose changes were merged.
+    void dispatch_pending_axes(controller_data* c);
+    // Applies the control state to the instruments.
+    void apply_controls();
+    // Copies the edited states for apply_controls().
+    void update_applied_parts();
+
+    void start_input_thread();
+    void stop_input_thread();
+    void notify_input(controller* c);
+    void input_handler();
 
     void gui_keyboard_grab();
     void gui_controller_manager();
@@ -75,6 +128,8 @@ private:
     unsigned gui_modulation_mode();
     unsigned gui_adsr();
     unsigned gui_filter();
+    unsigned gui_effects();
+    unsigned gui_parts();
     unsigned gui_oscillator(
         oscillator& osc,
         unsigned index,
@@ -84,6 +139,7 @@ private:
         bool is_carrier,
         bool removable
     );
+    unsigned gui_modulator_links(unsigned index, struct nk_rect bounds);
     void gui_instrument_editor();
 
     void gui_bind_action_template(bind& b);
@@ -134,14 +190,43 @@ private:
     void next_protip();
 
     void reset_fm(bool refresh_only = true);
+    void update_part_ranges();
+    void load_parts();
+    void store_parts();
+    void drop_part(unsigned index);
+    void update_effects();
 
     void apply_options(const options& new_opts);
+    void calibrate_latency();
+    void finish_calibration();
+    void adapt_latency();
+    // The latency the stream is opened with.
+    double get_stream_latency() const;
+    // Reopens the stream with the current instruments.
+    void reopen_output();
 
     nk_context* ctx;
     SDL_Window* win;
     int ww, wh;
     SDL_GLContext gl_ctx;
     time_point previous_update_time;
+    time_point previous_latency_check;
+    // adapt_latency() ignores the stream until it has settled after being
+    // opened, and never goes below the latency picked by the user. The
+    // adapted latency only lasts for the session and isn't stored in opts. A
+    // pending change waits until the stream is reopened anyway, or until
+    // nothing is playing.
+    time_point latency_settled_time;
+    double base_latency, adapted_latency;
+    bool latency_pending;
+    unsigned xrun_intervals, quiet_intervals;
+    // Calibration runs on a thread of its own, so that the GUI stays
+    // responsive. The output is closed until it's finished.
+    std::unique_ptr<std::thread> calibration_thread;
+    std::unique_ptr<fm_instrument> calibration_instrument;
+    audio_output::calibration calibration_result;
+    std::atomic<double> calibration_progress;
+    std::atomic_bool calibration_done;
 
     SDL_Surface* icon;
 
@@ -155,7 +240,7 @@ private:
     bool instrument_delete_popup_open;
     int save_recording_state;
     // Used for assigning binds
-    int latest_input_button, latest_input_axis;
+    std::atomic_int latest_input_button, latest_input_axis;
     unsigned protip_index;
 
     midi_context midi;
@@ -171,16 +256,46 @@ private:
     bool keyboard_grabbed, mouse_grabbed;
 
     std::unique_ptr<fm_instrument> fm;
+    // The edited instrument is the first part of the mixer, and keys play
+    // the mixer.
+    int lowest_key, highest_key;
+    std::vector<part_data> extra_parts;
+    std::unique_ptr<part_mixer> mixer;
+    std::vector<retired_mixer> retired_mixers;
+    // Instruments of removed parts, retired along with the mixer on the next
+    // reset.
+    std::vector<std::unique_ptr<fm_instrument>> dropped_parts;
     std::unique_ptr<audio_output> output;
 
     float master_volume;
     control_state control;
 
+    // The GUI edits ins_state and the parts freely, controls are applied
+    // with these copies. They're refreshed after edits and resets.
+    std::vector<applied_part> applied_parts;
+    float applied_master_volume;
+
     std::vector<instrument_state> all_instruments;
     instrument_state ins_state;
+    // Edited separately so that the file is only loaded once the path is
+    // complete.
+    std::string impulse_response_input;
 
     options opts;
     visualizer vis;
+
+    // Controllers with threaded input are polled on the input thread as soon
+    // as they notify, so that their latency doesn't depend on the frame rate.
+    // control_mutex guards what that thread touches: control, the list of
+    // controllers with their binds, applied_parts, the instruments and mixer
+    // being played and output. It's only held for accessing those, never
+    // while building the GUI or opening the audio stream.
+    std::mutex control_mutex;
+    std::mutex input_mutex;
+    std::condition_variable input_cv;
+    std::vector<controller*> input_controllers;
+    bool input_should_quit;
+    std::unique_ptr<std::thread> input_thread;
 };
 
 #endif
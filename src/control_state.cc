@@ -20,20 +20,6 @@
 #include "bindings.hh"
 #include <stdexcept>
 
-namespace
-{
-    template<typename T>
-    void reset_controller(T& m, control_state::controller_id cid)
-    {
-        for(auto it = m.begin(); it != m.end();)
-        {
-            auto old_it = it++;
-            if((uint32_t)old_it->first == cid)
-                m.erase(old_it);
-        }
-    }
-}
-
 control_state::full_id control_state::create_id(
     controller_id cid,
     action_id aid
@@ -47,6 +33,74 @@ void control_state::split_id(full_id id, controller_id& cid, action_id& aid)
     aid = id>>32;
 }
 
+control_state::action_values::action_values()
+:   sum_valid(true), product_valid(true), cached_sum(0), cached_product(1)
+{
+}
+
+void control_state::action_values::set(full_id id, double value)
+{
+    double* v = values.find(id);
+    if(v && *v == value) return;
+    if(v) *v = value;
+    else values[id] = value;
+    sum_valid = false;
+    product_valid = false;
+}
+
+bool control_state::action_values::get(full_id id, double& value) const
+{
+    const double* v = values.find(id);
+    if(!v) return false;
+    value = *v;
+    return true;
+}
+
+void control_state::action_values::erase(full_id id)
+{
+    if(!values.erase(id)) return;
+    sum_valid = false;
+    product_valid = false;
+}
+
+void control_state::action_values::erase_controller(controller_id cid)
+{
+    if(!values.erase_controller(cid)) return;
+    sum_valid = false;
+    product_valid = false;
+}
+
+void control_state::action_values::clear()
+{
+    values.clear();
+    sum_valid = true;
+    product_valid = true;
+    cached_sum = 0;
+    cached_product = 1;
+}
+
+double control_state::action_values::sum() const
+{
+    if(!sum_valid)
+    {
+        cached_sum = 0;
+        for(auto& pair: values) cached_sum += pair.second;
+        sum_valid = true;
+    }
+    return cached_sum;
+}
+
+double control_state::action_values::product() const
+{
+    if(!product_valid)
+    {
+        cached_product = 1;
+        for(auto& pair: values) cached_product *= pair.second;
+        product_valid = true;
+    }
+    return cached_product;
+}
+
 control_state::control_state() { }
 
 void control_state::set_threshold_state(
@@ -61,9 +115,8 @@ void control_state::set_threshold_state(
 int control_state::get_threshold_state(controller_id cid, action_id aid) const
 {
     full_id id = create_id(cid, aid);
-    auto it = threshold_state.find(id);
-    if(it == threshold_state.end()) return 0;
-    return it->second;
+    const int* state = threshold_state.find(id);
+    return state ? *state : 0;
 }
 
 void control_state::set_toggle_state(
@@ -78,9 +131,8 @@ void control_state::set_toggle_state(
 int control_state::get_toggle_state(controller_id cid, action_id aid) const
 {
     full_id id = create_id(cid, aid);
-    auto it = toggle_state.find(id);
-    if(it == toggle_state.end()) return 0;
-    return it->second;
+    const int* state = toggle_state.find(id);
+    return state ? *state : 0;
 }
 
 void control_state::set_cumulation_speed(
@@ -89,10 +141,9 @@ void control_state::set_cumulation_speed(
     double speed
 ){
     full_id id = create_id(cid, aid);
-    auto it = cumulative_state.find(id);
-    if(it == cumulative_state.end())
-        cumulative_state[id] = std::make_pair(0.0, speed);
-    else it->second.second = speed;
+    auto* state = cumulative_state.find(id);
+    if(!state) cumulative_state[id] = std::make_pair(0.0, speed);
+    else state->second = speed;
 }
 
 void control_state::clear_cumulation(controller_id cid, action_id aid)
@@ -104,9 +155,8 @@ void control_state::clear_cumulation(controller_id cid, action_id aid)
 double control_state::get_cumulation(controller_id cid, action_id aid)
 {
     full_id id = create_id(cid, aid);
-    auto it = cumulative_state.find(id);
-    if(it == cumulative_state.end()) return 0;
-    return it->second.first;
+    auto* state = cumulative_state.find(id);
+    return state ? state->first : 0;
 }
 
 void control_state::set_stacking(controller_id cid, action_id aid, int s)
@@ -118,9 +168,8 @@ void control_state::set_stacking(controller_id cid, action_id aid, int s)
 int control_state::get_stacking(controller_id cid, action_id aid) const
 {
     full_id id = create_id(cid, aid);
-    auto it = stacking.find(id);
-    if(it == stacking.end()) return 0;
-    return it->second;
+    const int* state = stacking.find(id);
+    return state ? *state : 0;
 }
 
 void control_state::erase_action(controller_id cid, action_id aid)
@@ -153,6 +202,9 @@ void control_state::erase_action(controller_id cid, action_id aid)
 
     for(unsigned i = 0; i < sizeof(env)/sizeof(*env); ++i)
         env[i].mul.erase(id);
+
+    for(unsigned i = 0; i < sizeof(filt)/sizeof(*filt); ++i)
+        filt[i].mul.erase(id);
 }
 
 void control_state::press_key(
@@ -162,7 +214,7 @@ void control_state::press_key(
     double volume
 ){
     full_id id = create_id(cid, aid);
-    press_queue.push_back({id, semitone, volume});
+    press_queue.push_back({id, semitone, volume, 0.0, 1.0});
 }
 
 void control_state::set_key_volume(
@@ -171,9 +223,33 @@ void control_state::set_key_volume(
     double volume
 ){
     full_id id = create_id(cid, aid);
-    for(auto& pair: pressed_keys)
-        if(pair.second.id == id)
-            pair.second.volume = volume;
+    for(key_data& k: press_queue)
+        if(k.id == id)
+            k.volume = volume;
+    for(pressed_key& p: pressed_keys)
+        if(p.key.id == id)
+            p.key.volume = volume;
+}
+
+void control_state::set_key_expression(
+    controller_id cid,
+    action_id aid,
+    double bend,
+    double amplitude
+){
+    full_id id = create_id(cid, aid);
+    for(key_data& k: press_queue)
+    {
+        if(k.id != id) continue;
+        k.bend = bend;
+        k.amplitude = amplitude;
+    }
+    for(pressed_key& p: pressed_keys)
+    {
+        if(p.key.id != id) continue;
+        p.key.bend = bend;
+        p.key.amplitude = amplitude;
+    }
 }
 
 void control_state::release_key(controller_id cid, action_id aid)
@@ -185,8 +261,10 @@ void control_state::release_key(controller_id cid, action_id aid)
 bool control_state::is_active_key(controller_id cid, action_id aid) const
 {
     full_id id = create_id(cid, aid);
-    for(const auto& pair: pressed_keys)
-        if(pair.second.id == id) return true;
+    for(const key_data& k: press_queue)
+        if(k.id == id) return true;
+    for(const pressed_key& p: pressed_keys)
+        if(p.key.id == id) return true;
     return false;
 }
 
@@ -196,7 +274,7 @@ void control_state::set_frequency_expt(
     double freq_expt
 ){
     full_id id = create_id(cid, aid);
-    this->freq_expt[id] = freq_expt;
+    this->freq_expt.set(id, freq_expt);
 }
 
 bool control_state::get_frequency_expt(
@@ -206,10 +284,7 @@ bool control_state::get_frequency_expt(
 ) const
 {
     full_id id = create_id(cid, aid);
-    auto it = this->freq_expt.find(id);
-    if(it == this->freq_expt.end()) return false;
-    freq_expt = it->second;
-    return true;
+    return this->freq_expt.get(id, freq_expt);
 }
 
 void control_state::set_volume_mul(
@@ -218,7 +293,7 @@ void control_state::set_volume_mul(
     double volume_mul
 ){
     full_id id = create_id(cid, aid);
-    this->volume_mul[id] = volume_mul;
+    this->volume_mul.set(id, volume_mul);
 }
 
 bool control_state::get_volume_mul(
@@ -228,10 +303,7 @@ bool control_state::get_volume_mul(
 ) const
 {
     full_id id = create_id(cid, aid);
-    auto it = this->volume_mul.find(id);
-    if(it == this->volume_mul.end()) return false;
-    volume_mul = it->second;
-    return true;
+    return this->volume_mul.get(id, volume_mul);
 }
 
 void control_state::set_period_fine(
@@ -243,7 +315,7 @@ void control_state::set_period_fine(
     full_id id = create_id(cid, aid);
     if(modulator_index >= osc.size())
         osc.resize(modulator_index+1);
-    osc[modulator_index].period_fine[id] = period_fine;
+    osc[modulator_index].period_fine.set(id, period_fine);
 }
 
 bool control_state::get_period_fine(
@@ -254,10 +326,7 @@ bool control_state::get_period_fine(
 ) const {
     full_id id = create_id(cid, aid);
     if(modulator_index >= osc.size()) return false;
-    auto it = osc[modulator_index].period_fine.find(id);
-    if(it == osc[modulator_index].period_fine.end()) return false;
-    period_fine = it->second;
-    return true;
+    return osc[modulator_index].period_fine.get(id, period_fine);
 }
 
 void control_state::set_amplitude_mul(
@@ -269,7 +338,7 @@ void control_state::set_amplitude_mul(
     full_id id = create_id(cid, aid);
     if(modulator_index >= osc.size())
         osc.resize(modulator_index+1);
-    osc[modulator_index].amplitude_mul[id] = amplitude_mul;
+    osc[modulator_index].amplitude_mul.set(id, amplitude_mul);
 }
 
 bool control_state::get_amplitude_mul(
@@ -280,10 +349,7 @@ bool control_state::get_amplitude_mul(
 ) const {
     full_id id = create_id(cid, aid);
     if(modulator_index >= osc.size()) return false;
-    auto it = osc[modulator_index].amplitude_mul.find(id);
-    if(it == osc[modulator_index].amplitude_mul.end()) return false;
-    amplitude_mul = it->second;
-    return true;
+    return osc[modulator_index].amplitude_mul.get(id, amplitude_mul);
 }
 
 void control_state::set_envelope_adjust(
@@ -293,7 +359,7 @@ void control_state::set_envelope_adjust(
     double mul
 ){
     full_id id = create_id(cid, aid);
-    env[which].mul[id] = mul;
+    env[which].mul.set(id, mul);
 }
 
 bool control_state::get_envelope_adjust(
@@ -304,10 +370,28 @@ bool control_state::get_envelope_adjust(
 ) const
 {
     full_id id = create_id(cid, aid);
-    auto it = env[which].mul.find(id);
-    if(it == env[which].mul.end()) return false;
-    mul = it->second;
-    return true;
+    return env[which].mul.get(id, mul);
+}
+
+void control_state::set_filter_adjust(
+    unsigned which,
+    controller_id cid,
+    action_id aid,
+    double mul
+){
+    full_id id = create_id(cid, aid);
+    filt[which].mul.set(id, mul);
+}
+
+bool control_state::get_filter_adjust(
+    unsigned which,
+    controller_id cid,
+    action_id aid,
+    double& mul
+) const
+{
+    full_id id = create_id(cid, aid);
+    return filt[which].mul.get(id, mul);
 }
 
 void control_state::reset()
@@ -332,6 +416,11 @@ void control_state::reset()
     {
         env[i].mul.clear();
     }
+
+    for(unsigned i = 0; i < sizeof(filt)/sizeof(*filt); ++i)
+    {
+        filt[i].mul.clear();
+    }
 }
 
 void control_state::reset(controller_id cid)
@@ -354,29 +443,37 @@ void control_state::reset(controller_id cid)
         }
     }
 
-    for(auto it = pressed_keys.begin(); it != pressed_keys.end();)
+    for(unsigned i = 0; i < pressed_keys.size(); ++i)
     {
-        auto old_it = it++;
-        if((uint32_t)old_it->second.id == cid)
-            pressed_keys.erase(old_it);
+        if((uint32_t)pressed_keys[i].key.id == cid)
+        {
+            pressed_keys[i] = pressed_keys.back();
+            pressed_keys.pop_back();
+            --i;
+        }
     }
 
-    reset_controller(threshold_state, cid);
-    reset_controller(toggle_state, cid);
-    reset_controller(stacking, cid);
-    reset_controller(cumulative_state, cid);
-    reset_controller(freq_expt, cid);
-    reset_controller(volume_mul, cid);
+    threshold_state.erase_controller(cid);
+    toggle_state.erase_controller(cid);
+    stacking.erase_controller(cid);
+    cumulative_state.erase_controller(cid);
+    freq_expt.erase_controller(cid);
+    volume_mul.erase_controller(cid);
 
     for(auto& o: osc)
     {
-        reset_controller(o.period_fine, cid);
-        reset_controller(o.amplitude_mul, cid);
+        o.period_fine.erase_controller(cid);
+        o.amplitude_mul.erase_controller(cid);
     }
 
     for(unsigned i = 0; i < sizeof(env)/sizeof(*env); ++i)
     {
-        reset_controller(env[i].mul, cid);
+        env[i].mul.erase_controller(cid);
+    }
+
+    for(unsigned i = 0; i < sizeof(filt)/sizeof(*filt); ++i)
+    {
+        filt[i].mul.erase_controller(cid);
     }
 }
 
@@ -399,41 +496,34 @@ void control_state::update(controller_id cid, bindings& b, double dt)
 
 double control_state::total_freq_mul(double base_freq) const
 {
-    double expt = 0.0;
-    for(auto& pair: freq_expt) expt += pair.second;
-    return base_freq*pow(2.0, expt/12.0);
+    return base_freq*pow(2.0, freq_expt.sum()/12.0);
 }
 
 double control_state::total_volume_mul() const
 {
-    double mul = 1.0;
-    for(auto& pair: volume_mul) mul *= pair.second;
-    return mul;
+    return volume_mul.product();
 }
 
 double control_state::total_period_fine(unsigned i) const
 {
-    double fine = 0.0;
-    if(i >= osc.size()) return fine;
-
-    for(auto& pair: osc[i].period_fine) fine += pair.second;
-    return fine;
+    if(i >= osc.size()) return 0.0;
+    return osc[i].period_fine.sum();
 }
 
 double control_state::total_amp_mul(unsigned i) const
 {
-    double mul = 1.0;
-    if(i >= osc.size()) return mul;
-
-    for(auto& pair: osc[i].amplitude_mul) mul *= pair.second;
-    return mul;
+    if(i >= osc.size()) return 1.0;
+    return osc[i].amplitude_mul.product();
 }
 
 double control_state::total_envelope_adjust(unsigned which) const
 {
-    double mul = 1.0;
-    for(auto& pair: env[which].mul) mul *= pair.second;
-    return mul;
+    return env[which].mul.product();
+}
+
+double control_state::total_filter_adjust(unsigned which) const
+{
+    return filt[which].mul.product();
 }
 
 void control_state::apply(
@@ -468,26 +558,48 @@ void control_state::apply(
     adsr.release_length *= total_envelope_adjust(3);
 
     ins.set_envelope(adsr);
+    ins.set_filter_modulation(total_filter_adjust(0), total_filter_adjust(1));
+    ins.set_voice_filter(ins_state.voice_filter);
     ins.set_volume(src_volume*total_volume_mul());
     dst.update_period_lookup();
     dst.limit_total_carrier_amplitude();
     ins.set_synth(dst);
+}
 
-    for(key_data& p: press_queue)
-        pressed_keys[ins.press_voice(p.semitone)] = p;
+void control_state::apply_keys(instrument& ins)
+{
+    for(key_data& k: press_queue)
+    {
+        instrument::voice_id voice = ins.press_voice(k.semitone);
+        // The voice may have been stolen from another key.
+        bool found = false;
+        for(pressed_key& p: pressed_keys)
+        {
+            if(p.voice == voice)
+            {
+                p.key = k;
+                found = true;
+                break;
+            }
+        }
+        if(!found) pressed_keys.push_back({voice, k});
+    }
 
     press_queue.clear();
 
-    for(auto it = pressed_keys.begin(); it != pressed_keys.end();)
+    for(unsigned i = 0; i < pressed_keys.size(); ++i)
     {
-        auto old_it = it++;
-        ins.set_voice_volume(old_it->first, old_it->second.volume);
+        pressed_key& p = pressed_keys[i];
+        ins.set_voice_volume(p.voice, p.key.volume);
+        ins.set_voice_expression(p.voice, p.key.bend, p.key.amplitude);
         for(full_id id: release_queue)
         {
-            if(old_it->second.id == id)
+            if(p.key.id == id)
             {
-                ins.release_voice(old_it->first);
-                pressed_keys.erase(old_it);
+                ins.release_voice(p.voice);
+                pressed_keys[i] = pressed_keys.back();
+                pressed_keys.pop_back();
+                --i;
                 break;
             }
         }
@@ -495,4 +607,3 @@ void control_state::apply(
 
     release_queue.clear();
 }
-
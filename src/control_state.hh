@@ -20,8 +20,8 @@
 #define CAFEFM_CONTROL_CONTEXT_HH
 #include "fm.hh"
 #include "instrument_state.hh"
-#include <set>
-#include <map>
+#include <vector>
+#include <unordered_map>
 
 class bind;
 class controller;
@@ -56,7 +56,13 @@ public:
         controller_id cid, action_id aid, int semitone, double volume
     );
     void set_key_volume(controller_id cid, action_id aid, double volume);
+    // Per-key pitch bend in semitones and amplitude multiplier, see
+    // instrument::set_voice_expression().
+    void set_key_expression(
+        controller_id cid, action_id aid, double bend, double amplitude
+    );
     void release_key(controller_id cid, action_id aid);
+    // Also true for keys that are waiting to be pressed by apply_keys().
     bool is_active_key(controller_id cid, action_id aid) const;
 
     void set_frequency_expt(controller_id cid, action_id aid, double freq_expt);
@@ -100,6 +106,13 @@ public:
         unsigned which, controller_id cid, action_id id, double& mul
     ) const;
 
+    void set_filter_adjust(
+        unsigned which, controller_id cid, action_id id, double mul
+    );
+    bool get_filter_adjust(
+        unsigned which, controller_id cid, action_id id, double& mul
+    ) const;
+
     void reset();
     void reset(controller_id cid);
     void update(controller_id cid, bindings& b, double dt);
@@ -109,6 +122,7 @@ public:
     double total_period_fine(unsigned oscillator_index) const;
     double total_amp_mul(unsigned oscillator_index) const;
     double total_envelope_adjust(unsigned which) const;
+    double total_filter_adjust(unsigned which) const;
 
     // Applies alterations by actions to synth and modulators.
     void apply(
@@ -116,6 +130,9 @@ public:
         double src_volume,
         instrument_state& ins_state
     );
+    // Presses and releases the keys queued since the last call. Separate from
+    // apply(), so that one set of keys can play several instruments.
+    void apply_keys(instrument& ins);
 
 private:
     struct key_data
@@ -123,36 +140,158 @@ private:
         full_id id;
         int semitone;
         double volume;
+        double bend;
+        double amplitude;
     };
     std::vector<key_data> press_queue;
     std::vector<full_id> release_queue;
 
-    // TODO: These should be vectors for performance reasons. They are rarely
-    // indexed but often iterated.
-    std::map<instrument::voice_id, key_data> pressed_keys;
+    struct pressed_key
+    {
+        instrument::voice_id voice;
+        key_data key;
+    };
+    std::vector<pressed_key> pressed_keys;
+
+    // Values of actions, stored contiguously so that they're cheap to
+    // iterate. Each action gets a slot when it's first set, and erasing one
+    // moves the last slot into its place.
+    template<typename T>
+    class action_map
+    {
+    public:
+        using entry = std::pair<full_id, T>;
+
+        T* find(full_id id)
+        {
+            auto it = slots.find(id);
+            return it == slots.end() ? nullptr : &entries[it->second].second;
+        }
+
+        const T* find(full_id id) const
+        {
+            auto it = slots.find(id);
+            return it == slots.end() ? nullptr : &entries[it->second].second;
+        }
+
+        T& operator[](full_id id)
+        {
+            auto it = slots.find(id);
+            if(it != slots.end()) return entries[it->second].second;
+            slots[id] = entries.size();
+            entries.emplace_back(id, T());
+            return entries.back().second;
+        }
+
+        bool erase(full_id id)
+        {
+            auto it = slots.find(id);
+            if(it == slots.end()) return false;
+            unsigned slot = it->second;
+            slots.erase(it);
+            if(slot != entries.size() - 1)
+            {
+                entries[slot] = std::move(entries.back());
+                slots[entries[slot].first] = slot;
+            }
+            entries.pop_back();
+            return true;
+        }
+
+        bool erase_controller(controller_id cid)
+        {
+            bool erased = false;
+            for(unsigned i = 0; i < entries.size();)
+            {
+                if((uint32_t)entries[i].first == cid)
+                {
+                    erase(entries[i].first);
+                    erased = true;
+                }
+                else ++i;
+            }
+            return erased;
+        }
 
-    std::map<full_id, int> threshold_state;
-    std::map<full_id, int> toggle_state;
-    std::map<full_id, int> stacking;
-    std::map<
-        full_id,
+        void clear()
+        {
+            entries.clear();
+            slots.clear();
+        }
+
+        typename std::vector<entry>::iterator begin()
+        {
+            return entries.begin();
+        }
+
+        typename std::vector<entry>::iterator end()
+        {
+            return entries.end();
+        }
+
+        typename std::vector<entry>::const_iterator begin() const
+        {
+            return entries.begin();
+        }
+
+        typename std::vector<entry>::const_iterator end() const
+        {
+            return entries.end();
+        }
+
+    private:
+        std::vector<entry> entries;
+        std::unordered_map<full_id, unsigned> slots;
+    };
+
+    // Adjustments by actions that are combined into one value. The totals
+    // are cached, so they're only recomputed after a value has changed.
+    class action_values
+    {
+    public:
+        action_values();
+
+        void set(full_id id, double value);
+        bool get(full_id id, double& value) const;
+        void erase(full_id id);
+        void erase_controller(controller_id cid);
+        void clear();
+
+        double sum() const;
+        double product() const;
+
+    private:
+        action_map<double> values;
+        mutable bool sum_valid, product_valid;
+        mutable double cached_sum, cached_product;
+    };
+
+    action_map<int> threshold_state;
+    action_map<int> toggle_state;
+    action_map<int> stacking;
+    action_map<
         std::pair<double /* Cumulation */, double /* Speed */>
     > cumulative_state;
 
-    std::map<full_id, double> freq_expt;
-    std::map<full_id, double> volume_mul;
+    action_values freq_expt;
+    action_values volume_mul;
 
     struct oscillator_mod
     {
-        std::map<full_id, double> period_fine;
-        std::map<full_id, double> amplitude_mul;
+        action_values period_fine;
+        action_values amplitude_mul;
     };
     std::vector<oscillator_mod> osc;
 
     struct envelope_mod
     {
-        std::map<full_id, double> mul;
+        action_values mul;
     } env[4];
+
+    struct filter_mod
+    {
+        action_values mul;
+    } filt[2];
 };
 
 #endif
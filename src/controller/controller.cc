@@ -33,6 +33,8 @@ bool controller::poll(change_callback, bool)
     return true;
 }
 
+void controller::set_input_callback(input_callback) {}
+
 
 bool controller::assign_bind_on_use() const
 {
@@ -51,6 +53,11 @@ unsigned controller::get_axis_count() const { return 0; }
 std::string controller::get_axis_name(unsigned i) const { outofbounds(i); }
 axis controller::get_axis_state(unsigned i) const { outofbounds(i); }
 
+bool controller::get_axis_expression(unsigned, double&, double&) const
+{
+    return false;
+}
+
 unsigned controller::get_button_count() const { return 0; }
 std::string controller::get_button_name(unsigned i) const { outofbounds(i); }
 unsigned controller::get_button_state(unsigned i) const { outofbounds(i); }
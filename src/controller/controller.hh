@@ -37,6 +37,7 @@ public:
     using change_callback = std::function<void(
         controller* c, int axis_index, int button_index
     )>;
+    using input_callback = std::function<void(controller* c)>;
 
     virtual ~controller();
     // These should return false if controller is disconnected.
@@ -46,6 +47,12 @@ public:
     // updates and just check whether it's still connected.
     virtual bool poll(change_callback cb = {}, bool active = true);
 
+    // Controllers that receive input on a thread of their own call this from
+    // that thread when new input has arrived, so that they can be polled
+    // right away instead of on the next update. poll() must still only be
+    // called from one thread at a time.
+    virtual void set_input_callback(input_callback cb);
+
     // If false, input binds should be assigned with a drop-down instead of
     // waiting for the user to use the controller. Useful for overlapping
     // controls. Defaults to true.
@@ -60,6 +67,13 @@ public:
     virtual unsigned get_axis_count() const;
     virtual std::string get_axis_name(unsigned i) const;
     virtual axis get_axis_state(unsigned i) const;
+    // Expression of a single note, for controllers that have it per axis,
+    // like MPE MIDI devices. Keys bound to the axis are bent by bend
+    // semitones and their volume is multiplied by amplitude. Returns false
+    // if the axis has no expression of its own.
+    virtual bool get_axis_expression(
+        unsigned i, double& bend, double& amplitude
+    ) const;
 
     virtual unsigned get_button_count() const;
     virtual std::string get_button_name(unsigned i) const;
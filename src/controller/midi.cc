@@ -18,11 +18,18 @@
 */
 #include "midi.hh"
 #include "../bindings.hh"
+#include <algorithm>
+#include <cmath>
 #define CENTER (0x40 << 7)
 #define VEL_OFFSET 0x00
 #define AFTERTOUCH_OFFSET 0x80
 #define CONTROL_AXES_OFFSET 0x100
 #define PITCH_WHEEL_OFFSET 0x120
+#define CHANNEL_COUNT 16
+#define RPN_PITCH_BEND_SENSITIVITY 0x0000
+#define RPN_MPE_CONFIGURATION 0x0006
+#define MPE_MEMBER_BEND_RANGE 48
+#define MPE_MASTER_BEND_RANGE 2
 
 midi_context::midi_context()
 {
@@ -112,6 +119,7 @@ midi_controller::midi_controller(midi_context& ctx, unsigned port)
 : ctx(&ctx)
 {
     name = in.getPortName(port);
+    in.setCallback(receive, this);
     in.openPort(port, "CaféFM input");
 
     // 128 notes in midi.
@@ -123,25 +131,42 @@ midi_controller::midi_controller(midi_context& ctx, unsigned port)
     control_buttons.resize(32, 0);
     program = 0;
     pitch_wheel = CENTER;
+
+    lower_zone_channels = 0;
+    upper_zone_channels = 0;
+    note_channel.resize(128, 0);
+    channel_rpn.resize(CHANNEL_COUNT, 0x3FFF);
+    channel_bend.resize(CHANNEL_COUNT, CENTER);
+    channel_bend_range.resize(CHANNEL_COUNT, MPE_MEMBER_BEND_RANGE);
+    channel_pressure.resize(CHANNEL_COUNT, 0);
+    channel_pressure_reference.resize(CHANNEL_COUNT, 0);
+    channel_reference_pending.resize(CHANNEL_COUNT, false);
 }
 
 midi_controller::~midi_controller()
 {
+    // Stops the RtMidi thread before the members it uses are destroyed.
+    in.closePort();
 }
 
 bool midi_controller::poll(change_callback cb, bool active)
 {
-    std::vector<uint8_t> m;
-    for(;active;)
     {
-        m.clear();
-        in.getMessage(&m);
-        if(m.size() == 0) break;
+        std::unique_lock<std::mutex> lock(received_mutex);
+        polled.swap(received);
+        received.clear();
+    }
+
+    for(size_t i = 0; active && i < polled.size(); i += 1 + polled[i])
+    {
+        const uint8_t* m = polled.data() + i + 1;
+        unsigned size = polled[i];
+        if(size == 0) continue;
 
         uint8_t func = m[0]&0xF0;
-        // uint8_t chan = m[0]&0x0F;
-        uint8_t d0 = m.size() > 1 ? m[1] : 0;
-        uint8_t d1 = m.size() > 2 ? m[2] : 0;
+        uint8_t chan = m[0]&0x0F;
+        uint8_t d0 = size > 1 ? m[1] : 0;
+        uint8_t d1 = size > 2 ? m[2] : 0;
 
         switch(func)
         {
@@ -151,6 +176,12 @@ bool midi_controller::poll(change_callback cb, bool active)
             break;
         case 0x90:
             note_velocity[d0] = d1;
+            note_channel[d0] = chan;
+            if(d1)
+            {
+                channel_pressure_reference[chan] = channel_pressure[chan];
+                channel_reference_pending[chan] = true;
+            }
             if(cb) cb(this, VEL_OFFSET + d0, -1);
             break;
         case 0xA0:
@@ -158,6 +189,48 @@ bool midi_controller::poll(change_callback cb, bool active)
             if(cb) cb(this, AFTERTOUCH_OFFSET + d0, -1);
             break;
         case 0xB0:
+            if(d0 == 0x06)
+            {
+                // Data entry of a registered parameter.
+                if(channel_rpn[chan] == RPN_PITCH_BEND_SENSITIVITY)
+                {
+                    // Sent to any member channel, it applies to the whole
+                    // zone.
+                    unsigned first = chan, last = chan;
+                    if(chan >= 1 && chan <= lower_zone_channels)
+                    {
+                        first = 1;
+                        last = lower_zone_channels;
+                    }
+                    else if(is_mpe_member(chan))
+                    {
+                        first = 15 - upper_zone_channels;
+                        last = 14;
+                    }
+                    for(unsigned i = first; i <= last; ++i)
+                        channel_bend_range[i] = d1;
+                }
+                else if(channel_rpn[chan] == RPN_MPE_CONFIGURATION)
+                {
+                    unsigned members = std::min(d1, (uint8_t)15);
+                    if(chan == 0) lower_zone_channels = members;
+                    else if(chan == 15) upper_zone_channels = members;
+                    for(unsigned i = 0; i < CHANNEL_COUNT; ++i)
+                    {
+                        channel_bend_range[i] =
+                            i == 0 || i == 15 ?
+                            MPE_MASTER_BEND_RANGE : MPE_MEMBER_BEND_RANGE;
+                    }
+                }
+            }
+            else if(d0 == 0x64)
+                channel_rpn[chan] = (channel_rpn[chan] & 0x3F80) | d1;
+            else if(d0 == 0x65)
+            {
+                channel_rpn[chan] =
+                    (channel_rpn[chan] & 0x7F) | ((uint16_t)d1 << 7);
+            }
+
             if(d0 < 0x20)
             {
                 control_axes[d0] &= 0x7F;
@@ -188,11 +261,28 @@ bool midi_controller::poll(change_callback cb, bool active)
             program = d0;
             break;
         case 0xD0:
+            if(is_mpe_member(chan))
+            {
+                channel_pressure[chan] = d0;
+                if(channel_reference_pending[chan])
+                {
+                    channel_pressure_reference[chan] = d0;
+                    channel_reference_pending[chan] = false;
+                }
+                notify_channel_notes(chan, cb);
+                break;
+            }
             note_aftertouch.assign(note_aftertouch.size(), d0);
             for(unsigned i = 0; i < note_aftertouch.size(); ++i)
                 if(cb) cb(this, AFTERTOUCH_OFFSET + i, -1);
             break;
         case 0xE0:
+            if(is_mpe_member(chan))
+            {
+                channel_bend[chan] = d0 | (((uint16_t)d1) << 7);
+                notify_channel_notes(chan, cb);
+                break;
+            }
             pitch_wheel = d0 | (((uint16_t)d1) << 7);
             if(cb) cb(this, PITCH_WHEEL_OFFSET, -1);
             break;
@@ -204,6 +294,12 @@ bool midi_controller::poll(change_callback cb, bool active)
     return ctx->status[name];
 }
 
+void midi_controller::set_input_callback(input_callback cb)
+{
+    std::unique_lock<std::mutex> lock(received_mutex);
+    on_input = cb;
+}
+
 bool midi_controller::potentially_inactive() const
 {
     return name.find("Midi Through") != std::string::npos;
@@ -304,6 +400,24 @@ axis midi_controller::get_axis_state(unsigned i) const
     return res;
 }
 
+bool midi_controller::get_axis_expression(
+    unsigned i, double& bend, double& amplitude
+) const
+{
+    if(i >= note_velocity.size()) return false;
+    unsigned chan = note_channel[i];
+    if(!is_mpe_member(chan)) return false;
+
+    bend = (channel_bend[chan] - CENTER)/(double)0x1F80;
+    bend = std::max(std::min(bend, 1.0), -1.0) * channel_bend_range[chan];
+    // Releasing pressure fades the note by up to 6 dB from where it started.
+    // Adding pressure can't raise it past its velocity, that could clip.
+    amplitude = pow(2.0, std::min(
+        channel_pressure[chan] - channel_pressure_reference[chan], 0
+    )/(double)0x7F);
+    return true;
+}
+
 unsigned midi_controller::get_button_count() const
 {
     return control_buttons.size();
@@ -326,3 +440,39 @@ unsigned midi_controller::get_button_state(unsigned i) const
 {
     return control_buttons[i];
 }
+
+bool midi_controller::is_mpe_member(unsigned channel) const
+{
+    return
+        (channel >= 1 && channel <= lower_zone_channels) ||
+        (channel <= 14 && channel + upper_zone_channels >= 15);
+}
+
+void midi_controller::notify_channel_notes(
+    unsigned channel, change_callback& cb
+){
+    if(!cb) return;
+    for(unsigned i = 0; i < note_velocity.size(); ++i)
+    {
+        if(note_velocity[i] && note_channel[i] == channel)
+            cb(this, VEL_OFFSET + i, -1);
+    }
+}
+
+void midi_controller::receive(
+    double timestamp,
+    std::vector<unsigned char>* message,
+    void* data
+){
+    (void)timestamp;
+    midi_controller* self = static_cast<midi_controller*>(data);
+    // Only system exclusive messages can be this long, and they're ignored.
+    if(message->size() > UINT8_MAX) return;
+
+    std::unique_lock<std::mutex> lock(self->received_mutex);
+    self->received.push_back(message->size());
+    self->received.insert(
+        self->received.end(), message->begin(), message->end()
+    );
+    if(self->on_input) self->on_input(self);
+}
@@ -23,6 +23,7 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <mutex>
 
 class midi_controller;
 class bindings;
@@ -55,6 +56,7 @@ public:
     ~midi_controller();
 
     bool poll(change_callback cb = {}, bool active = true) override;
+    void set_input_callback(input_callback cb) override;
 
     bool potentially_inactive() const override;
 
@@ -64,21 +66,57 @@ public:
     unsigned get_axis_count() const override;
     std::string get_axis_name(unsigned i) const override;
     axis get_axis_state(unsigned i) const override;
+    bool get_axis_expression(
+        unsigned i, double& bend, double& amplitude
+    ) const override;
 
     unsigned get_button_count() const override;
     std::string get_button_name(unsigned i) const override;
     unsigned get_button_state(unsigned i) const override;
 
 private:
+    // Called by RtMidi from its own thread.
+    static void receive(
+        double timestamp,
+        std::vector<unsigned char>* message,
+        void* data
+    );
+
+    // True if the channel is a member channel of an MPE zone.
+    bool is_mpe_member(unsigned channel) const;
+    // Lets the keys of the notes held on the channel see its new expression.
+    void notify_channel_notes(unsigned channel, change_callback& cb);
+
     midi_context* ctx;
     RtMidiIn in;
     std::string name;
 
+    // Messages received since the last poll(), stored back to back with each
+    // one prefixed by its length. The callback is also called with the mutex
+    // locked, so that it isn't replaced while in use.
+    std::mutex received_mutex;
+    std::vector<uint8_t> received, polled;
+    input_callback on_input;
+
     std::vector<uint8_t> note_velocity;
     std::vector<uint8_t> note_aftertouch;
     std::vector<uint16_t> control_axes;
     std::vector<bool> control_buttons;
     uint8_t program;
     uint16_t pitch_wheel;
+
+    // MPE zones are set up by the MPE configuration message. The member
+    // channels of a zone carry the pitch bend and pressure of one note each,
+    // while its master channel is used like a normal MIDI channel.
+    unsigned lower_zone_channels, upper_zone_channels;
+    std::vector<uint8_t> note_channel;
+    std::vector<uint16_t> channel_rpn;
+    std::vector<uint16_t> channel_bend;
+    std::vector<uint8_t> channel_bend_range;
+    std::vector<uint8_t> channel_pressure;
+    // Pressure is relative to the first pressure after the note-on, so that
+    // notes start at their normal volume.
+    std::vector<uint8_t> channel_pressure_reference;
+    std::vector<bool> channel_reference_pending;
 };
 #endif
@@ -0,0 +1,274 @@
+/*
+    Copyright 2019 Julius Ikkala
+
+    This file is part of CafeFM.
+
+    CafeFM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CafeFM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "convolver.hh"
+#include <sndfile.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+convolver::convolver()
+:   block_size(16)
+{
+}
+
+convolver::convolver(
+    const std::vector<float>& impulse_response,
+    unsigned block_size,
+    bool non_uniform
+){
+    // The real FFT of pffft needs a multiple of 32, and the FFT length is
+    // twice the block size.
+    this->block_size = 16;
+    while(this->block_size < block_size) this->block_size <<= 1;
+
+    const float* ir = impulse_response.data();
+    size_t ir_size = impulse_response.size();
+    stages.reserve(2);
+
+    // The tail stage outputs its blocks one tail length later, so the head
+    // must cover everything before that, minus the delay of the head itself.
+    unsigned tail_length = this->block_size * TAIL_RATIO;
+    size_t head_size = tail_length - this->block_size;
+    if(non_uniform && ir_size > head_size)
+    {
+        add_stage(ir, head_size, this->block_size);
+        add_stage(ir + head_size, ir_size - head_size, tail_length);
+    }
+    else add_stage(ir, ir_size, this->block_size);
+}
+
+convolver::~convolver()
+{
+    for(stage& s: stages) pffft_destroy_setup(s.setup);
+}
+
+unsigned convolver::get_block_size() const
+{
+    return block_size;
+}
+
+uint64_t convolver::get_tail_length() const
+{
+    // Each stage's output is delayed by one of its partitions.
+    uint64_t length = 0;
+    for(const stage& s: stages)
+        length += (uint64_t)(s.partitions + 1) * s.length;
+    return length;
+}
+
+std::vector<float> convolver::load_impulse_response(
+    const fs::path& path,
+    uint64_t samplerate
+){
+    std::string path_str = path.string();
+    SF_INFO info;
+    memset(&info, 0, sizeof(info));
+    SNDFILE* f = sf_open(path_str.c_str(), SFM_READ, &info);
+    if(!f) throw std::runtime_error("Unable to read file " + path_str);
+
+    if(info.frames > MAX_IMPULSE_LENGTH * info.samplerate)
+    {
+        sf_close(f);
+        throw std::runtime_error(
+            "This impulse response is too long. The maximum length is "
+            + std::to_string((int)MAX_IMPULSE_LENGTH) + " seconds."
+        );
+    }
+
+    std::vector<float> data(info.channels * info.frames, 0);
+    sf_readf_float(f, data.data(), info.frames);
+    sf_close(f);
+
+    // Linear interpolation is enough here, the response is mostly noise
+    // anyway.
+    double step = info.samplerate / (double)samplerate;
+    size_t length = info.frames / step;
+    std::vector<float> ir(length, 0);
+    for(size_t i = 0; i < length; ++i)
+    {
+        double t = i * step;
+        size_t j = t;
+        t -= j;
+        float a = data[j * info.channels];
+        float b = j + 1 < (size_t)info.frames ?
+            data[(j + 1) * info.channels] : 0.0f;
+        ir[i] = a + (b - a) * t;
+    }
+
+    double energy = 0;
+    for(float s: ir) energy += s * (double)s;
+    if(energy > 0)
+    {
+        float scale = 1.0 / sqrt(energy);
+        for(float& s: ir) s *= scale;
+    }
+    return ir;
+}
+
+void convolver::process(const double* in, double* out, unsigned long count)
+{
+    for(stage& s: stages)
+    {
+        unsigned long i = 0;
+        while(i < count)
+        {
+            unsigned n = std::min(
+                count - i, (unsigned long)(s.length - s.fill)
+            );
+            float* w = s.window.get() + s.length + s.fill;
+            const float* o = s.output.get() + s.fill;
+            for(unsigned j = 0; j < n; ++j)
+            {
+                w[j] = in[i + j];
+                out[i + j] += o[j];
+            }
+            s.fill += n;
+            i += n;
+
+            // Spread the older partitions evenly over the block, so that long
+            // tail partitions don't land on a single callback.
+            accumulate(
+                s, 1 + (uint64_t)(s.partitions - 1) * s.fill / s.length
+            );
+            if(s.fill == s.length) finish_block(s);
+        }
+    }
+}
+
+void convolver::reset()
+{
+    for(stage& s: stages)
+    {
+        unsigned fft_size = s.length * 2;
+        memset(s.fdl.get(), 0, s.partitions * fft_size * sizeof(float));
+        memset(s.window.get(), 0, fft_size * sizeof(float));
+        memset(s.accum.get(), 0, fft_size * sizeof(float));
+        memset(s.output.get(), 0, s.length * sizeof(float));
+        s.fill = 0;
+        s.next_partition = 1;
+    }
+}
+
+void convolver::aligned_deleter::operator()(float* ptr) const
+{
+    pffft_aligned_free(ptr);
+}
+
+convolver::aligned_buffer convolver::allocate(size_t count)
+{
+    float* ptr = (float*)pffft_aligned_malloc(count * sizeof(float));
+    if(!ptr) throw std::bad_alloc();
+    memset(ptr, 0, count * sizeof(float));
+    return aligned_buffer(ptr);
+}
+
+void convolver::add_stage(
+    const float* impulse_response,
+    size_t count,
+    unsigned length
+){
+    stage s;
+    unsigned fft_size = length * 2;
+    s.setup = pffft_new_setup(fft_size, PFFFT_REAL);
+    s.length = length;
+    s.partitions = std::max((count + length - 1) / length, (size_t)1);
+    s.ir = allocate(s.partitions * fft_size);
+    s.fdl = allocate(s.partitions * fft_size);
+    s.window = allocate(fft_size);
+    s.accum = allocate(fft_size);
+    s.result = allocate(fft_size);
+    s.work = allocate(fft_size);
+    s.output = allocate(length);
+    s.newest = 0;
+    s.fill = 0;
+    s.next_partition = 1;
+
+    // Each partition is zero-padded to twice its length, so that the last
+    // half of the circular convolution with the two latest input blocks is
+    // the linear convolution of the current block.
+    float scale = 1.0f / fft_size;
+    float* padded = s.result.get();
+    for(unsigned p = 0; p < s.partitions; ++p)
+    {
+        size_t offset = (size_t)p * length;
+        size_t n = offset < count ?
+            std::min(count - offset, (size_t)length) : 0;
+        memset(padded, 0, fft_size * sizeof(float));
+        for(size_t i = 0; i < n; ++i)
+            padded[i] = impulse_response[offset + i] * scale;
+
+        pffft_transform(
+            s.setup, padded, s.ir.get() + p * fft_size, s.work.get(),
+            PFFFT_FORWARD
+        );
+    }
+    memset(padded, 0, fft_size * sizeof(float));
+
+    stages.push_back(std::move(s));
+}
+
+void convolver::accumulate(stage& s, unsigned end_partition)
+{
+    unsigned fft_size = s.length * 2;
+    end_partition = std::min(end_partition, s.partitions);
+    // While the current block is being filled, the newest spectrum is that of
+    // the previous block, which is convolved with partition 1.
+    for(; s.next_partition < end_partition; ++s.next_partition)
+    {
+        unsigned slot =
+            (s.newest + s.partitions - (s.next_partition - 1)) % s.partitions;
+        pffft_zconvolve_accumulate(
+            s.setup,
+            s.fdl.get() + slot * fft_size,
+            s.ir.get() + s.next_partition * fft_size,
+            s.accum.get(),
+            1.0f
+        );
+    }
+}
+
+void convolver::finish_block(stage& s)
+{
+    unsigned fft_size = s.length * 2;
+    accumulate(s, s.partitions);
+
+    s.newest = (s.newest + 1) % s.partitions;
+    float* spectrum = s.fdl.get() + s.newest * fft_size;
+    pffft_transform(
+        s.setup, s.window.get(), spectrum, s.work.get(), PFFFT_FORWARD
+    );
+    pffft_zconvolve_accumulate(
+        s.setup, spectrum, s.ir.get(), s.accum.get(), 1.0f
+    );
+    pffft_transform(
+        s.setup, s.accum.get(), s.result.get(), s.work.get(), PFFFT_BACKWARD
+    );
+
+    memcpy(
+        s.output.get(), s.result.get() + s.length, s.length * sizeof(float)
+    );
+    memset(s.accum.get(), 0, fft_size * sizeof(float));
+    memcpy(
+        s.window.get(), s.window.get() + s.length, s.length * sizeof(float)
+    );
+
+    s.fill = 0;
+    s.next_partition = 1;
+}
@@ -0,0 +1,115 @@
+/*
+    Copyright 2019 Julius Ikkala
+
+    This file is part of CafeFM.
+
+    CafeFM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CafeFM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CAFEFM_CONVOLVER_HH
+#define CAFEFM_CONVOLVER_HH
+#include "pffft.h"
+#include "io.hh"
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+// Partitioned FFT convolution with an impulse response. The output is
+// delayed by exactly one block. All buffers are allocated by the
+// constructor, so process() is safe to call from the audio callback.
+class convolver
+{
+public:
+    // Tail partitions are this many times longer than the block size when
+    // non-uniform partitioning is used.
+    static constexpr unsigned TAIL_RATIO = 16;
+    static constexpr double MAX_IMPULSE_LENGTH = 20.0;
+
+    // Creates a convolver that outputs silence.
+    convolver();
+    // The block size is rounded up to a power of two, and is at least 16.
+    // With non-uniform partitioning, the part of the impulse response that
+    // fits within the delay of the tail uses block_size partitions and the
+    // rest uses TAIL_RATIO times longer partitions. This is much cheaper for
+    // long impulse responses, and the extra work for the tail is spread over
+    // the blocks in between.
+    convolver(
+        const std::vector<float>& impulse_response,
+        unsigned block_size,
+        bool non_uniform = false
+    );
+    convolver(const convolver& other) = delete;
+    ~convolver();
+
+    unsigned get_block_size() const;
+    // How many samples the output keeps going after the input stops.
+    uint64_t get_tail_length() const;
+
+    // Loads the first channel of an audio file, resampled to the given
+    // samplerate and normalized to unit energy. Throws on failure.
+    static std::vector<float> load_impulse_response(
+        const fs::path& path,
+        uint64_t samplerate
+    );
+
+    // Adds the convolved input to out.
+    void process(const double* in, double* out, unsigned long count);
+    // Clears the input history without reallocating.
+    void reset();
+
+private:
+    struct aligned_deleter
+    {
+        void operator()(float* ptr) const;
+    };
+    using aligned_buffer = std::unique_ptr<float[], aligned_deleter>;
+    static aligned_buffer allocate(size_t count);
+
+    // Uniformly partitioned convolution with one partition length.
+    struct stage
+    {
+        PFFFT_Setup* setup;
+        unsigned length;
+        unsigned partitions;
+
+        // Spectra of the impulse response partitions, scaled for the
+        // inverse transform.
+        aligned_buffer ir;
+        // Frequency-domain delay line of input spectra.
+        aligned_buffer fdl;
+        // The previous and current input blocks.
+        aligned_buffer window;
+        aligned_buffer accum;
+        aligned_buffer result;
+        aligned_buffer work;
+        // The output of the previous block, played during the current one.
+        aligned_buffer output;
+
+        unsigned newest;
+        unsigned fill;
+        unsigned next_partition;
+    };
+
+    void add_stage(
+        const float* impulse_response,
+        size_t count,
+        unsigned length
+    );
+    void accumulate(stage& s, unsigned end_partition);
+    void finish_block(stage& s);
+
+    unsigned block_size;
+    std::vector<stage> stages;
+};
+
+#endif
@@ -0,0 +1,523 @@
+/*
+    Copyright 2019 Julius Ikkala
+
+    This file is part of CafeFM.
+
+    CafeFM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CafeFM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _USE_MATH_DEFINES
+#include "effects.hh"
+#include "convolver.hh"
+#include <cmath>
+#include <algorithm>
+#include <climits>
+
+namespace
+{
+    // Delay line lengths of the reverb at 44100Hz and size 1. They're
+    // mutually prime so that the echoes don't pile up on the same samples.
+    const unsigned reverb_lengths[] = {
+        1116, 1188, 1277, 1356, 1422, 1491, 1557, 1617
+    };
+
+    // Minimum delay of the chorus, the modulation is added on top of this.
+    constexpr double CHORUS_BASE_DELAY = 0.005;
+
+    // Scratch buffer length; longer blocks are processed in pieces.
+    constexpr unsigned MAX_CHUNK = 1024;
+
+    // In-place, unnormalized Hadamard transform. Used as the feedback matrix
+    // of the reverb, since it mixes every line to every other line.
+    template<unsigned N>
+    void hadamard(double* v)
+    {
+        for(unsigned len = 1; len < N; len <<= 1)
+        {
+            for(unsigned i = 0; i < N; i += len << 1)
+            {
+                for(unsigned j = i; j < i + len; ++j)
+                {
+                    double a = v[j];
+                    double b = v[j + len];
+                    v[j] = a + b;
+                    v[j + len] = a - b;
+                }
+            }
+        }
+    }
+}
+
+effects_state::effects_state()
+{
+    delay.enabled = false;
+    delay.time = 0.3;
+    delay.feedback = 0.35;
+    delay.mix = 0.3;
+
+    chorus.enabled = false;
+    chorus.rate = 0.8;
+    chorus.depth = 0.004;
+    chorus.mix = 0.5;
+
+    reverb.enabled = false;
+    reverb.size = 1.0;
+    reverb.decay = 1.5;
+    reverb.damping = 0.3;
+    reverb.mix = 0.25;
+
+    convolution.enabled = false;
+    convolution.non_uniform = true;
+    convolution.mix = 0.3;
+}
+
+bool effects_state::operator==(const effects_state& other) const
+{
+    return delay.enabled == other.delay.enabled &&
+        delay.time == other.delay.time &&
+        delay.feedback == other.delay.feedback &&
+        delay.mix == other.delay.mix &&
+        chorus.enabled == other.chorus.enabled &&
+        chorus.rate == other.chorus.rate &&
+        chorus.depth == other.chorus.depth &&
+        chorus.mix == other.chorus.mix &&
+        reverb.enabled == other.reverb.enabled &&
+        reverb.size == other.reverb.size &&
+        reverb.decay == other.reverb.decay &&
+        reverb.damping == other.reverb.damping &&
+        reverb.mix == other.reverb.mix &&
+        convolution.enabled == other.convolution.enabled &&
+        convolution.non_uniform == other.convolution.non_uniform &&
+        convolution.mix == other.convolution.mix &&
+        convolution.impulse_response == other.convolution.impulse_response;
+}
+
+bool effects_state::operator!=(const effects_state& other) const
+{
+    return !(*this == other);
+}
+
+json effects_state::serialize() const
+{
+    json j;
+
+    j["delay"]["enabled"] = delay.enabled;
+    j["delay"]["time"] = delay.time;
+    j["delay"]["feedback"] = delay.feedback;
+    j["delay"]["mix"] = delay.mix;
+
+    j["chorus"]["enabled"] = chorus.enabled;
+    j["chorus"]["rate"] = chorus.rate;
+    j["chorus"]["depth"] = chorus.depth;
+    j["chorus"]["mix"] = chorus.mix;
+
+    j["reverb"]["enabled"] = reverb.enabled;
+    j["reverb"]["size"] = reverb.size;
+    j["reverb"]["decay"] = reverb.decay;
+    j["reverb"]["damping"] = reverb.damping;
+    j["reverb"]["mix"] = reverb.mix;
+
+    j["convolution"]["enabled"] = convolution.enabled;
+    j["convolution"]["non_uniform"] = convolution.non_uniform;
+    j["convolution"]["mix"] = convolution.mix;
+    j["convolution"]["impulse_response"] = convolution.impulse_response;
+
+    return j;
+}
+
+bool effects_state::deserialize(const json& j)
+{
+    *this = effects_state();
+
+    if(j.count("delay"))
+    {
+        const json& d = j.at("delay");
+        delay.enabled = d.value("enabled", delay.enabled);
+        delay.time = d.value("time", delay.time);
+        delay.feedback = d.value("feedback", delay.feedback);
+        delay.mix = d.value("mix", delay.mix);
+    }
+
+    if(j.count("chorus"))
+    {
+        const json& c = j.at("chorus");
+        chorus.enabled = c.value("enabled", chorus.enabled);
+        chorus.rate = c.value("rate", chorus.rate);
+        chorus.depth = c.value("depth", chorus.depth);
+        chorus.mix = c.value("mix", chorus.mix);
+    }
+
+    if(j.count("reverb"))
+    {
+        const json& r = j.at("reverb");
+        reverb.enabled = r.value("enabled", reverb.enabled);
+        reverb.size = r.value("size", reverb.size);
+        reverb.decay = r.value("decay", reverb.decay);
+        reverb.damping = r.value("damping", reverb.damping);
+        reverb.mix = r.value("mix", reverb.mix);
+    }
+
+    if(j.count("convolution"))
+    {
+        const json& c = j.at("convolution");
+        convolution.enabled = c.value("enabled", convolution.enabled);
+        convolution.non_uniform = c.value(
+            "non_uniform", convolution.non_uniform
+        );
+        convolution.mix = c.value("mix", convolution.mix);
+        convolution.impulse_response = c.value(
+            "impulse_response", convolution.impulse_response
+        );
+    }
+
+    return true;
+}
+
+void effects_chain::delay_line::resize(unsigned length)
+{
+    data.assign(length, 0.0);
+    head = 0;
+}
+
+void effects_chain::delay_line::push(double x)
+{
+    if(++head == data.size()) head = 0;
+    data[head] = x;
+}
+
+double effects_chain::delay_line::tap(unsigned delay) const
+{
+    unsigned i = head + data.size() - (delay - 1);
+    if(i >= data.size()) i -= data.size();
+    return data[i];
+}
+
+double effects_chain::delay_line::tap(double delay) const
+{
+    unsigned i = delay;
+    double t = delay - i;
+    return tap(i) + (tap(i+1) - tap(i)) * t;
+}
+
+effects_chain::effects_chain(uint64_t samplerate)
+:   samplerate(samplerate), queue_head(0), queue_tail(0), has_pending(false),
+    next_convolver(nullptr), retired_convolver(nullptr),
+    loaded_non_uniform(false), block_size(256),
+    active_convolver(new convolver()), tail_length(0), silent_samples(0),
+    delay_length(1), chorus_phase(0),
+    chorus_step(0), reverb_damping(0)
+{
+    scratch.resize(MAX_CHUNK);
+    wet.resize(MAX_CHUNK);
+    delay.resize(MAX_DELAY_TIME * samplerate + 1);
+    chorus.resize(
+        (CHORUS_BASE_DELAY + 2.0 * MAX_CHORUS_DEPTH) * samplerate + 3
+    );
+    for(unsigned i = 0; i < REVERB_LINES; ++i)
+    {
+        reverb[i].line.resize(
+            reverb_lengths[i] * MAX_REVERB_SIZE * samplerate / 44100.0 + 1
+        );
+        reverb[i].length = 1;
+        reverb[i].gain = 0;
+        reverb[i].lowpass = 0;
+    }
+    update_parameters();
+}
+
+effects_chain::~effects_chain()
+{
+    delete active_convolver;
+    delete next_convolver.load();
+    delete retired_convolver.load();
+}
+
+void effects_chain::set_state(const effects_state& state)
+{
+    pending = state;
+    has_pending = true;
+    if(
+        state.convolution.impulse_response != loaded_impulse_response ||
+        state.convolution.non_uniform != loaded_non_uniform
+    ){
+        loaded_impulse_response = state.convolution.impulse_response;
+        loaded_non_uniform = state.convolution.non_uniform;
+        load_convolver();
+    }
+    flush();
+}
+
+bool effects_chain::flush()
+{
+    delete retired_convolver.exchange(nullptr, std::memory_order_acquire);
+    if(
+        pending_convolver &&
+        !next_convolver.load(std::memory_order_acquire) &&
+        !retired_convolver.load(std::memory_order_acquire)
+    ) next_convolver.store(
+        pending_convolver.release(), std::memory_order_release
+    );
+
+    if(!has_pending) return !pending_convolver;
+
+    unsigned head = queue_head.load(std::memory_order_relaxed);
+    unsigned tail = queue_tail.load(std::memory_order_acquire);
+    if(head - tail >= QUEUE_SIZE) return false;
+
+    queue[head % QUEUE_SIZE] = pending;
+    queue_head.store(head + 1, std::memory_order_release);
+    has_pending = false;
+    return !pending_convolver;
+}
+
+void effects_chain::set_block_size(unsigned block_size)
+{
+    if(this->block_size == block_size) return;
+    this->block_size = block_size;
+    if(!loaded_impulse_response.empty())
+    {
+        load_convolver();
+        flush();
+    }
+}
+
+void effects_chain::apply(int32_t* samples, unsigned long framecount)
+{
+    receive_messages();
+
+    if(
+        !state.delay.enabled && !state.chorus.enabled &&
+        !state.reverb.enabled && !state.convolution.enabled
+    ) return;
+
+    if(std::any_of(
+        samples, samples + framecount, [](int32_t s){ return s != 0; }
+    )) silent_samples = 0;
+    else if(silent_samples >= tail_length) return;
+    else silent_samples += framecount;
+
+    for(unsigned long offset = 0; offset < framecount; offset += MAX_CHUNK)
+    {
+        unsigned long count = std::min(
+            framecount - offset, (unsigned long)MAX_CHUNK
+        );
+        double* x = scratch.data();
+        int32_t* s = samples + offset;
+        for(unsigned long i = 0; i < count; ++i) x[i] = s[i];
+
+        if(state.chorus.enabled) apply_chorus(x, count);
+        if(state.delay.enabled) apply_delay(x, count);
+        if(state.convolution.enabled) apply_convolution(x, count);
+        if(state.reverb.enabled) apply_reverb(x, count);
+
+        for(unsigned long i = 0; i < count; ++i)
+            s[i] = std::clamp(x[i], (double)INT32_MIN, (double)INT32_MAX);
+    }
+}
+
+bool effects_chain::is_silent() const
+{
+    return silent_samples >= tail_length || (
+        !state.delay.enabled && !state.chorus.enabled &&
+        !state.reverb.enabled && !state.convolution.enabled
+    );
+}
+
+void effects_chain::receive_messages()
+{
+
+    convolver* c = next_convolver.exchange(nullptr, std::memory_order_acquire);
+    if(c)
+    {
+        retired_convolver.store(active_convolver, std::memory_order_release);
+        active_convolver = c;
+        update_tail_length();
+    }
+
+    unsigned tail = queue_tail.load(std::memory_order_relaxed);
+    unsigned head = queue_head.load(std::memory_order_acquire);
+    if(head == tail) return;
+
+    // Only the latest state matters, older ones would be overwritten anyway.
+    // Swapping avoids copying the impulse response path, which would
+    // allocate.
+    bool delay_enabled = state.delay.enabled;
+    bool chorus_enabled = state.chorus.enabled;
+    bool reverb_enabled = state.reverb.enabled;
+    bool convolution_enabled = state.convolution.enabled;
+    std::swap(state, queue[(head - 1) % QUEUE_SIZE]);
+    queue_tail.store(head, std::memory_order_release);
+
+    // Don't let effects that were turned off replay their old contents.
+    if(state.delay.enabled && !delay_enabled)
+        std::fill(delay.data.begin(), delay.data.end(), 0.0);
+    if(state.chorus.enabled && !chorus_enabled)
+        std::fill(chorus.data.begin(), chorus.data.end(), 0.0);
+    if(state.convolution.enabled && !convolution_enabled)
+        active_convolver->reset();
+    if(state.reverb.enabled && !reverb_enabled)
+    {
+        for(unsigned i = 0; i < REVERB_LINES; ++i)
+        {
+            std::fill(
+                reverb[i].line.data.begin(), reverb[i].line.data.end(), 0.0
+            );
+            reverb[i].lowpass = 0;
+        }
+    }
+
+    update_parameters();
+}
+
+void effects_chain::update_parameters()
+{
+    delay_length = std::clamp(
+        (unsigned)round(state.delay.time * samplerate),
+        1u, (unsigned)delay.data.size()
+    );
+
+    chorus_step = 2.0 * M_PI * state.chorus.rate / samplerate;
+
+    double size = std::clamp(state.reverb.size, 0.1, MAX_REVERB_SIZE);
+    double decay = std::max(state.reverb.decay, 0.01);
+    for(unsigned i = 0; i < REVERB_LINES; ++i)
+    {
+        reverb[i].length = std::clamp(
+            (unsigned)(reverb_lengths[i] * size * samplerate / 44100.0),
+            1u, (unsigned)reverb[i].line.data.size()
+        );
+        // Each pass through the line must lose its share of 60dB.
+        reverb[i].gain = pow(
+            10.0, -3.0 * reverb[i].length / (decay * samplerate)
+        );
+    }
+    reverb_damping = std::clamp(state.reverb.damping, 0.0, 0.95);
+    update_tail_length();
+}
+
+void effects_chain::update_tail_length()
+{
+    // Decaying by this much takes anything down from full scale to below
+    // 1 LSB.
+    const double full_scale_db = 20.0 * log10(4294967296.0);
+    // The effects run in series, so their tails add up.
+    double length = 0;
+    if(state.chorus.enabled) length += chorus.data.size();
+    if(state.delay.enabled)
+    {
+        double feedback = fabs(state.delay.feedback);
+        if(feedback >= 1.0) length = INFINITY;
+        else
+        {
+            double echoes = feedback > 0 ?
+                ceil(full_scale_db / (-20.0 * log10(feedback))) : 0;
+            length += (echoes + 1) * delay_length;
+        }
+    }
+    if(state.convolution.enabled)
+        length += active_convolver->get_tail_length();
+    if(state.reverb.enabled)
+    {
+        double decay = std::max(state.reverb.decay, 0.01);
+        unsigned longest = 0;
+        for(unsigned i = 0; i < REVERB_LINES; ++i)
+            longest = std::max(longest, reverb[i].length);
+        length += full_scale_db / 60.0 * decay * samplerate + longest;
+    }
+    tail_length = length < (double)UINT64_MAX ? (uint64_t)length : UINT64_MAX;
+    silent_samples = 0;
+}
+
+void effects_chain::apply_delay(double* x, unsigned long count)
+{
+    double feedback = state.delay.feedback;
+    double mix = state.delay.mix;
+    for(unsigned long i = 0; i < count; ++i)
+    {
+        double d = delay.tap(delay_length);
+        delay.push(x[i] + feedback * d);
+        x[i] += mix * d;
+    }
+}
+
+void effects_chain::apply_chorus(double* x, unsigned long count)
+{
+    double depth = std::clamp(state.chorus.depth, 0.0, MAX_CHORUS_DEPTH);
+    double mix = state.chorus.mix;
+    double max_delay = chorus.data.size() - 1;
+    for(unsigned long i = 0; i < count; ++i)
+    {
+        double d = (
+            CHORUS_BASE_DELAY + depth * (1.0 + sin(chorus_phase))
+        ) * samplerate;
+        double wet = chorus.tap(std::clamp(d, 1.0, max_delay));
+        chorus.push(x[i]);
+        x[i] = (1.0 - 0.5 * mix) * x[i] + 0.5 * mix * wet;
+
+        chorus_phase += chorus_step;
+        if(chorus_phase > 2.0 * M_PI) chorus_phase -= 2.0 * M_PI;
+    }
+}
+
+void effects_chain::load_convolver()
+{
+    // An empty convolver is sent first, so that the old impulse response
+    // stops playing even if loading the new one fails.
+    pending_convolver.reset(new convolver());
+    if(loaded_impulse_response.empty()) return;
+
+    pending_convolver.reset(new convolver(
+        convolver::load_impulse_response(loaded_impulse_response, samplerate),
+        block_size,
+        loaded_non_uniform
+    ));
+}
+
+void effects_chain::apply_convolution(double* x, unsigned long count)
+{
+    double mix = state.convolution.mix;
+    double* w = wet.data();
+    std::fill(w, w + count, 0.0);
+    active_convolver->process(x, w, count);
+    for(unsigned long i = 0; i < count; ++i) x[i] += mix * w[i];
+}
+
+void effects_chain::apply_reverb(double* x, unsigned long count)
+{
+    // Keeps the feedback network from decaying into denormals in silence.
+    constexpr double ANTI_DENORMAL = 1e-10;
+    const double norm = 1.0 / sqrt((double)REVERB_LINES);
+    double mix = state.reverb.mix;
+    double damping = reverb_damping;
+
+    for(unsigned long i = 0; i < count; ++i)
+    {
+        double v[REVERB_LINES];
+        double wet = 0;
+        for(unsigned j = 0; j < REVERB_LINES; ++j)
+        {
+            double y = reverb[j].line.tap(reverb[j].length);
+            reverb[j].lowpass = y + damping * (reverb[j].lowpass - y);
+            v[j] = reverb[j].lowpass * reverb[j].gain;
+            wet += v[j];
+        }
+
+        hadamard<REVERB_LINES>(v);
+
+        double in = x[i] * norm + ANTI_DENORMAL;
+        for(unsigned j = 0; j < REVERB_LINES; ++j)
+            reverb[j].line.push(in + v[j] * norm);
+
+        x[i] += mix * wet * norm;
+    }
+}
@@ -0,0 +1,177 @@
+/*
+    Copyright 2019 Julius Ikkala
+
+    This file is part of CafeFM.
+
+    CafeFM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CafeFM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CAFEFM_EFFECTS_HH
+#define CAFEFM_EFFECTS_HH
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include "io.hh"
+
+struct effects_state
+{
+    effects_state();
+
+    struct
+    {
+        bool enabled;
+        double time; // In seconds
+        double feedback;
+        double mix;
+    } delay;
+
+    struct
+    {
+        bool enabled;
+        double rate; // In Hz
+        double depth; // In seconds
+        double mix;
+    } chorus;
+
+    struct
+    {
+        bool enabled;
+        double size; // Relative room size, scales the delay line lengths.
+        double decay; // Time to decay by 60dB, in seconds
+        double damping; // 0 - no high frequency loss, 1 - maximum loss
+        double mix;
+    } reverb;
+
+    struct
+    {
+        bool enabled;
+        bool non_uniform;
+        double mix;
+        std::string impulse_response; // Path to an audio file
+    } convolution;
+
+    bool operator==(const effects_state& other) const;
+    bool operator!=(const effects_state& other) const;
+
+    json serialize() const;
+    bool deserialize(const json& j);
+};
+
+class convolver;
+
+// Effects applied to the final mix. All buffers are allocated by the
+// constructor, or in the calling thread of set_state() for convolution, so
+// apply() never allocates and is safe to run in the audio callback.
+class effects_chain
+{
+public:
+    static constexpr double MAX_DELAY_TIME = 2.0;
+    static constexpr double MAX_CHORUS_DEPTH = 0.02;
+    static constexpr double MAX_REVERB_SIZE = 2.0;
+
+    explicit effects_chain(uint64_t samplerate = 44100);
+    effects_chain(const effects_chain& other) = delete;
+    ~effects_chain();
+
+    // Can be called from a different thread than apply(). The state is
+    // passed through a lock-free queue and takes effect on the next block.
+    // Loads the impulse response for convolution if it has changed, which
+    // throws if the file can't be read.
+    void set_state(const effects_state& state);
+    // Retries sending a state or convolver that didn't fit in the queue, and
+    // frees convolvers that are no longer used. Returns true if nothing is
+    // left pending.
+    bool flush();
+
+    // Sets the partition size of convolution, which is also its latency.
+    // Call from the same thread as set_state().
+    void set_block_size(unsigned block_size);
+
+    void apply(int32_t* samples, unsigned long framecount);
+    // True if the effects have rung out, so that they output nothing until
+    // they get input again. Call from the thread calling apply().
+    bool is_silent() const;
+
+private:
+    static constexpr unsigned REVERB_LINES = 8;
+    static constexpr unsigned QUEUE_SIZE = 8;
+
+    struct delay_line
+    {
+        std::vector<double> data;
+        unsigned head;
+
+        void resize(unsigned length);
+        void push(double x);
+        // delay must be in [1, data.size()].
+        double tap(unsigned delay) const;
+        // Linearly interpolated, delay must be in [1, data.size()-1].
+        double tap(double delay) const;
+    };
+
+    void receive_messages();
+    void update_parameters();
+    void update_tail_length();
+    void load_convolver();
+
+    void apply_delay(double* x, unsigned long count);
+    void apply_chorus(double* x, unsigned long count);
+    void apply_convolution(double* x, unsigned long count);
+    void apply_reverb(double* x, unsigned long count);
+
+    uint64_t samplerate;
+
+    // Single producer, single consumer. Only the GUI thread writes
+    // queue_head and pending, only the audio thread writes queue_tail.
+    effects_state queue[QUEUE_SIZE];
+    std::atomic_uint queue_head, queue_tail;
+    effects_state pending;
+    bool has_pending;
+
+    // Convolvers are handed over one at a time. The audio thread takes
+    // next_convolver and puts the one it replaced to retired_convolver, and
+    // the other thread only sends a new one once both are empty.
+    std::atomic<convolver*> next_convolver, retired_convolver;
+    std::unique_ptr<convolver> pending_convolver;
+    std::string loaded_impulse_response;
+    bool loaded_non_uniform;
+    unsigned block_size;
+
+    // Only accessed by the audio thread.
+    effects_state state;
+    std::vector<double> scratch, wet;
+    convolver* active_convolver;
+    // Once the input has been silent for tail_length samples, everything
+    // left in the effects is below 1 LSB and they're skipped.
+    uint64_t tail_length;
+    uint64_t silent_samples;
+
+    delay_line delay;
+    unsigned delay_length;
+
+    delay_line chorus;
+    double chorus_phase, chorus_step;
+
+    struct
+    {
+        delay_line line;
+        unsigned length;
+        double gain;
+        double lowpass;
+    } reverb[REVERB_LINES];
+    double reverb_damping;
+};
+
+#endif
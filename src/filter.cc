@@ -21,6 +21,8 @@
 #include "helpers.hh"
 #include <cmath>
 #include <complex>
+#include <algorithm>
+#include <climits>
 
 namespace
 {
@@ -28,290 +30,308 @@ namespace
         "NONE", "LOW_PASS", "HIGH_PASS", "BAND_PASS", "BAND_STOP"
     };
 
-    void butterworth_lowpass(
-        unsigned order,
-        double cutoff,
-        std::vector<double>& d,
-        std::vector<double>& c
-    ){
-        std::vector<std::complex<double>> a;
-        cutoff = M_PI * cutoff;
-        double sc = sin(cutoff), cc = cos(cutoff);
+    // Analog second-order section, coefficients in order of descending powers
+    // of s.
+    struct analog_biquad
+    {
+        double b[3];
+        double a[3];
+    };
 
-        a.resize(order, 0);
-        for(unsigned i = 0; i < order; ++i)
-        {
-            double pole = M_PI * (2 * i + 1) / (2 * order);
-            std::complex<double> r(-cc, -sc * cos(pole));
-            r /= (1.0 + sc * sin(pole));
-            for(unsigned j = i; j > 0; --j) a[j] += r*a[j-1];
-            a[0] += r;
-        }
+    // Poles of the normalized analog Butterworth prototype that have a
+    // non-negative imaginary part. The rest are their conjugates. If the order
+    // is odd, the last one is the real pole at -1.
+    std::vector<std::complex<double>> butterworth_poles(unsigned order)
+    {
+        std::vector<std::complex<double>> poles;
+        for(unsigned k = 0; k < (order+1)/2; ++k)
+            poles.push_back(std::polar(1.0, M_PI*(2*k+order+1)/(2*order)));
+        return poles;
+    }
+
+    // Pre-warped analog frequency for the bilinear transform with
+    // s = (1 - z^-1)/(1 + z^-1).
+    double prewarp(double f, uint64_t samplerate)
+    {
+        f = std::clamp(f, 1e-4*samplerate, 0.4999*samplerate);
+        return tan(M_PI * f / samplerate);
+    }
 
-        d.resize(order+1);
-        d[0] = 1.0;
-        for(unsigned i = 0; i < order; ++i)
-            d[i+1] = a[i].real();
+    analog_biquad conjugate_denominator(
+        std::complex<double> pole,
+        double b2, double b1, double b0
+    ){
+        return {{b2, b1, b0}, {1.0, -2.0*pole.real(), std::norm(pole)}};
+    }
 
-        double scale = 1.0;
-        for(unsigned i = 0; i < order/2; ++i)
+    void design_lowpass(
+        unsigned order, double w, std::vector<analog_biquad>& out
+    ){
+        for(std::complex<double> p: butterworth_poles(order))
         {
-            double pole = M_PI * (2 * i + 1) / (2 * order);
-            scale *= 1.0 + sc * sin(pole);
+            if(p.imag() > 1e-9)
+                out.push_back(conjugate_denominator(w*p, 0.0, 0.0, w*w));
+            else out.push_back({{0.0, 0.0, w}, {0.0, 1.0, w}});
         }
+    }
 
-        sc = sin(cutoff * 0.5f); cc = cos(cutoff * 0.5f);
-
-        if(order & 1) scale *= sc + cc;
-        scale = pow(sc, order) / scale;
-
-        c.resize(order+1, scale);
-        for(unsigned i = 1; i <= order/2; ++i)
+    void design_highpass(
+        unsigned order, double w, std::vector<analog_biquad>& out
+    ){
+        for(std::complex<double> p: butterworth_poles(order))
         {
-            c[i] = (order-i+1)*c[i-1]/i;
-            c[order-i] = c[i];
+            // |p| = 1, so w/p = w*conj(p), which has the same real part.
+            if(p.imag() > 1e-9)
+                out.push_back(conjugate_denominator(w*p, 1.0, 0.0, 0.0));
+            else out.push_back({{0.0, 1.0, 0.0}, {0.0, 1.0, w}});
         }
     }
 
-    void butterworth_highpass(
+    // Each prototype pole p maps to the roots of s^2 + c1*s + w0^2. Complex
+    // prototype poles give two conjugate pairs, real ones a single quadratic.
+    void design_bandpass_bandstop(
         unsigned order,
-        double cutoff,
-        std::vector<double>& d,
-        std::vector<double>& c
+        double w1,
+        double w2,
+        bool stop,
+        std::vector<analog_biquad>& out
     ){
-        std::vector<std::complex<double>> a;
-        cutoff = M_PI * cutoff;
-        double sc = sin(cutoff), cc = cos(cutoff);
+        double w0 = sqrt(w1*w2);
+        double bw = w2 - w1;
+        double w02 = w0*w0;
+
+        double b2 = stop ? 1.0 : 0.0;
+        double b1 = stop ? 0.0 : bw;
+        double b0 = stop ? w02 : 0.0;
 
-        a.resize(order, 0);
-        for(unsigned i = 0; i < order; ++i)
+        for(std::complex<double> p: butterworth_poles(order))
         {
-            double pole = M_PI * (2 * i + 1) / (2 * order);
-            std::complex<double> r(-cc, -sc * cos(pole));
-            r /= (1.0 + sc * sin(pole));
-            for(unsigned j = i; j > 0; --j) a[j] += r*a[j-1];
-            a[0] += r;
+            std::complex<double> c1 = stop ? -bw/p : -bw*p;
+            if(p.imag() > 1e-9)
+            {
+                std::complex<double> d = sqrt(c1*c1 - 4.0*w02);
+                std::complex<double> r1 = (-c1 + d)*0.5;
+                std::complex<double> r2 = (-c1 - d)*0.5;
+                out.push_back(conjugate_denominator(r1, b2, b1, b0));
+                out.push_back(conjugate_denominator(r2, b2, b1, b0));
+            }
+            else out.push_back({{b2, b1, b0}, {1.0, c1.real(), w02}});
         }
+    }
 
-        d.resize(order+1);
-        d[0] = 1.0;
-        for(unsigned i = 0; i < order; ++i)
-            d[i+1] = a[i].real();
-
-        double scale = 1.0;
-        for(unsigned i = 0; i < order/2; ++i)
+    // Rewrites an analog section in the state-variable form used by filter.
+    // The pole frequency is stored unwarped, so that it can be scaled later.
+    filter::stage to_stage(const analog_biquad& s)
+    {
+        filter::stage st;
+        double w;
+        if(s.a[0] == 0)
         {
-            double pole = M_PI * (2 * i + 1) / (2 * order);
-            scale *= 1.0 + sc * sin(pole);
+            w = s.a[2]/s.a[1];
+            st.k = 0.0;
+            st.hp = s.b[1]/s.a[1];
+            st.bp = 0.0;
+            st.lp = s.b[2]/(s.a[1]*w);
+            st.first_order = true;
         }
-
-        sc = sin(cutoff * 0.5f); cc = cos(cutoff * 0.5f);
-
-        if(order & 1) scale *= sc + cc;
-        scale = pow(cc, order) / scale;
-
-        c.resize(order+1, scale);
-        for(unsigned i = 1; i <= order/2; ++i)
+        else
         {
-            c[i] = (order-i+1)*c[i-1]/i;
-            c[order-i] = c[i];
+            w = sqrt(s.a[2]/s.a[0]);
+            st.k = s.a[1]/(s.a[0]*w);
+            st.hp = s.b[0]/s.a[0];
+            st.bp = s.b[1]/(s.a[0]*w);
+            st.lp = s.b[2]/(s.a[0]*w*w);
+            st.first_order = false;
         }
-
-        for(unsigned i = 0; i <= order; ++i) if(i&1) c[i] = -c[i];
+        st.freq = atan(w)/M_PI;
+        return st;
     }
 
-    void butterworth_bandpass(
-        unsigned order,
-        double cutoff,
-        double bandwidth,
-        std::vector<double>& d,
-        std::vector<double>& c
-    ){
-        std::vector<std::complex<double>> a;
-        cutoff = M_PI * cutoff;
-        bandwidth = M_PI * bandwidth;
-
-        double cc = cos(cutoff);
-        double sb = sin(bandwidth), cb = cos(bandwidth);
-        double s2b = sin(2*bandwidth), c2b = cos(2*bandwidth);
-        double itb = 1.0 / tan(bandwidth);
+    filter design_filter(std::vector<analog_biquad>& analog)
+    {
+        // Put the sections with the sharpest resonances last, so that they
+        // get the signal with the most of the other bands already removed.
+        auto q = [](const analog_biquad& s){
+            return s.a[1] == 0 ? 0.0 : sqrt(fabs(s.a[0]*s.a[2]))/fabs(s.a[1]);
+        };
+        std::stable_sort(
+            analog.begin(), analog.end(),
+            [&](const analog_biquad& a, const analog_biquad& b){
+                return q(a) < q(b);
+            }
+        );
+
+        std::vector<filter::stage> stages;
+        for(const analog_biquad& s: analog) stages.push_back(to_stage(s));
+        return filter(stages);
+    }
 
-        std::complex<double> scaling(1.0, 0.0);
-        a.resize(2*order, 0);
+    // tan(pi*x) for x in [0, MAX_FREQ], so that modulated sections don't
+    // need to call tan() whenever their cutoff moves.
+    constexpr unsigned TAN_TABLE_SIZE = 4096;
+    constexpr double MAX_FREQ = 0.49;
 
-        for(unsigned i = 0; i < order; ++i)
+    struct tan_table
+    {
+        tan_table()
         {
-            double pole = M_PI * (2 * i + 1) / (2 * order);
-            double sp = sin(pole), cp = cos(pole);
-            std::complex<double> poled(sp, cp);
-            double m = 1.0 + s2b*sp;
-            auto r = std::complex<double>(c2b, s2b*cp)/m;
-            auto t = -2.0*cc*std::complex(cb+sb*sp, sb*cp)/m;
-
-            if(i != 0) a[2*i+1] += r * a[2*i-1];
-
-            for(unsigned j = 2*i; j > 1; --j)
-                a[j] += t * a[j-1] + r * a[j-2];
-
-            a[1] += t * a[0] + r;
-            a[0] += t;
-
-            scaling = scaling * itb + scaling * poled;
+            for(unsigned i = 0; i <= TAN_TABLE_SIZE; ++i)
+                values[i] = tan(M_PI * MAX_FREQ * i / TAN_TABLE_SIZE);
         }
 
-        double scale = 1.0 / scaling.real();
-
-        d.resize(2*order+1);
-        d[0] = 1.0;
-        for(unsigned i = 0; i < 2*order; ++i)
-            d[i+1] = a[i].real();
-
-        std::vector<double> tmp(order+1, scale);
-        for(unsigned i = 1; i <= order/2; ++i)
+        double operator()(double x) const
         {
-            tmp[i] = (order-i+1)*tmp[i-1]/i;
-            tmp[order-i] = tmp[i];
+            x = std::clamp(x, 1e-5, MAX_FREQ) * (TAN_TABLE_SIZE / MAX_FREQ);
+            unsigned i = std::min((unsigned)x, TAN_TABLE_SIZE-1);
+            double t = x - i;
+            return values[i] + (values[i+1] - values[i]) * t;
         }
 
-        c.resize(2*order+1, 0.0);
-        for(unsigned i = 0; i <= order; ++i)
-            c[2*i] = (i&1)?-tmp[i]:tmp[i];
-    }
-
-    void butterworth_bandstop(
-        unsigned order,
-        double cutoff,
-        double bandwidth,
-        std::vector<double>& d,
-        std::vector<double>& c
-    ){
-        std::vector<std::complex<double>> a;
-        cutoff = M_PI * cutoff;
-        bandwidth = M_PI * bandwidth;
-
-        double cc = cos(cutoff);
-        double sb = sin(bandwidth), cb = cos(bandwidth);
-        double s2b = sin(2*bandwidth), c2b = cos(2*bandwidth);
-        double tb = tan(bandwidth);
+        double values[TAN_TABLE_SIZE+1];
+    };
 
-        std::complex<double> scaling(1.0, 0.0);
-        a.resize(2*order, 0);
+    const tan_table prewarp_table;
 
-        for(unsigned i = 0; i < order; ++i)
+    double bessel_i0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for(unsigned k = 1; term > 1e-12 * sum; ++k)
         {
-            double pole = M_PI * (2 * i + 1) / (2 * order);
-            double sp = sin(pole), cp = cos(pole);
-            std::complex<double> poled(sp, cp);
-            double m = 1.0 + s2b*sp;
-            auto r = std::complex<double>(c2b, -s2b*cp)/m;
-            auto t = -2.0*cc*std::complex(cb+sb*sp, -sb*cp)/m;
-
-            if(i != 0) a[2*i+1] += r * a[2*i-1];
-
-            for(unsigned j = 2*i; j > 1; --j)
-                a[j] += t * a[j-1] + r * a[j-2];
-
-            a[1] += t * a[0] + r;
-            a[0] += t;
-
-            scaling = scaling * tb + scaling * poled;
+            term *= (x * x) / (4.0 * k * k);
+            sum += term;
         }
+        return sum;
+    }
 
-        double scale = 1.0 / scaling.real();
-
-        d.resize(2*order+1);
-        d[0] = 1.0;
-        for(unsigned i = 0; i < 2*order; ++i)
-            d[i+1] = a[i].real();
-
-        c.resize(2*order+1, 0.0);
-
-        double alpha = -2.0 * cc / cb;
-        c[0] = 1.0;
-        c[1] = alpha;
-        c[2] = 1.0;
-      
-        for(unsigned i = 1; i < order; ++i)
+    // Kaiser-windowed half-band lowpass. Returns the coefficients of the odd
+    // taps on one side, the center tap is 1/2.
+    std::vector<double> halfband_coefficients(unsigned half_taps, double beta)
+    {
+        std::vector<double> coef(half_taps);
+        double length = 2.0 * half_taps;
+        double sum = 0;
+        for(unsigned m = 0; m < half_taps; ++m)
         {
-            c[2*i+2] += c[2*i];
-            for(unsigned j = 2*i; j > 1; --j)
-                c[j+1] += alpha * c[j] + c[j-1];
-            c[2] += alpha * c[1] + 1.0;
-            c[1] += alpha;
+            double n = 2 * m + 1;
+            double r = n / length;
+            double sign = m & 1 ? -1.0 : 1.0;
+            coef[m] = sign / (M_PI * n) *
+                bessel_i0(beta * sqrt(1.0 - r * r)) / bessel_i0(beta);
+            sum += coef[m];
         }
-        for(unsigned i = 0; i < 2*order+1; ++i) c[i] *= scale;
+        // Normalize for unity gain at DC.
+        for(double& c: coef) c *= 0.25 / sum;
+        return coef;
     }
 }
 
-filter::filter(
-    const std::vector<double>& feedforward_coef,
-    const std::vector<double>& feedback_coef
-):  feedforward_coef(feedforward_coef.size()-1),
-    feedback_coef(feedback_coef.size()-1),
-    input_head(0), input(feedforward_coef.size()-1, 0),
-    output_head(0), output(feedback_coef.size()-1, 0)
+filter::filter()
+:   cutoff_mul(1.0), resonance_mul(1.0)
 {
-    double feedback_first = feedback_coef[0];
-    feedforward_first = feedforward_coef[0]/feedback_first;
+}
 
-    for(unsigned i = 0; i < this->feedforward_coef.size(); ++i)
-        this->feedforward_coef[i] = feedforward_coef[i + 1]/feedback_first;
-    for(unsigned i = 0; i < this->feedback_coef.size(); ++i)
-        this->feedback_coef[i] = -feedback_coef[i + 1]/feedback_first;
+filter::filter(const std::vector<stage>& stages)
+:   cutoff_mul(1.0), resonance_mul(1.0)
+{
+    for(const stage& st: stages)
+        sections.push_back({st, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0});
+    update_coefficients();
 }
 
 filter::filter(const filter& other)
-:   feedforward_first(other.feedforward_first),
-    feedforward_coef(other.feedforward_coef),
-    feedback_coef(other.feedback_coef),
-    input_head(other.input_head), input(other.input),
-    output_head(other.output_head), output(other.output)
+:   sections(other.sections), cutoff_mul(other.cutoff_mul),
+    resonance_mul(other.resonance_mul)
 {
 }
 
 filter::filter(filter&& other)
-:   feedforward_first(other.feedforward_first),
-    feedforward_coef(std::move(other.feedforward_coef)),
-    feedback_coef(std::move(other.feedback_coef)),
-    input_head(other.input_head), input(std::move(other.input)),
-    output_head(other.output_head), output(std::move(other.output))
+:   sections(std::move(other.sections)), cutoff_mul(other.cutoff_mul),
+    resonance_mul(other.resonance_mul)
 {
 }
 
-int32_t filter::push(int32_t sample)
+void filter::set_modulation(double cutoff_mul, double resonance_mul)
 {
-    double output_sample = feedforward_first * (double)sample;
-    unsigned i = 0, j = input_head;
-    unsigned first_len = feedforward_coef.size() - j;
-    unsigned second_len = feedforward_coef.size() - first_len;
-    unsigned e = feedforward_coef.size()-1;
+    if(
+        cutoff_mul == this->cutoff_mul &&
+        resonance_mul == this->resonance_mul
+    ) return;
+
+    this->cutoff_mul = cutoff_mul;
+    this->resonance_mul = resonance_mul;
+    update_coefficients();
+}
 
-    for(; i < first_len; ++i, ++j)
-        output_sample += input[j] * feedforward_coef[e-i];
+void filter::update_coefficients()
+{
+    for(section& s: sections)
+    {
+        double g = prewarp_table(s.design.freq * cutoff_mul);
+        if(s.design.first_order)
+        {
+            s.a1 = g/(1.0 + g);
+            continue;
+        }
 
-    j = 0;
-    for(; j < second_len; ++i, ++j)
-        output_sample += input[j] * feedforward_coef[e-i];
+        s.k = s.design.k;
+        // Resonance only sharpens the last section; it has the highest Q.
+        if(&s == &sections.back())
+            s.k = std::max(s.k / std::max(resonance_mul, 1e-3), 0.02);
 
-    i = 0; j = output_head;
-    first_len = feedback_coef.size() - j;
-    second_len = feedback_coef.size() - first_len;
-    e = feedback_coef.size()-1;
+        s.a1 = 1.0/(1.0 + g*(g + s.k));
+        s.a2 = g*s.a1;
+        s.a3 = g*s.a2;
+    }
+}
 
-    for(; i < first_len; ++i, ++j)
-        output_sample += output[j] * feedback_coef[e-i];
+inline double filter::tick(section& s, double x)
+{
+    if(s.design.first_order)
+    {
+        double v = (x - s.ic1) * s.a1;
+        double lp = v + s.ic1;
+        s.ic1 = lp + v;
+        return s.design.hp * (x - lp) + s.design.lp * lp;
+    }
 
-    j = 0;
-    for(; j < second_len; ++i, ++j)
-        output_sample += output[j] * feedback_coef[e-i];
+    double v3 = x - s.ic2;
+    double v1 = s.a1 * s.ic1 + s.a2 * v3;
+    double v2 = s.ic2 + s.a2 * s.ic1 + s.a3 * v3;
+    s.ic1 = 2.0 * v1 - s.ic1;
+    s.ic2 = 2.0 * v2 - s.ic2;
+    return s.design.hp * (x - s.k * v1 - v2) +
+        s.design.bp * v1 + s.design.lp * v2;
+}
 
-    input[input_head++] = sample;
-    output[output_head++] = output_sample;
+int32_t filter::push(int32_t sample)
+{
+    double x = sample;
+    for(section& s: sections) x = tick(s, x);
+    return std::clamp(x, (double)INT32_MIN, (double)INT32_MAX);
+}
 
-    input_head %= input.size();
-    output_head %= output.size();
+void filter::process(int32_t* samples, unsigned count)
+{
+    section* begin = sections.data();
+    section* end = begin + sections.size();
+
+    // Going sample by sample through all sections lets the CPU overlap the
+    // sections' recurrences, as each only waits for its own previous state
+    // and the previous section's output. Running each section over the whole
+    // block instead was measured to be slower.
+    for(unsigned i = 0; i < count; ++i)
+    {
+        double x = samples[i];
+        for(section* s = begin; s != end; ++s) x = tick(*s, x);
+        samples[i] = std::clamp(x, (double)INT32_MIN, (double)INT32_MAX);
+    }
+}
 
-    return output_sample;
+bool filter::is_silent() const
+{
+    for(const section& s: sections)
+        if(fabs(s.ic1) >= 0.5 || fabs(s.ic2) >= 0.5) return false;
+    return true;
 }
 
 filter_state::filter_state()
@@ -321,28 +341,31 @@ filter_state::filter_state()
 
 filter filter_state::design(uint64_t samplerate)
 {
-    double cutoff = f0/(samplerate*0.5);
-    double bw = bandwidth/(samplerate*0.5);
-    std::vector<double> x, y;
+    std::vector<analog_biquad> analog;
+    if(order == 0) return filter();
+
     switch(type)
     {
-    case NONE:
-        return filter({}, {});
     case LOW_PASS:
-        butterworth_lowpass(order, cutoff, y, x);
-        return filter(x, y);
+        design_lowpass(order, prewarp(f0, samplerate), analog);
+        break;
     case HIGH_PASS:
-        butterworth_highpass(order, cutoff, y, x);
-        return filter(x, y);
+        design_highpass(order, prewarp(f0, samplerate), analog);
+        break;
     case BAND_PASS:
-        butterworth_bandpass(order, cutoff, bw, y, x);
-        return filter(x, y);
     case BAND_STOP:
-        butterworth_bandstop(order, cutoff, bw, y, x);
-        return filter(x, y);
+        design_bandpass_bandstop(
+            order,
+            prewarp(f0 - bandwidth, samplerate),
+            prewarp(f0 + bandwidth, samplerate),
+            type == BAND_STOP,
+            analog
+        );
+        break;
     default:
-        return filter({}, {});
+        return filter();
     }
+    return design_filter(analog);
 }
 
 json filter_state::serialize() const
@@ -377,3 +400,238 @@ bool filter_state::deserialize(const json& j)
     order = j.value("order", 32);
     return true;
 }
+
+voice_filter_state::voice_filter_state()
+: type(filter_state::NONE), key_track(4.0), envelope_depth(0.0),
+  resonance(0.7)
+{
+}
+
+json voice_filter_state::serialize() const
+{
+    json j;
+
+    j["type"] = filter_type_strings[(unsigned)type];
+
+    if(type != filter_state::NONE)
+    {
+        j["key_track"] = key_track;
+        j["envelope_depth"] = envelope_depth;
+        j["resonance"] = resonance;
+    }
+
+    return j;
+}
+
+bool voice_filter_state::deserialize(const json& j)
+{
+    std::string type_str = j.at("type").get<std::string>();
+    int type_i = find_string_arg(
+        type_str.c_str(),
+        filter_type_strings,
+        sizeof(filter_type_strings)/sizeof(*filter_type_strings)
+    );
+    if(type_i < 0) type = filter_state::NONE;
+    else type = (enum filter_state::filter_type)type_i;
+
+    key_track = j.value("key_track", 4.0);
+    envelope_depth = j.value("envelope_depth", 0.0);
+    resonance = j.value("resonance", 0.7);
+    return true;
+}
+
+voice_filter_bank::voice_filter_bank()
+: type(filter_state::NONE), hp(0.0), bp(0.0), lp(0.0)
+{
+}
+
+void voice_filter_bank::set_type(filter_state::filter_type type)
+{
+    this->type = type;
+    hp = type == filter_state::HIGH_PASS || type == filter_state::BAND_STOP;
+    bp = type == filter_state::BAND_PASS;
+    lp = type == filter_state::LOW_PASS || type == filter_state::BAND_STOP;
+}
+
+filter_state::filter_type voice_filter_bank::get_type() const
+{
+    return type;
+}
+
+void voice_filter_bank::resize(unsigned voices)
+{
+    groups.resize((voices + LANES - 1)/LANES, lane_group{});
+}
+
+void voice_filter_bank::reset(unsigned voice)
+{
+    lane_group& g = groups[voice/LANES];
+    g.ic1[voice%LANES] = 0.0;
+    g.ic2[voice%LANES] = 0.0;
+}
+
+void voice_filter_bank::set_cutoff(
+    unsigned voice, double freq, double resonance
+){
+    lane_group& group = groups[voice/LANES];
+    unsigned l = voice%LANES;
+    double g = prewarp_table(freq);
+    group.k[l] = 1.0/std::max(resonance, 0.1);
+    group.a1[l] = 1.0/(1.0 + g*(g + group.k[l]));
+    group.a2[l] = g*group.a1[l];
+    group.a3[l] = g*group.a2[l];
+}
+
+unsigned voice_filter_bank::get_stride() const
+{
+    return groups.size()*LANES;
+}
+
+bool voice_filter_bank::is_ringing(unsigned group) const
+{
+    return groups[group].ringing;
+}
+
+bool voice_filter_bank::is_ringing() const
+{
+    for(const lane_group& g: groups)
+        if(g.ringing) return true;
+    return false;
+}
+
+void voice_filter_bank::process(
+    const double* in,
+    unsigned count,
+    int32_t* out,
+    const std::vector<unsigned>& groups
+){
+    unsigned stride = get_stride();
+    std::fill(mix, mix + count*LANES, 0.0);
+
+    for(unsigned i: groups)
+    {
+        lane_group& g = this->groups[i];
+        // Local copies, so that the compiler can keep them in registers over
+        // the whole block.
+        double a1[LANES], a2[LANES], a3[LANES], k[LANES];
+        double ic1[LANES], ic2[LANES];
+        for(unsigned l = 0; l < LANES; ++l)
+        {
+            a1[l] = g.a1[l]; a2[l] = g.a2[l]; a3[l] = g.a3[l]; k[l] = g.k[l];
+            ic1[l] = g.ic1[l]; ic2[l] = g.ic2[l];
+        }
+
+        for(unsigned t = 0; t < count; ++t)
+        {
+            const double* x = in + t*stride + i*LANES;
+            double* m = mix + t*LANES;
+            for(unsigned l = 0; l < LANES; ++l)
+            {
+                double v3 = x[l] - ic2[l];
+                double v1 = a1[l] * ic1[l] + a2[l] * v3;
+                double v2 = ic2[l] + a2[l] * ic1[l] + a3[l] * v3;
+                ic1[l] = 2.0 * v1 - ic1[l];
+                ic2[l] = 2.0 * v2 - ic2[l];
+                double band = k[l] * v1;
+                m[l] += hp * (x[l] - band - v2) + bp * band + lp * v2;
+            }
+        }
+
+        g.ringing = false;
+        for(unsigned l = 0; l < LANES; ++l)
+        {
+            g.ic1[l] = ic1[l];
+            g.ic2[l] = ic2[l];
+            if(fabs(ic1[l]) >= 0.5 || fabs(ic2[l]) >= 0.5) g.ringing = true;
+        }
+        // Leftovers below 1 LSB would otherwise start ringing again when
+        // another voice of the group becomes active.
+        if(!g.ringing)
+        {
+            std::fill(g.ic1, g.ic1 + LANES, 0.0);
+            std::fill(g.ic2, g.ic2 + LANES, 0.0);
+        }
+    }
+
+    for(unsigned t = 0; t < count; ++t)
+    {
+        double sum = 0;
+        for(unsigned l = 0; l < LANES; ++l) sum += mix[t*LANES + l];
+        out[t] = std::clamp(sum, (double)INT32_MIN, (double)INT32_MAX);
+    }
+}
+
+decimator::decimator(unsigned factor)
+:   factor(1)
+{
+    // The first stages have a wide transition band, since anything that
+    // aliases there is removed by the later stages. The last stage must cut
+    // from 20kHz to the Nyquist frequency at 44100Hz.
+    while(this->factor < std::min(factor, MAX_FACTOR))
+    {
+        stage s;
+        bool last = this->factor * 2 >= std::min(factor, MAX_FACTOR);
+        s.coef = last ?
+            halfband_coefficients(32, 9.0) :
+            halfband_coefficients(8, 9.0);
+        s.history.resize(4 * s.coef.size() - 2 + MAX_BLOCK, 0.0);
+        stages.push_back(std::move(s));
+        this->factor *= 2;
+    }
+}
+
+unsigned decimator::get_factor() const
+{
+    return factor;
+}
+
+void decimator::reset()
+{
+    for(stage& s: stages)
+        std::fill(s.history.begin(), s.history.end(), 0.0);
+}
+
+void decimator::process(const int32_t* in, unsigned count, int32_t* out)
+{
+    if(factor == 1)
+    {
+        std::copy(in, in + count, out);
+        return;
+    }
+
+    for(unsigned i = 0; i < count; ++i) buffer[i] = in[i];
+    for(stage& s: stages)
+    {
+        process_stage(s, buffer, count, buffer);
+        count /= 2;
+    }
+    for(unsigned i = 0; i < count; ++i)
+    {
+        out[i] = std::clamp(
+            round(buffer[i]), (double)INT32_MIN, (double)INT32_MAX
+        );
+    }
+}
+
+void decimator::process_stage(
+    stage& s, const double* in, unsigned count, double* out
+){
+    unsigned half_taps = s.coef.size();
+    unsigned keep = 4 * half_taps - 2;
+    double* h = s.history.data();
+    std::copy(in, in + count, h + keep);
+
+    // The filter window of output k ends at input 2k, and its center tap is
+    // at 2k - (2*half_taps - 1).
+    const double* c = s.coef.data();
+    for(unsigned k = 0; k < count / 2; ++k)
+    {
+        const double* w = h + 2 * k + 2 * half_taps - 1;
+        double sum = 0.5 * w[0];
+        for(unsigned m = 0; m < half_taps; ++m)
+            sum += c[m] * (w[-1 - 2 * (int)m] + w[1 + 2 * m]);
+        out[k] = sum;
+    }
+
+    std::copy(h + count, h + count + keep, h);
+}
@@ -23,26 +23,56 @@
 #include <vector>
 #include "io.hh"
 
+// Cascade of second-order sections, processed as trapezoidal state-variable
+// filters. Their coefficients stay stable under modulation, so the cutoff and
+// resonance can be changed while the filter is running.
 class filter
 {
 public:
-    explicit filter(
-        const std::vector<double>& feedforward_coef,
-        const std::vector<double>& feedback_coef
-    );
+    // One section of the analog prototype:
+    // H(s) = (hp*s^2 + bp*w*s + lp*w^2) / (s^2 + k*w*s + w^2)
+    // where w is the pre-warped pole frequency. First-order sections are
+    // H(s) = (hp*s + lp*w) / (s + w), and ignore k and bp.
+    struct stage
+    {
+        double freq; // Pole frequency relative to the samplerate
+        double k; // 1/Q
+        double hp, bp, lp;
+        bool first_order;
+    };
+
+    filter();
+    explicit filter(const std::vector<stage>& stages);
     filter(const filter& other);
     filter(filter&& other);
 
+    // Scales the pole frequencies of all sections and the Q of the sharpest
+    // one. Only recomputes coefficients when the values change, and never
+    // allocates, so this is cheap enough to call for every block.
+    void set_modulation(double cutoff_mul = 1.0, double resonance_mul = 1.0);
+
     int32_t push(int32_t sample);
+    // Filters the samples in-place. Equivalent to calling push() for each
+    // sample, but without the per-sample call overhead.
+    void process(int32_t* samples, unsigned count);
+    // True if the filter has rung out, so that it would output nothing
+    // without input.
+    bool is_silent() const;
 
 private:
-    double feedforward_first;
-    std::vector<double> feedforward_coef;
-    std::vector<double> feedback_coef;
-    unsigned input_head;
-    std::vector<double> input;
-    unsigned output_head;
-    std::vector<double> output;
+    struct section
+    {
+        stage design;
+        double a1, a2, a3; // a1 = G for first-order sections
+        double k;
+        double ic1, ic2;
+    };
+
+    void update_coefficients();
+    static double tick(section& s, double x);
+
+    std::vector<section> sections;
+    double cutoff_mul, resonance_mul;
 };
 
 struct filter_state
@@ -68,4 +98,118 @@ struct filter_state
     bool deserialize(const json& j);
 };
 
+// Settings for the filters applied to each voice separately, before mixing.
+struct voice_filter_state
+{
+    voice_filter_state();
+
+    filter_state::filter_type type;
+
+    // Cutoff or center frequency relative to the frequency of the voice.
+    double key_track;
+    // How many octaves the cutoff rises at the envelope's peak.
+    double envelope_depth;
+    double resonance;
+
+    json serialize() const;
+    bool deserialize(const json& j);
+};
+
+// A resonant second-order state-variable filter for each voice. Voices are
+// stored in groups of LANES as structures of arrays, so that the compiler can
+// filter each group with SIMD instructions. Each group is run over the whole
+// block at once, which keeps its state in registers.
+class voice_filter_bank
+{
+public:
+    static constexpr unsigned LANES = 4;
+    static constexpr unsigned MAX_BLOCK = 64;
+
+    voice_filter_bank();
+
+    void set_type(filter_state::filter_type type);
+    filter_state::filter_type get_type() const;
+
+    void resize(unsigned voices);
+    void reset(unsigned voice);
+
+    // freq is relative to the samplerate.
+    void set_cutoff(unsigned voice, double freq, double resonance);
+
+    // Number of values per sample in the input of process(). Lanes past the
+    // voice count must be zero.
+    unsigned get_stride() const;
+
+    // True while a lane of the group still has a state of at least 1 LSB, so
+    // that the group must be processed for the tails of its voices to ring
+    // out. Once it has rung out, its state is cleared.
+    bool is_ringing(unsigned group) const;
+    bool is_ringing() const;
+
+    // Filters count <= MAX_BLOCK samples of each voice and mixes them to out.
+    // The input is interleaved, sample i of voice j is at in[i*stride + j].
+    // Only the LANES voices starting at LANES*g for each g in groups are
+    // processed, the rest keep their state and aren't read.
+    void process(
+        const double* in,
+        unsigned count,
+        int32_t* out,
+        const std::vector<unsigned>& groups
+    );
+
+private:
+    struct lane_group
+    {
+        double a1[LANES], a2[LANES], a3[LANES], k[LANES];
+        double ic1[LANES], ic2[LANES];
+        bool ringing;
+    };
+
+    filter_state::filter_type type;
+    double hp, bp, lp;
+    std::vector<lane_group> groups;
+    double mix[MAX_BLOCK*LANES];
+};
+
+// Decimates by a power of two with a cascade of half-band FIR filters, each
+// halving the samplerate. Every other coefficient of a half-band filter is
+// zero and the rest are symmetric, and only the kept samples are computed, so
+// the cost per output sample is small.
+class decimator
+{
+public:
+    static constexpr unsigned MAX_FACTOR = 4;
+    // Longest input accepted by a single process() call.
+    static constexpr unsigned MAX_BLOCK = 256;
+
+    explicit decimator(unsigned factor = 1);
+
+    unsigned get_factor() const;
+    void reset();
+
+    // count must be a multiple of the factor and at most MAX_BLOCK. Writes
+    // count/factor samples to out.
+    void process(const int32_t* in, unsigned count, int32_t* out);
+
+private:
+    struct stage
+    {
+        // Nonzero coefficients on one side of the center tap, innermost
+        // first.
+        std::vector<double> coef;
+        // Inputs from previous calls that are still in the filter's reach,
+        // followed by the current input.
+        std::vector<double> history;
+    };
+
+    // Can be done in-place.
+    static void process_stage(
+        stage& s, const double* in, unsigned count, double* out
+    );
+
+    unsigned factor;
+    std::vector<stage> stages;
+    double buffer[MAX_BLOCK];
+};
+
 #endif
@@ -16,11 +16,30 @@
     You should have received a copy of the GNU General Public License
     along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
 */
+#define _USE_MATH_DEFINES
 #include "fm.hh"
 #include "helpers.hh"
+#include "pffft.h"
 #include <stdexcept>
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #define PERIOD_MUL 65536
+#define DEFAULT_MAX_CONTROL_ERROR 0.001
+// Number of set_synth() calls with the same patch before it's baked.
+#define BAKE_DELAY 30
+#define MAX_BAKED_PATCHES 16
+// CPU governor timings, in seconds.
+#define LOAD_AVERAGE_TIME 0.1
+#define SINE_FADE_TIME 0.005
+// Held voices are only culled after the load has stayed over the budget this
+// long, so that a single slow block doesn't cut notes.
+#define HELD_CULL_DELAY 0.02
+// Sines are used until the average load drops below this part of the budget.
+#define SINE_RECOVERY 0.5
+// Start phases of unison copies are spread by the golden ratio, so that no
+// two copies start in phase and they don't cancel each other out either.
+#define UNISON_PHASE_STEP 0x9E3779B9u
 
 static const char* const mode_strings[] = {
     "FREQUENCY", "PHASE"
@@ -31,7 +50,7 @@ static const char* const osc_strings[] = {
 };
 
 oscillator::state::state()
-:  t(0), output(0) {}
+:  t(0), output(0), slow(false), delta(0), rate(0), max_step(0) {}
 
 oscillator::oscillator(
     func type,
@@ -181,6 +200,7 @@ void oscillator::reset(state& s) const
 {
     s.t = phase_constant;
     s.output = value(s.t);
+    s.delta = 0;
 }
 
 void oscillator::update(
@@ -194,8 +214,22 @@ void oscillator::update(
     s.output = value(s.t + phase_offset);
 }
 
+void oscillator::update_slow(
+    state& s,
+    uint64_t period_num,
+    uint64_t period_denom,
+    unsigned steps,
+    uint64_t phase_offset
+) const
+{
+    s.t += steps * (period_num/period_denom);
+    s.delta = (value(s.t + phase_offset) - s.output) / (int64_t)steps;
+    s.output += s.delta;
+}
+
 fm_synth::fm_synth()
-: mode(FREQUENCY), oscillators{{}}, carriers{0} {}
+:   mode(FREQUENCY), max_control_error(DEFAULT_MAX_CONTROL_ERROR),
+    oscillators{{}}, carriers{0} {}
 
 bool fm_synth::index_compatible(const fm_synth& other) const
 {
@@ -222,6 +256,16 @@ fm_synth::modulation_mode fm_synth::get_modulation_mode() const
     return mode;
 }
 
+void fm_synth::set_max_control_error(double error)
+{
+    max_control_error = std::max(error, 0.0);
+}
+
+double fm_synth::get_max_control_error() const
+{
+    return max_control_error;
+}
+
 std::vector<unsigned>& fm_synth::get_carriers()
 {
     return carriers;
@@ -245,7 +289,14 @@ const oscillator& fm_synth::get_oscillator(unsigned i) const
 
 void fm_synth::erase_oscillator(unsigned i)
 {
-    erase_index(i);
+    // Once nothing refers to it, finish_changes() drops it along with the
+    // modulators that were only reachable through it.
+    auto detach = [i](std::vector<unsigned>& v){
+        v.erase(std::remove(v.begin(), v.end(), i), v.end());
+    };
+    detach(carriers);
+    for(oscillator& o: oscillators) detach(o.modulators);
+    finish_changes();
 }
 
 unsigned fm_synth::add_oscillator(const oscillator& o)
@@ -258,46 +309,75 @@ unsigned fm_synth::add_oscillator(const oscillator& o)
 void fm_synth::finish_changes()
 {
     erase_invalid_indices();
-    reference_vec ref = determine_references();
-    erase_orphans(ref);
+    sort_oscillators();
 
-    // Sort modulators
-    std::map<int, int> index_map;
-    std::vector<bool> handled_oscillators(oscillators.size(), false);
-    std::vector<oscillator> new_oscillators;
-    for(unsigned handled = 0; handled < oscillators.size(); ++handled)
+    // Depth-first search from the carriers finds the oscillators that are
+    // still in use, and drops any modulator link that would close a cycle.
+    enum { UNVISITED = 0, ACTIVE, DONE };
+    std::vector<uint8_t> visit(oscillators.size(), UNVISITED);
+    std::vector<std::pair<unsigned, unsigned>> stack;
+    for(unsigned c: carriers)
     {
-        int add_index = 0;
-        int min_max_ref = oscillators.size();
-        for(unsigned i = 0; i < oscillators.size(); ++i)
+        if(visit[c] != UNVISITED) continue;
+        visit[c] = ACTIVE;
+        stack.push_back({c, 0});
+        while(!stack.empty())
         {
-            if(handled_oscillators[i]) continue;
-            bool all_handled = true;
-            int max_ref = -1;
-            for(unsigned j = 0; j < ref[i].size(); ++j)
+            auto [i, j] = stack.back();
+            std::vector<unsigned>& modulators = oscillators[i].modulators;
+            if(j == modulators.size())
             {
-                if(ref[i][j] == -1) continue;
-                if(!handled_oscillators[ref[i][j]])
-                {
-                    all_handled = false;
-                    break;
-                }
-                else if(index_map[ref[i][j]] > max_ref)
-                    max_ref = index_map[ref[i][j]];
+                visit[i] = DONE;
+                stack.pop_back();
+                continue;
+            }
+            unsigned m = modulators[j];
+            if(visit[m] == ACTIVE)
+            {
+                modulators.erase(modulators.begin() + j);
+                continue;
             }
-            if(!all_handled) continue;
-            if(max_ref < min_max_ref)
+            stack.back().second++;
+            if(visit[m] == UNVISITED)
             {
-                add_index = i;
-                min_max_ref = max_ref;
+                visit[m] = ACTIVE;
+                stack.push_back({m, 0});
             }
         }
-        index_map[add_index] = new_oscillators.size();
-        handled_oscillators[add_index] = true;
-        new_oscillators.push_back(oscillators[add_index]);
     }
 
-    oscillators = new_oscillators;
+    // Topological sort, so that every oscillator comes before its
+    // modulators. Carriers go first, then each modulator as soon as all of
+    // its parents are placed. Ties keep the old order, which keeps the
+    // layout stable while editing.
+    std::vector<unsigned> parent_count(oscillators.size(), 0);
+    for(unsigned i = 0; i < oscillators.size(); ++i)
+    {
+        if(visit[i] != DONE) continue;
+        for(unsigned m: oscillators[i].modulators) parent_count[m]++;
+    }
+
+    std::vector<unsigned> order;
+    order.reserve(oscillators.size());
+    for(unsigned c: carriers)
+        if(parent_count[c] == 0) order.push_back(c);
+    // Modulator lists are sorted, so the oscillators that become ready are
+    // already in their old order.
+    for(unsigned head = 0; head < order.size(); ++head)
+    {
+        for(unsigned m: oscillators[order[head]].modulators)
+            if(--parent_count[m] == 0) order.push_back(m);
+    }
+
+    std::vector<unsigned> index_map(oscillators.size(), 0);
+    std::vector<oscillator> new_oscillators;
+    new_oscillators.reserve(order.size());
+    for(unsigned i: order)
+    {
+        index_map[i] = new_oscillators.size();
+        new_oscillators.push_back(std::move(oscillators[i]));
+    }
+    oscillators = std::move(new_oscillators);
 
     // Apply new indices from index map
     for(unsigned& m: carriers) m = index_map[m];
@@ -310,29 +390,32 @@ void fm_synth::finish_changes()
 
 void fm_synth::update_period_lookup()
 {
+    // A denominator of 0 marks a period that isn't known yet. Until then,
+    // period_lookup holds the period of the parent.
     period_lookup.resize(oscillators.size());
     std::fill(
         period_lookup.begin(),
         period_lookup.end(),
-        std::make_pair(1lu, 1lu)
+        std::make_pair(1l, 0l)
     );
+    for(unsigned c: carriers) period_lookup[c] = std::make_pair(1l, 1l);
 
     for(unsigned i = 0; i < oscillators.size(); ++i)
     {
         oscillator& o = oscillators[i];
         auto [period_num, period_denom] = period_lookup[i];
+        period_denom |= !period_denom;
         period_num *= o.period_num;
         period_denom *= o.period_denom;
         normalize_fract(period_num, period_denom);
         period_lookup[i] = std::make_pair(period_num, period_denom);
 
+        // A shared modulator is relative to its first parent, which is the
+        // carrier itself if it's also a carrier.
         for(unsigned& m: o.modulators)
         {
-            auto [num, denom] = period_lookup[m];
-            num *= period_num;
-            denom *= period_denom;
-            normalize_fract(num, denom);
-            period_lookup[m] = std::make_pair(num, denom);
+            if(period_lookup[m].second != 0) continue;
+            period_lookup[m] = std::make_pair(period_num, period_denom);
         }
     }
 }
@@ -345,6 +428,35 @@ double fm_synth::get_total_carrier_amplitude() const
     return total;
 }
 
+uint64_t fm_synth::hash() const
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037lu;
+    auto add = [&](int64_t value){
+        for(unsigned i = 0; i < 8; ++i)
+        {
+            h ^= (value >> (i * 8)) & 0xFF;
+            h *= 1099511628211lu;
+        }
+    };
+
+    add(mode);
+    add(carriers.size());
+    for(unsigned c: carriers) add(c);
+    for(const oscillator& o: oscillators)
+    {
+        add(o.type);
+        add(o.amp_num);
+        add(o.amp_denom);
+        add(o.period_num);
+        add(o.period_denom);
+        add(o.phase_constant);
+        add(o.modulators.size());
+        for(unsigned m: o.modulators) add(m);
+    }
+    return h;
+}
+
 void fm_synth::limit_total_carrier_amplitude()
 {
     double total = 0.0;
@@ -366,15 +478,15 @@ fm_synth::layout fm_synth::generate_layout()
     reference_vec ref = determine_references();
 
     layout l;
-    std::map<int /* parent */, int /* layer */> layer_map;
-    layer_map[-1] = -1;
+    std::vector<unsigned> layer_map(oscillators.size(), 0);
 
     // Since the parent should always be before in the array, a single pass
-    // like this is enough.
+    // like this is enough. Shared modulators are shown under their first
+    // parent only.
     for(unsigned i = 0; i < oscillators.size(); ++i)
     {
         int parent = ref[i].front();
-        unsigned layer = layer_map[parent] + 1;
+        unsigned layer = parent < 0 ? 0 : layer_map[parent] + 1;
         layer_map[i] = layer;
 
         if(layer >= l.layers.size())
@@ -485,23 +597,140 @@ fm_synth::state fm_synth::start(double volume, int64_t denom) const
     state s;
     set_volume(s, volume*denom, denom);
     s.states.resize(oscillators.size());
+    s.base_t = 0;
+    s.control_step = 1;
+    s.control_phase = 0;
+    s.sine_mix = 0;
     reset(s);
     return s;
 }
 
-void fm_synth::reset(state& s) const
+void fm_synth::reset(state& s, uint32_t phase) const
 {
     for(unsigned i = 0; i < oscillators.size(); ++i)
-        oscillators[i].reset(s.states[i]);
+    {
+        oscillator::state& os = s.states[i];
+        oscillators[i].reset(os);
+        if(phase == 0 || i >= period_lookup.size()) continue;
+        os.t += (uint64_t)phase * period_lookup[i].first /
+            period_lookup[i].second;
+        os.output = oscillators[i].value(os.t);
+    }
+    s.base_t = phase;
+    s.control_phase = 0;
+    s.sine_mix = 0;
+}
+
+void fm_synth::update_control_rate(state& s) const
+{
+    // At the start of a control step, slow oscillators are in sync with the
+    // voice, so they can be switched without a jump.
+    if(s.control_phase != 0) return;
+
+    static constexpr unsigned steps[] = {16, 8, 4};
+    constexpr unsigned step_count = sizeof(steps)/sizeof(*steps);
+    unsigned slow_count[step_count] = {0};
+
+    // Cycles per sample of the voice's base frequency.
+    double base = s.period_num / (double)s.period_denom / 4294967296.0;
+
+    // Modulators come after the oscillators they modulate, so their rates
+    // are known when they're needed.
+    for(unsigned i = oscillators.size(); i > 0; --i)
+    {
+        const oscillator& o = oscillators[i-1];
+        oscillator::state& os = s.states[i-1];
+
+        // Upper bound for the instantaneous frequency, including modulation.
+        double rate = base *
+            period_lookup[i-1].first / (double)period_lookup[i-1].second;
+        double modulation = 0;
+        unsigned limit = steps[0];
+        for(unsigned m: o.modulators)
+        {
+            double amp = fabs(oscillators[m].get_amplitude());
+            if(mode == FREQUENCY) modulation += amp * rate;
+            else modulation += M_PI * amp * s.states[m].rate;
+            limit = std::min(limit, s.states[m].max_step);
+        }
+        os.rate = rate + modulation;
+        os.max_step = 0;
+
+        // Carriers go straight to the output, and a slow oscillator can only
+        // be modulated by other slow oscillators.
+        if(
+            std::find(carriers.begin(), carriers.end(), i-1) != carriers.end()
+        ) continue;
+
+        for(unsigned j = 0; j < step_count && steps[j] <= limit; ++j)
+        {
+            double cycles = os.rate * steps[j];
+            double error = INFINITY;
+            // Linear interpolation of a sine is off by at most
+            // (w*h)^2/8, and a triangle only at its corners.
+            if(o.type == oscillator::SINE)
+                error = (2 * M_PI * cycles) * (2 * M_PI * cycles) / 8;
+            else if(o.type == oscillator::TRIANGLE) error = 2 * cycles;
+
+            if(error <= max_control_error)
+            {
+                os.max_step = steps[j];
+                break;
+            }
+        }
+
+        for(unsigned j = 0; j < step_count; ++j)
+            if(os.max_step >= steps[j]) slow_count[j]++;
+    }
+
+    // Pick the step that saves the most evaluations.
+    unsigned best = 1;
+    double best_saved = 0;
+    for(unsigned j = 0; j < step_count; ++j)
+    {
+        double saved = slow_count[j] * (steps[j] - 1) / (double)steps[j];
+        if(saved > best_saved)
+        {
+            best = steps[j];
+            best_saved = saved;
+        }
+    }
+
+    s.control_step = best;
+    for(unsigned i = 0; i < oscillators.size(); ++i)
+    {
+        oscillator::state& os = s.states[i];
+        os.slow = best > 1 && os.max_step >= best;
+        os.delta = 0;
+    }
 }
 
 int64_t fm_synth::step_frequency(state& s) const
 {
+    s.base_t += s.period_num / s.period_denom;
+    bool tick = s.control_phase == 0;
+    if(++s.control_phase == s.control_step) s.control_phase = 0;
+
     for(unsigned i = oscillators.size(); i > 0; --i)
     {
         const oscillator& o = oscillators[i-1];
+        oscillator::state& os = s.states[i-1];
+        if(os.slow && !tick)
+        {
+            os.output += os.delta;
+            continue;
+        }
+
         int64_t x = 1u<<31;
-        for(unsigned m: o.modulators) x += s.states[m].output;
+        if(os.slow)
+        {
+            // Modulators of slow oscillators are slow too. This frequency
+            // is used for the whole step, so take their average over it.
+            int64_t half = (s.control_step - 1) / 2;
+            for(unsigned m: o.modulators)
+                x += s.states[m].output + s.states[m].delta * half;
+        }
+        else for(unsigned m: o.modulators) x += s.states[m].output;
 
         int64_t period_num = period_lookup[i-1].first;
         int64_t period_denom = period_lookup[i-1].second;
@@ -510,7 +739,9 @@ int64_t fm_synth::step_frequency(state& s) const
         normalize_fract(period_num, period_denom);
         period_num *= x >> 16;
         period_denom <<= 15;
-        o.update(s.states[i-1], period_num, period_denom);
+        if(os.slow)
+            o.update_slow(os, period_num, period_denom, s.control_step);
+        else o.update(os, period_num, period_denom);
     }
 
     int64_t x = 0;
@@ -520,17 +751,37 @@ int64_t fm_synth::step_frequency(state& s) const
 
 int64_t fm_synth::step_phase(state& s) const
 {
+    s.base_t += s.period_num / s.period_denom;
+    bool tick = s.control_phase == 0;
+    if(++s.control_phase == s.control_step) s.control_phase = 0;
+
     for(unsigned i = oscillators.size(); i > 0; --i)
     {
         const oscillator& o = oscillators[i-1];
+        oscillator::state& os = s.states[i-1];
+        if(os.slow && !tick)
+        {
+            os.output += os.delta;
+            continue;
+        }
+
         int64_t x = 0;
-        for(unsigned m: o.modulators) x += s.states[m].output;
+        if(os.slow)
+        {
+            // The phase offset is needed at the end of the step.
+            int64_t end = s.control_step - 1;
+            for(unsigned m: o.modulators)
+                x += s.states[m].output + s.states[m].delta * end;
+        }
+        else for(unsigned m: o.modulators) x += s.states[m].output;
 
         uint64_t period_num = period_lookup[i-1].first;
         uint64_t period_denom = period_lookup[i-1].second;
         period_num *= s.period_num;
         period_denom *= s.period_denom;
-        o.update(s.states[i-1], period_num, period_denom, x);
+        if(os.slow)
+            o.update_slow(os, period_num, period_denom, s.control_step, x);
+        else o.update(os, period_num, period_denom, x);
     }
 
     int64_t x = 0;
@@ -538,6 +789,25 @@ int64_t fm_synth::step_phase(state& s) const
     return s.amp_num*x/s.amp_denom;
 }
 
+int64_t fm_synth::step_sine(state& s) const
+{
+    s.base_t += s.period_num / s.period_denom;
+    return sine_value(s);
+}
+
+int64_t fm_synth::sine_value(const state& s) const
+{
+    int64_t x = 0;
+    for(unsigned c: carriers)
+    {
+        const oscillator& o = oscillators[c];
+        uint64_t t = s.base_t * period_lookup[c].first /
+            period_lookup[c].second + o.phase_constant;
+        x += o.amp_num * i32sin(t) / o.amp_denom;
+    }
+    return s.amp_num*x/s.amp_denom;
+}
+
 void fm_synth::synthesize(
     state& s,
     int32_t* samples,
@@ -584,6 +854,7 @@ json fm_synth::serialize() const
 {
     json j;
     j["mode"] = mode_strings[(unsigned)mode];
+    j["max_control_error"] = max_control_error;
     j["carriers"] = carriers;
     j["oscillators"] = json::array();
 
@@ -618,6 +889,9 @@ bool fm_synth::deserialize(const json& j)
             sizeof(mode_strings)/sizeof(*mode_strings));
         if(mode_i < 0) return false;
         mode = (modulation_mode)mode_i;
+        max_control_error = j.value(
+            "max_control_error", DEFAULT_MAX_CONTROL_ERROR
+        );
 
         j.at("carriers").get_to(carriers);
 
@@ -695,87 +969,179 @@ fm_synth::reference_vec fm_synth::determine_references()
     return references;
 }
 
-void fm_synth::erase_orphans(reference_vec& ref)
+void fm_synth::sort_oscillators()
 {
-    bool deleted = false;
-    do
-    {
-        deleted = false;
-        for(unsigned i = 0; i < ref.size(); ++i)
-        {
-            if(ref[i].size() == 0)
-            {
-                deleted = true;
-                erase_index(i, &ref);
-                i--;
-            }
-        }
-    }
-    while(deleted);
+    auto sort_unique = [](std::vector<unsigned>& v){
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    };
+    sort_unique(carriers);
+    for(oscillator& o: oscillators) sort_unique(o.modulators);
 }
 
-void fm_synth::erase_index(unsigned i, reference_vec* ref)
+std::unique_ptr<fm_wavetable> fm_wavetable::bake(const fm_synth& synth)
 {
-    // Remove the modulator itself
-    oscillators.erase(oscillators.begin() + i);
+    constexpr uint64_t step = (UINT64_C(1) << 32) / SIZE;
+    constexpr int64_t tolerance = (UINT64_C(1) << 32) / 10000;
 
-    // Fix indices
-    for(unsigned j = 0; j < carriers.size(); ++j)
+    for(unsigned i = 0; i < synth.oscillators.size(); ++i)
     {
-        if(carriers[j] == i)
-        {
-            carriers.erase(carriers.begin() + j);
-            j--;
-        }
-        else if(carriers[j] > i) carriers[j]--;
+        auto [num, denom] = synth.period_lookup[i];
+        if(
+            synth.oscillators[i].type == oscillator::NOISE ||
+            num <= 0 || denom <= 0 || num % denom != 0
+        ) return nullptr;
     }
+    if(synth.carriers.empty()) return nullptr;
 
-    for(oscillator& o: oscillators)
+    std::unique_ptr<fm_wavetable> table(new fm_wavetable());
+    bool track = synth.mode == fm_synth::FREQUENCY;
+    if(track)
     {
-        for(unsigned j = 0; j < o.modulators.size(); ++j)
+        table->deviations.assign(
+            synth.oscillators.size(), std::vector<int32_t>(SIZE, 0)
+        );
+    }
+
+    // Render one cycle with exactly SIZE samples. Like a voice, it starts
+    // from the reset state, and position p holds the output after the phase
+    // has reached p.
+    fm_synth::state s = synth.start(1.0, 1);
+    s.period_num = step;
+    s.period_denom = 1;
+    std::vector<int64_t> start_t(synth.oscillators.size());
+    for(unsigned i = 0; i < start_t.size(); ++i) start_t[i] = s.states[i].t;
+
+    float* cycle = (float*)pffft_aligned_malloc(SIZE * sizeof(float));
+    float* spectrum = (float*)pffft_aligned_malloc(SIZE * sizeof(float));
+    float* work = (float*)pffft_aligned_malloc(SIZE * sizeof(float));
+    PFFFT_Setup* setup = pffft_new_setup(SIZE, PFFFT_REAL);
+
+    bool periodic = true;
+    for(unsigned p = 1; p <= SIZE; ++p)
+    {
+        int64_t x = track ? synth.step_frequency(s) : synth.step_phase(s);
+        cycle[p % SIZE] = x;
+        if(!track) continue;
+
+        for(unsigned i = 0; i < start_t.size(); ++i)
         {
-            if(o.modulators[j] == i)
-            {
-                o.modulators.erase(o.modulators.begin() + j);
-                j--;
-            }
-            else if(o.modulators[j] > i) o.modulators[j]--;
+            int64_t ratio = synth.period_lookup[i].first /
+                synth.period_lookup[i].second;
+            int32_t deviation = s.states[i].t - start_t[i] - ratio * step * p;
+            table->deviations[i][p % SIZE] = deviation;
+            // Frequency modulation only repeats if its average over the
+            // cycle is zero.
+            if(p == SIZE && (deviation > tolerance || deviation < -tolerance))
+                periodic = false;
         }
     }
 
-    // Update references if applicable
-    if(ref)
+    if(periodic)
     {
-        ref->erase(ref->begin()+i);
-        for(std::vector<int>& r: *ref)
+        pffft_transform_ordered(
+            setup, cycle, spectrum, work, PFFFT_FORWARD
+        );
+        // The ordered real spectrum has DC and Nyquist first, then the
+        // other harmonics as complex pairs.
+        spectrum[1] = 0;
+        for(unsigned level = 0; level < LEVELS; ++level)
         {
-            for(unsigned j = 0; j < r.size(); ++j)
-            {
-                if(r[j] == (int)i)
-                {
-                    r.erase(r.begin() + j);
-                    j--;
-                }
-                else if(r[j] > (int)i) r[j]--;
-            }
+            unsigned harmonics = (SIZE / 2) >> level;
+            for(unsigned k = harmonics + 1; k < SIZE / 2; ++k)
+                spectrum[2*k] = spectrum[2*k+1] = 0;
+
+            pffft_transform_ordered(
+                setup, spectrum, cycle, work, PFFFT_BACKWARD
+            );
+            std::vector<float>& l = table->levels[level];
+            l.resize(SIZE + 1);
+            for(unsigned p = 0; p < SIZE; ++p) l[p] = cycle[p] / SIZE;
+            l[SIZE] = l[0];
         }
     }
+
+    pffft_destroy_setup(setup);
+    pffft_aligned_free(work);
+    pffft_aligned_free(spectrum);
+    pffft_aligned_free(cycle);
+
+    if(!periodic) return nullptr;
+    return table;
 }
 
-void fm_synth::sort_oscillators()
+int64_t fm_wavetable::step(fm_synth::state& s) const
 {
-    std::sort(carriers.begin(), carriers.end());
-    for(oscillator& o: oscillators)
-        std::sort(o.modulators.begin(), o.modulators.end());
+    uint64_t inc = s.period_num / s.period_denom;
+    s.base_t += inc;
+
+    // Level k has SIZE/2 >> k harmonics, which stay under the Nyquist
+    // frequency while the increment is at most 2^(21+k).
+    int level = 0;
+    if(inc > 1)
+    {
+        level = 64 - clz64(inc - 1) - 21;
+        level = std::clamp(level, 0, (int)LEVELS-1);
+    }
+
+    constexpr unsigned shift = 32 - 11;
+    uint32_t t = s.base_t;
+    unsigned i = t >> shift;
+    float frac = (t & ((1u << shift) - 1)) / (float)(1u << shift);
+    const float* l = levels[level].data();
+    int64_t x = l[i] + (l[i+1] - l[i]) * frac;
+    return s.amp_num*x/s.amp_denom;
+}
+
+void fm_wavetable::restore(const fm_synth& synth, fm_synth::state& s) const
+{
+    constexpr uint64_t step = (UINT64_C(1) << 32) / SIZE;
+    uint32_t t = s.base_t;
+    unsigned p = t / step;
+    for(unsigned i = 0; i < synth.oscillators.size(); ++i)
+    {
+        const oscillator& o = synth.oscillators[i];
+        oscillator::state& os = s.states[i];
+        int64_t ratio = synth.period_lookup[i].first /
+            synth.period_lookup[i].second;
+        os.t = o.phase_constant + ratio * t;
+        if(i < deviations.size()) os.t += deviations[i][p];
+        os.output = o.value(os.t);
+        os.delta = 0;
+    }
+    s.control_phase = 0;
+}
+
+void fm_wavetable::align(const fm_synth& synth, fm_synth::state& s) const
+{
+    constexpr uint64_t step = (UINT64_C(1) << 32) / SIZE;
+    unsigned c = synth.carriers[0];
+    int64_t ratio = synth.period_lookup[c].first /
+        synth.period_lookup[c].second;
+    uint32_t t = s.base_t;
+    int32_t error = s.states[c].t - synth.oscillators[c].phase_constant -
+        ratio * t;
+    if(c < deviations.size()) error -= deviations[c][t / step];
+    s.base_t += error / ratio;
 }
 
 fm_instrument::fm_instrument(uint64_t samplerate)
 :   instrument(samplerate), synth_updated(false),
-    write_index(0), read_index(0)
-{}
+    write_index(0), read_index(0), unison(1), unison_detune(0),
+    unison_ratios(1, 1.0), unison_attenuation(65536),
+    voice_filter_type(filter_state::NONE), stable_hash(0), stable_count(0),
+    baked(nullptr), baked_in_use(nullptr), active_baked(nullptr),
+    cpu_budget(0), allow_sine_fallback(false), average_load(0),
+    overloaded_time(0), sine_fallback(false), sine_fade(0), governor_load(0),
+    overloaded_blocks(0), culled_voices(0), sine_blocks(0)
+{
+    set_max_polyphony();
+}
 
 void fm_instrument::set_synth(const fm_synth& s)
 {
+    // Drop a stale table before the audio thread can see the new patch.
+    update_baked(s);
     if(synth[write_index].index_compatible(s))
         synth[write_index] = s;
     else
@@ -783,88 +1149,540 @@ void fm_instrument::set_synth(const fm_synth& s)
         write_index ^= 1;
         synth[write_index] = s;
 
-        states[write_index].resize(states[write_index^1].size());
-        for(voice_id j = 0; j < states[write_index].size(); ++j)
-        {
-            states[write_index][j] = synth[write_index].start();
+        states[write_index].assign(
+            states[write_index^1].size(), synth[write_index].start()
+        );
+        for(voice_id j = 0; j < get_max_polyphony(); ++j)
             reset_voice(j);
-        }
 
         synth_updated = true;
     }
 }
 
+void fm_instrument::update_baked(const fm_synth& s)
+{
+    uint64_t hash = s.hash();
+    if(hash != stable_hash)
+    {
+        // Back to live synthesis as soon as anything changes.
+        stable_hash = hash;
+        stable_count = 0;
+        baked = nullptr;
+        return;
+    }
+    if(++stable_count != BAKE_DELAY) return;
+
+    auto it = baked_cache.find(hash);
+    if(it == baked_cache.end())
+    {
+        if(baked_cache.size() >= MAX_BAKED_PATCHES)
+        {
+            for(auto it = baked_cache.begin(); it != baked_cache.end();)
+            {
+                const fm_wavetable* w = it->second.get();
+                if(w && (w == baked || w == baked_in_use)) ++it;
+                else it = baked_cache.erase(it);
+            }
+        }
+        // Patches that can't be baked are cached too, so that they're not
+        // retried.
+        it = baked_cache.emplace(hash, fm_wavetable::bake(s)).first;
+    }
+    baked = it->second.get();
+}
+
 const fm_synth& fm_instrument::get_synth()
 {
     return synth[write_index];
 }
 
+void fm_instrument::set_voice_filter(const voice_filter_state& s)
+{
+    voice_filter = s;
+    voice_filter_type = s.type;
+}
+
+void fm_instrument::set_oversampling(unsigned factor)
+{
+    if(oversampler.get_factor() == factor) return;
+    oversampler = decimator(factor);
+    refresh_all_voices();
+}
+
+unsigned fm_instrument::get_oversampling() const
+{
+    return oversampler.get_factor();
+}
+
+void fm_instrument::set_unison(unsigned count, double detune)
+{
+    count = std::clamp(count, 1u, MAX_UNISON);
+    unison_detune = detune;
+    unison_ratios.resize(count);
+    for(unsigned u = 0; u < count; ++u)
+    {
+        double cents = count == 1 ? 0.0 :
+            detune * (u / (double)(count - 1) - 0.5);
+        unison_ratios[u] = exp2(cents / 1200.0);
+    }
+
+    if(count == unison)
+    {
+        refresh_all_voices();
+        return;
+    }
+
+    unison = count;
+    unison_attenuation = round(65536.0 * sqrt(count));
+    for(unsigned i = 0; i < 2; ++i)
+    {
+        states[i].assign(
+            get_max_polyphony() * unison, synth[i].start()
+        );
+    }
+    for(voice_id j = 0; j < get_max_polyphony(); ++j)
+        reset_voice(j);
+}
+
+unsigned fm_instrument::get_unison() const
+{
+    return unison;
+}
+
+double fm_instrument::get_unison_detune() const
+{
+    return unison_detune;
+}
+
+void fm_instrument::set_cpu_budget(double budget, bool allow_sine_fallback)
+{
+    cpu_budget = budget;
+    this->allow_sine_fallback = allow_sine_fallback;
+}
+
+double fm_instrument::get_cpu_budget() const
+{
+    return cpu_budget;
+}
+
+fm_instrument::governor_stats fm_instrument::get_governor_stats() const
+{
+    return {governor_load, overloaded_blocks, culled_voices, sine_blocks};
+}
+
+void fm_instrument::reset_governor_stats()
+{
+    overloaded_blocks = 0;
+    culled_voices = 0;
+    sine_blocks = 0;
+}
+
+bool fm_instrument::is_silent() const
+{
+    return instrument::is_silent() && (
+        voice_filters.get_type() == filter_state::NONE ||
+        !voice_filters.is_ringing()
+    );
+}
+
 void fm_instrument::synthesize(int32_t* samples, unsigned sample_count) 
 {
+    auto start = std::chrono::steady_clock::now();
     if(synth_updated)
     {
         read_index ^= 1;
         synth_updated = false;
     }
+
+    filter_state::filter_type filter_type =
+        (filter_state::filter_type)voice_filter_type.load();
+    if(voice_filters.get_type() != filter_type)
+    {
+        voice_filters.set_type(filter_type);
+        for(voice_id j = 0; j < get_max_polyphony(); ++j)
+            voice_filters.reset(j);
+    }
+
+    // Switching tables would jump the phase of voices playing sines, since
+    // their oscillators are frozen.
+    const fm_wavetable* table = baked;
+    if(table != active_baked && !sine_fallback && sine_fade == 0)
+    {
+        // The old table is still protected by baked_in_use here.
+        if(active_baked)
+        {
+            for(fm_synth::state& s: states[read_index])
+                active_baked->restore(synth[read_index], s);
+        }
+        for(;;)
+        {
+            baked_in_use = table;
+            const fm_wavetable* again = baked;
+            if(again == table) break;
+            table = again;
+        }
+        active_baked = table;
+        if(table)
+        {
+            for(fm_synth::state& s: states[read_index])
+                table->align(synth[read_index], s);
+        }
+    }
+
+    if(is_silent())
+    {
+        memset(samples, 0, sample_count * sizeof(*samples));
+        return;
+    }
+
+    unsigned factor = oversampler.get_factor();
+    if(factor == 1) render(samples, sample_count);
+    else
+    {
+        unsigned chunk = decimator::MAX_BLOCK / factor;
+        for(unsigned offset = 0; offset < sample_count; offset += chunk)
+        {
+            unsigned count = std::min(sample_count - offset, chunk);
+            render(oversampled, count * factor);
+            oversampler.process(oversampled, count * factor, samples + offset);
+        }
+    }
+
+    apply_filter(samples, sample_count);
+
+    if(cpu_budget > 0)
+    {
+        govern(
+            std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start
+            ).count(),
+            sample_count
+        );
+    }
+}
+
+uint64_t fm_instrument::get_oversampled_rate() const
+{
+    return get_samplerate() * oversampler.get_factor();
+}
+
+void fm_instrument::render(int32_t* samples, unsigned sample_count)
+{
+    // Envelopes are stepped once per output sample.
+    unsigned step_mask = oversampler.get_factor() - 1;
     fm_synth* syn = synth + read_index;
     std::vector<fm_synth::state>* st = states + read_index;
+    const fm_wavetable* table = active_baked;
+    // Only voices that are sounding are rendered, so the size of the voice
+    // pool doesn't matter.
+    get_active_voices(active_voices);
+    if(!table)
+    {
+        for(voice_id j: active_voices)
+            for(unsigned u = 0; u < unison; ++u)
+                syn->update_control_rate((*st)[j * unison + u]);
+    }
+
+    auto step_frequency = [syn](fm_synth::state& s){
+        return syn->step_frequency(s);
+    };
+    auto step_phase = [syn](fm_synth::state& s){
+        return syn->step_phase(s);
+    };
+    auto step_baked = [table](fm_synth::state& s){
+        return table->step(s);
+    };
+
+    // Crossfades each voice between the full patch and plain sines.
+    bool sine = sine_fallback;
+    unsigned fade_length = std::max(
+        (unsigned)(get_oversampled_rate() * SINE_FADE_TIME), 1u
+    );
+    auto with_sines = [syn, sine, fade_length](auto step_func){
+        return [syn, sine, fade_length, step_func](fm_synth::state& s){
+            unsigned target = sine ? fade_length : 0;
+            if(s.sine_mix == target)
+                return sine ? syn->step_sine(s) : step_func(s);
+            if(s.sine_mix < target) s.sine_mix++;
+            else s.sine_mix = std::min(s.sine_mix - 1, fade_length);
+            int64_t full = step_func(s);
+            return full +
+                (syn->sine_value(s) - full) * s.sine_mix / fade_length;
+        };
+    };
+    auto sine_frequency = with_sines(step_frequency);
+    auto sine_phase = with_sines(step_phase);
+    bool use_sines = sine || sine_fade;
+
+    // The unison copies of a voice share its envelope and volume, so they're
+    // stepped back to back.
+    unsigned copies = unison;
+    int64_t attenuation = unison_attenuation;
+    auto step_copies = [syn, st, copies, attenuation](
+        auto step_func, voice_id j, int64_t volume_num, int64_t volume_denom
+    ){
+        fm_synth::state* s = st->data() + j * copies;
+        if(copies == 1)
+        {
+            syn->set_volume(*s, volume_num, volume_denom);
+            return step_func(*s);
+        }
+        volume_denom = volume_denom * attenuation >> 16;
+        int64_t sum = 0;
+        for(unsigned u = 0; u < copies; ++u)
+        {
+            syn->set_volume(s[u], volume_num, volume_denom);
+            sum += step_func(s[u]);
+        }
+        return sum;
+    };
 
     // This is done by duplication to avoid testing mode in inner loops.
 #define generate_samples(step_func) \
     for(unsigned i = 0; i < sample_count; ++i) \
     { \
         int64_t sum = 0; \
-        for(voice_id j = 0; j < states[read_index].size(); ++j) \
+        for(voice_id j: active_voices) \
         { \
-            step_voice(j); \
+            if((i & step_mask) == 0) step_voice(j); \
             int64_t volume_num = 0, volume_denom; \
             get_voice_volume(j, volume_num, volume_denom); \
             if(volume_num == 0) continue; \
-            synth[read_index].set_volume((*st)[j], volume_num, volume_denom); \
-            sum += syn-> step_func ((*st)[j]); \
+            sum += step_copies(step_func, j, volume_num, volume_denom); \
         } \
         samples[i] = std::clamp( \
             sum, (int64_t)INT32_MIN, (int64_t)INT32_MAX \
         ); \
     }
 
-    switch(synth[read_index].get_modulation_mode())
+    // With per-voice filters, voices are rendered one at a time into their
+    // own lanes, and the filter bank mixes them. Voices don't depend on each
+    // other, so the order doesn't change the result.
+#define generate_filtered_samples(step_func) \
+    for(voice_id j: active_voices) \
+    { \
+        for(unsigned i = 0; i < count; ++i) \
+        { \
+            if((i & step_mask) == 0) step_voice(j); \
+            int64_t volume_num = 0, volume_denom; \
+            get_voice_volume(j, volume_num, volume_denom); \
+            double& lane = voice_samples[i*stride + j]; \
+            lane = 0; \
+            if(volume_num == 0) continue; \
+            lane = step_copies(step_func, j, volume_num, volume_denom); \
+        } \
+    }
+
+    if(voice_filters.get_type() == filter_state::NONE)
     {
-    case fm_synth::FREQUENCY:
-        generate_samples(step_frequency)
-        break;
-    case fm_synth::PHASE:
-        generate_samples(step_phase)
-        break;
+        if(table) generate_samples(step_baked)
+        else if(use_sines) switch(synth[read_index].get_modulation_mode())
+        {
+        case fm_synth::FREQUENCY:
+            generate_samples(sine_frequency)
+            break;
+        case fm_synth::PHASE:
+            generate_samples(sine_phase)
+            break;
+        }
+        else switch(synth[read_index].get_modulation_mode())
+        {
+        case fm_synth::FREQUENCY:
+            generate_samples(step_frequency)
+            break;
+        case fm_synth::PHASE:
+            generate_samples(step_phase)
+            break;
+        }
     }
-#undef generate_samples
+    else
+    {
+        unsigned stride = voice_filters.get_stride();
+        // Groups with an active voice, and groups whose finished voices are
+        // still ringing. active_voices is in order.
+        active_groups.clear();
+        auto v = active_voices.begin();
+        for(unsigned g = 0; g < stride / voice_filter_bank::LANES; ++g)
+        {
+            bool active = voice_filters.is_ringing(g);
+            while(
+                v != active_voices.end() &&
+                *v / voice_filter_bank::LANES == g
+            ){
+                active = true;
+                ++v;
+            }
+            if(active) active_groups.push_back(g);
+        }
 
-    apply_filter(samples, sample_count);
+        for(
+            unsigned offset = 0;
+            offset < sample_count;
+            offset += voice_filter_bank::MAX_BLOCK
+        ){
+            unsigned count = std::min(
+                sample_count - offset, voice_filter_bank::MAX_BLOCK
+            );
+            update_voice_filters();
+            // Lanes of silent voices next to active ones must be zero.
+            for(unsigned g: active_groups)
+            {
+                for(unsigned i = 0; i < count; ++i)
+                {
+                    double* lanes = voice_samples.data() + i*stride +
+                        g*voice_filter_bank::LANES;
+                    std::fill(lanes, lanes + voice_filter_bank::LANES, 0.0);
+                }
+            }
+            if(table) generate_filtered_samples(step_baked)
+            else if(use_sines) switch(synth[read_index].get_modulation_mode())
+            {
+            case fm_synth::FREQUENCY:
+                generate_filtered_samples(sine_frequency)
+                break;
+            case fm_synth::PHASE:
+                generate_filtered_samples(sine_phase)
+                break;
+            }
+            else switch(synth[read_index].get_modulation_mode())
+            {
+            case fm_synth::FREQUENCY:
+                generate_filtered_samples(step_frequency)
+                break;
+            case fm_synth::PHASE:
+                generate_filtered_samples(step_phase)
+                break;
+            }
+            voice_filters.process(
+                voice_samples.data(), count, samples+offset, active_groups
+            );
+        }
+    }
+#undef generate_filtered_samples
+#undef generate_samples
 }
 
 void fm_instrument::refresh_voice(voice_id id)
 {
-    synth[write_index].set_frequency(
-        states[write_index][id],
-        get_frequency(id),
-        get_samplerate()
-    );
+    double frequency = get_frequency(id);
+    for(unsigned u = 0; u < unison; ++u)
+    {
+        synth[write_index].set_frequency(
+            states[write_index][id * unison + u],
+            frequency * unison_ratios[u],
+            get_oversampled_rate()
+        );
+    }
 }
 
 void fm_instrument::reset_voice(voice_id id)
 {
-    synth[write_index].set_frequency(
-        states[write_index][id],
-        get_frequency(id),
-        get_samplerate()
-    );
-    synth[write_index].reset(states[write_index][id]);
+    refresh_voice(id);
+    for(unsigned u = 0; u < unison; ++u)
+    {
+        synth[write_index].reset(
+            states[write_index][id * unison + u], u * UNISON_PHASE_STEP
+        );
+    }
+    if(id < voice_filters.get_stride()) voice_filters.reset(id);
 }
 
 void fm_instrument::handle_polyphony(unsigned n)
 {
     if(n == 0) n = 1;
-    states[write_index].resize(n, synth[write_index].start());
-    states[read_index].resize(n, synth[read_index].start());
+    states[write_index].resize(n * unison, synth[write_index].start());
+    states[read_index].resize(n * unison, synth[read_index].start());
+    voice_filters.resize(n);
+    voice_samples.assign(
+        voice_filter_bank::MAX_BLOCK * voice_filters.get_stride(), 0.0
+    );
+    active_voices.reserve(n);
+    active_groups.reserve(voice_filters.get_stride());
+    cull_candidates.reserve(n);
+}
+
+void fm_instrument::update_voice_filters()
+{
+    double samplerate = get_oversampled_rate();
+    for(voice_id j: active_voices)
+    {
+        double freq = get_frequency(j) * voice_filter.key_track;
+        if(voice_filter.envelope_depth != 0)
+            freq *= exp2(voice_filter.envelope_depth * get_envelope_level(j));
+        voice_filters.set_cutoff(j, freq/samplerate, voice_filter.resonance);
+    }
 }
 
+void fm_instrument::govern(double elapsed, unsigned sample_count)
+{
+    double duration = sample_count / (double)get_samplerate();
+    double load = elapsed / duration;
+    average_load += (load - average_load) *
+        std::min(duration / LOAD_AVERAGE_TIME, 1.0);
+    governor_load = average_load;
+
+    unsigned fade_length = get_oversampled_rate() * SINE_FADE_TIME;
+    sine_fade -= std::min(sine_fade, sample_count * oversampler.get_factor());
+    if(sine_fallback)
+    {
+        sine_blocks++;
+        if(average_load < cpu_budget * SINE_RECOVERY)
+        {
+            sine_fallback = false;
+            sine_fade = fade_length;
+        }
+    }
+
+    if(load <= cpu_budget)
+    {
+        overloaded_time = 0;
+        return;
+    }
+    overloaded_blocks++;
+    overloaded_time += duration;
+
+    // Assume that all voices cost the same. Voices that are already fading
+    // out will be gone soon, so they're not culled again.
+    get_active_voices(active_voices);
+    unsigned fading = 0;
+    for(voice_id j: active_voices) fading += is_voice_culled(j);
+    unsigned excess = ceil(active_voices.size() * (1.0 - cpu_budget / load));
+    if(excess <= fading) return;
+    excess -= fading;
+
+    excess -= cull_quietest(excess, false);
+    if(excess == 0) return;
+
+    // Sines get a chance to bring the load down before held voices are cut.
+    if(allow_sine_fallback && !active_baked && !sine_fallback)
+    {
+        sine_fallback = true;
+        sine_fade = fade_length;
+        overloaded_time = 0;
+        return;
+    }
+    if(sine_fade == 0 && overloaded_time >= HELD_CULL_DELAY)
+        cull_quietest(excess, true);
+}
+
+unsigned fm_instrument::cull_quietest(unsigned count, bool pressed)
+{
+    cull_candidates.clear();
+    for(voice_id j: active_voices)
+    {
+        if(is_voice_culled(j) || is_voice_pressed(j) != pressed) continue;
+        int64_t volume_num = 0, volume_denom;
+        get_voice_volume(j, volume_num, volume_denom);
+        cull_candidates.emplace_back(volume_num, j);
+    }
+    count = std::min(count, (unsigned)cull_candidates.size());
+    std::nth_element(
+        cull_candidates.begin(),
+        cull_candidates.begin() + count,
+        cull_candidates.end()
+    );
+    for(unsigned i = 0; i < count; ++i)
+        cull_voice(cull_candidates[i].second);
+    culled_voices += count;
+    return count;
+}
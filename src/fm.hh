@@ -28,10 +28,13 @@
 #include <type_traits>
 #include <utility>
 #include <variant>
+#include <memory>
+#include <unordered_map>
 
 class oscillator
 {
 friend class fm_synth;
+friend class fm_wavetable;
 public:
     enum func
     {
@@ -48,6 +51,14 @@ public:
 
         int64_t t;
         int64_t output;
+
+        // Slow oscillators are only evaluated once per control step, and
+        // their output moves by delta on every sample in between.
+        bool slow;
+        int64_t delta;
+        // Scratch values for fm_synth::update_control_rate().
+        double rate;
+        unsigned max_step;
     };
 
     oscillator(
@@ -91,6 +102,14 @@ public:
         uint64_t period_denom,
         uint64_t phase_offset = 0
     ) const;
+    // Advances a slow oscillator by a whole control step.
+    void update_slow(
+        state& s,
+        uint64_t period_num,
+        uint64_t period_denom,
+        unsigned steps,
+        uint64_t phase_offset = 0
+    ) const;
 
 protected:
     func type;
@@ -104,12 +123,22 @@ protected:
 
 class fm_synth
 {
+friend class fm_wavetable;
 public:
     struct state
     {
         int64_t period_num, period_denom;
         int64_t amp_num, amp_denom;
+        // Phase of the voice frequency since reset, in the same units as
+        // oscillator::state::t.
+        uint64_t base_t;
         std::vector<oscillator::state> states;
+        // Samples per control step, 1 if no oscillator is slow.
+        unsigned control_step;
+        unsigned control_phase;
+        // Progress of a crossfade from the full patch to step_sine(), used
+        // by fm_instrument under heavy load.
+        unsigned sine_mix;
     };
 
     enum modulation_mode
@@ -125,18 +154,28 @@ public:
     void set_modulation_mode(modulation_mode mode);
     modulation_mode get_modulation_mode() const;
 
+    // Modulators whose frequency is low enough are evaluated only every few
+    // samples and linearly interpolated in between. This is the largest
+    // allowed interpolation error relative to the modulator's amplitude. 0
+    // evaluates everything at the full samplerate.
+    void set_max_control_error(double error);
+    double get_max_control_error() const;
+
     std::vector<unsigned>& get_carriers();
     const std::vector<unsigned>& get_carriers() const;
 
     unsigned get_oscillator_count() const;
     oscillator& get_oscillator(unsigned i);
     const oscillator& get_oscillator(unsigned i) const;
-    // Invalidates and updates all oscillator indices after i. May remove
-    // several oscillators. States are also invalid afterwards, so restart them.
+    // Invalidates all oscillator indices. May remove several oscillators.
+    // States are also invalid afterwards, so restart them.
     void erase_oscillator(unsigned i);
     unsigned add_oscillator(const oscillator& o);
     // Cleans up modulators after dependency changes, ensuring that they are
-    // properly formatted.
+    // properly formatted. A modulator may modulate several oscillators, in
+    // which case it's evaluated once and its period is relative to its
+    // first parent. Links that would form a cycle are removed, as are
+    // oscillators that no carrier depends on. Runs in linear time.
     void finish_changes();
     // Call this after you are finished modifying the period of any oscillator.
     // finish_changes() also calls this.
@@ -145,6 +184,9 @@ public:
     double get_total_carrier_amplitude() const;
     void limit_total_carrier_amplitude();
 
+    // Covers everything that affects the output waveform.
+    uint64_t hash() const;
+
     struct layout
     {
         struct group
@@ -163,11 +205,22 @@ public:
     layout generate_layout();
 
     state start(double volume = 0.5, int64_t denom = 65536) const;
-    void reset(state& s) const;
+    // phase is where the voice starts in its cycle, in the same units as
+    // state::base_t. The oscillators start at the matching phases.
+    void reset(state& s, uint32_t phase = 0) const;
+    // Picks the slow oscillators of a voice based on its current frequency.
+    // Call this before each block; the change only happens at the start of
+    // a control step.
+    void update_control_rate(state& s) const;
     // Call this if mode == PHASE
     int64_t step_phase(state& s) const;
     // Call this if mode == FREQUENCY
     int64_t step_frequency(state& s) const;
+    // A cheap stand-in for the above: the carriers as plain sines, without
+    // modulation. Doesn't advance the oscillators.
+    int64_t step_sine(state& s) const;
+    // The output of step_sine() at the current phase, without advancing.
+    int64_t sine_value(const state& s) const;
     void synthesize(state& s, int32_t* samples, unsigned sample_count) const;
     void set_frequency(state& s, double frequency, uint64_t samplerate) const;
     void set_volume(state& s, int64_t volume_num, int64_t volume_denom) const;
@@ -180,24 +233,100 @@ private:
 
     void erase_invalid_indices();
     reference_vec determine_references();
-    void erase_orphans(reference_vec& ref);
-    void erase_index(unsigned index, reference_vec* ref = nullptr);
     void sort_oscillators();
 
     modulation_mode mode;
+    double max_control_error;
     std::vector<oscillator> oscillators;
     std::vector<unsigned> carriers;
     std::vector<std::pair<int64_t, int64_t>> period_lookup;
 };
 
+// One cycle of a patch whose oscillators all run at integer multiples of the
+// voice frequency, so that its output repeats at the voice frequency. The
+// cycle is stored at several bandwidths, and each voice reads the one with no
+// harmonics above the Nyquist frequency.
+class fm_wavetable
+{
+public:
+    static constexpr unsigned SIZE = 2048;
+    static constexpr unsigned LEVELS = 11;
+
+    // Returns nullptr if the patch isn't periodic.
+    static std::unique_ptr<fm_wavetable> bake(const fm_synth& synth);
+
+    // Replaces fm_synth::step_frequency() or step_phase() for the patch.
+    int64_t step(fm_synth::state& s) const;
+    // The oscillators of s aren't updated by step(). This puts them where
+    // the live synth would have them, so that it can continue from here.
+    void restore(const fm_synth& synth, fm_synth::state& s) const;
+    // The live synth rounds frequency modulation slightly, so its phase
+    // drifts from base_t over long notes. This moves base_t to match the
+    // first carrier before step() takes over.
+    void align(const fm_synth& synth, fm_synth::state& s) const;
+
+private:
+    // Each level has half the harmonics of the previous one. There's one
+    // extra sample at the end for interpolation.
+    std::vector<float> levels[LEVELS];
+    // In frequency mode, how far each oscillator's phase is from where a
+    // constant frequency would have it, for each position in the cycle.
+    std::vector<std::vector<int32_t>> deviations;
+};
+
 class fm_instrument: public instrument
 {
 public:
+    struct governor_stats
+    {
+        // Render time relative to the duration of the rendered samples,
+        // averaged over a short while.
+        double load;
+        uint64_t overloaded_blocks;
+        uint64_t culled_voices;
+        uint64_t sine_blocks;
+    };
+
+    static constexpr unsigned MAX_UNISON = 8;
+
     fm_instrument(uint64_t samplerate);
 
     void set_synth(const fm_synth& s);
     const fm_synth& get_synth();
 
+    void set_voice_filter(const voice_filter_state& s);
+
+    // Renders the voices at factor times the samplerate and decimates them,
+    // which reduces aliasing from high modulation indices and harsh
+    // waveforms. factor is 1, 2 or 4. Envelopes and the filter set with
+    // set_filter() still run at the normal samplerate.
+    void set_oversampling(unsigned factor);
+    unsigned get_oversampling() const;
+
+    // Plays each voice as count copies, detuned evenly over detune cents in
+    // total and started at different phases. The copies share the envelope,
+    // volume and patch of their voice, and are attenuated by sqrt(count) so
+    // that the voice stays about as loud. Changing the count resets all
+    // voices, so do it before playing. The detune can be changed any time.
+    void set_unison(unsigned count, double detune = 0.0);
+    unsigned get_unison() const;
+    double get_unison_detune() const;
+
+    // When a block takes longer to render than budget times its duration,
+    // voices are faded out until it fits: released voices first, quietest
+    // first. If allowed, the patch is then crossfaded to plain sines until
+    // the load has dropped well below the budget, and only after that are
+    // held voices culled too. 0 disables this. Call this before playing.
+    void set_cpu_budget(double budget, bool allow_sine_fallback = false);
+    double get_cpu_budget() const;
+
+    // Can be called from any thread.
+    governor_stats get_governor_stats() const;
+    void reset_governor_stats();
+
+    // Also waits for the per-voice filters to ring out.
+    bool is_silent() const override;
+
     void synthesize(int32_t* samples, unsigned sample_count) override;
 
 protected:
@@ -206,11 +335,79 @@ protected:
     void handle_polyphony(unsigned n) override;
 
 private:
+    // Static patches are played from a wavetable once they have stayed
+    // unchanged for a while.
+    void update_baked(const fm_synth& s);
+
     // Double buffered synth changes to avoid skips.
     std::atomic_bool synth_updated;
     unsigned write_index, read_index;
     fm_synth synth[2];
+    // The unison copies of each voice are next to each other, starting at
+    // id * unison.
     std::vector<fm_synth::state> states[2];
+
+    unsigned unison;
+    double unison_detune;
+    // Frequency multiplier of each copy.
+    std::vector<double> unison_ratios;
+    // sqrt(unison) in 16.16 fixed point, divides the volume of each copy.
+    int64_t unison_attenuation;
+
+    uint64_t get_oversampled_rate() const;
+    // sample_count must be a multiple of the oversampling factor.
+    void render(int32_t* samples, unsigned sample_count);
+
+    // Cutoffs follow the voices' frequencies and envelopes, so they're
+    // recomputed once per synthesized block.
+    void update_voice_filters();
+
+    // Reacts to the time it took to synthesize sample_count samples.
+    void govern(double elapsed, unsigned sample_count);
+    // Culls up to count voices, quietest first, from those that are
+    // released or held. Returns how many were culled.
+    unsigned cull_quietest(unsigned count, bool pressed);
+
+    voice_filter_state voice_filter;
+    // Type changes are picked up at the start of the next synthesized block,
+    // where the lanes can be reset without racing the audio thread.
+    std::atomic_int voice_filter_type;
+    voice_filter_bank voice_filters;
+    // Interleaved input lanes for voice_filters.
+    std::vector<double> voice_samples;
+
+    // Voices sounding in the current block and their lane groups, reserved
+    // for the whole pool.
+    std::vector<voice_id> active_voices;
+    std::vector<unsigned> active_groups;
+
+    decimator oversampler;
+    int32_t oversampled[decimator::MAX_BLOCK];
+
+    // The cache is only touched by the thread calling set_synth(). The
+    // audio thread announces the table it's reading in baked_in_use, and
+    // tables are only freed when neither pointer refers to them.
+    std::unordered_map<uint64_t, std::unique_ptr<fm_wavetable>> baked_cache;
+    uint64_t stable_hash;
+    unsigned stable_count;
+    std::atomic<const fm_wavetable*> baked, baked_in_use;
+    // Only accessed by the audio thread.
+    const fm_wavetable* active_baked;
+
+    double cpu_budget;
+    bool allow_sine_fallback;
+    // Only accessed by the audio thread.
+    double average_load;
+    double overloaded_time;
+    bool sine_fallback;
+    // Samples left in the crossfade to or from sines.
+    unsigned sine_fade;
+    std::vector<std::pair<int64_t, voice_id>> cull_candidates;
+
+    std::atomic<double> governor_load;
+    std::atomic_uint64_t overloaded_blocks;
+    std::atomic_uint64_t culled_voices;
+    std::atomic_uint64_t sine_blocks;
 };
 
 #endif
@@ -64,6 +64,20 @@ inline int32_t i32noise(int32_t x)
     return (x * (x * x * 60493 + 19990303) + 1376312589);
 }
 
+// Number of leading zero bits, x must not be zero.
+inline int clz64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(x);
+#elif  defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - index;
+#else
+#error "CLZ not yet implemented for compilers other than GCC or Clang!"
+#endif
+}
+
 // This function makes sure the fraction components fit in 32 bits.
 inline void normalize_fract(int64_t& num, int64_t& denom)
 {
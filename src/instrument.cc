@@ -23,6 +23,7 @@
 #include <cstring>
 #include <climits>
 #include <cmath>
+#include <algorithm>
 
 void envelope::set_volume(
     double peak_volume,
@@ -62,10 +63,258 @@ bool envelope::operator==(const envelope& other) const
     return memcmp(&other, this, sizeof(envelope)) == 0;
 }
 
+voice_allocator::voice_allocator(unsigned voice_count)
+:   released_head(NONE), released_tail(NONE), press_counter(0),
+    limit(voice_count), stealing(OLDEST), finished_head(0), finished_tail(0)
+{
+    resize(voice_count);
+}
+
+void voice_allocator::resize(unsigned voice_count)
+{
+    voices.assign(voice_count, {FREE, 0, 0, 0, 0, NONE, NONE});
+    free.clear();
+    held.clear();
+    free.reserve(voice_count);
+    held.reserve(voice_count);
+    released_head = released_tail = NONE;
+    note_voices.clear();
+
+    // Lower indices are used first.
+    for(unsigned i = voice_count; i > 0; --i) push_free(i-1);
+
+    // Each voice can finish at most once between two calls to allocate() or
+    // press(), so this never fills up.
+    finished.resize(voice_count + 1);
+    finished_head = 0;
+    finished_tail = 0;
+}
+
+unsigned voice_allocator::size() const
+{
+    return voices.size();
+}
+
+void voice_allocator::set_limit(unsigned limit)
+{
+    this->limit = std::max(limit, 1u);
+}
+
+unsigned voice_allocator::get_limit() const
+{
+    return limit;
+}
+
+void voice_allocator::set_policy(policy p)
+{
+    if(stealing == p) return;
+    stealing = p;
+    std::vector<unsigned> old_held;
+    old_held.swap(held);
+    held.reserve(voices.size());
+    for(unsigned id: old_held) heap_push(id);
+}
+
+voice_allocator::policy voice_allocator::get_policy() const
+{
+    return stealing;
+}
+
+unsigned voice_allocator::allocate(int semitone)
+{
+    receive_finished();
+
+    if(stealing == SAME_NOTE)
+    {
+        auto it = note_voices.find(semitone);
+        if(it != note_voices.end())
+        {
+            voice& v = voices[it->second];
+            if(v.list != FREE && v.semitone == semitone) return it->second;
+        }
+    }
+
+    unsigned used = voices.size() - free.size();
+    if(free.size() && used < limit) return free.back();
+    if(released_head != NONE) return released_head;
+    if(held.size()) return held.front();
+    return free.back();
+}
+
+void voice_allocator::press(unsigned id, int semitone, int64_t volume)
+{
+    receive_finished();
+    unlink(id);
+    voice& v = voices[id];
+    v.semitone = semitone;
+    v.volume = volume;
+    v.press_order = press_counter++;
+    heap_push(id);
+    if(stealing == SAME_NOTE) note_voices[semitone] = id;
+}
+
+void voice_allocator::set_volume(unsigned id, int64_t volume)
+{
+    voice& v = voices[id];
+    if(v.volume == volume) return;
+    v.volume = volume;
+    if(v.list == HELD && stealing == QUIETEST) heap_sift(v.index);
+}
+
+void voice_allocator::release(unsigned id)
+{
+    if(voices[id].list != HELD) return;
+    unlink(id);
+    push_released(id);
+}
+
+void voice_allocator::release_all()
+{
+    // Oldest first, so that they're also stolen in that order.
+    std::sort(
+        held.begin(), held.end(),
+        [&](unsigned a, unsigned b){
+            return voices[a].press_order < voices[b].press_order;
+        }
+    );
+    std::vector<unsigned> old_held;
+    old_held.swap(held);
+    held.reserve(voices.size());
+    for(unsigned id: old_held) push_released(id);
+}
+
+void voice_allocator::discard(unsigned id)
+{
+    unlink(id);
+    push_free(id);
+}
+
+void voice_allocator::finish(unsigned id)
+{
+    unsigned head = finished_head;
+    finished[head] = id;
+    finished_head = (head + 1) % finished.size();
+}
+
+void voice_allocator::receive_finished()
+{
+    unsigned tail = finished_tail;
+    while(tail != finished_head)
+    {
+        unsigned id = finished[tail];
+        // The voice may have been pressed again after it finished.
+        if(voices[id].list == RELEASED)
+        {
+            unlink(id);
+            push_free(id);
+        }
+        tail = (tail + 1) % finished.size();
+    }
+    finished_tail = tail;
+}
+
+void voice_allocator::unlink(unsigned id)
+{
+    voice& v = voices[id];
+    switch(v.list)
+    {
+    case FREE:
+        voices[free.back()].index = v.index;
+        free[v.index] = free.back();
+        free.pop_back();
+        break;
+    case HELD:
+        {
+            unsigned last = held.back();
+            held.pop_back();
+            if(last != id)
+            {
+                heap_move(v.index, last);
+                heap_sift(v.index);
+            }
+        }
+        break;
+    case RELEASED:
+        if(v.prev != NONE) voices[v.prev].next = v.next;
+        else released_head = v.next;
+        if(v.next != NONE) voices[v.next].prev = v.prev;
+        else released_tail = v.prev;
+        break;
+    }
+}
+
+void voice_allocator::push_free(unsigned id)
+{
+    voice& v = voices[id];
+    v.list = FREE;
+    v.index = free.size();
+    free.push_back(id);
+}
+
+void voice_allocator::push_released(unsigned id)
+{
+    voice& v = voices[id];
+    v.list = RELEASED;
+    v.prev = released_tail;
+    v.next = NONE;
+    if(released_tail != NONE) voices[released_tail].next = id;
+    else released_head = id;
+    released_tail = id;
+}
+
+bool voice_allocator::steal_before(unsigned a, unsigned b) const
+{
+    const voice& va = voices[a];
+    const voice& vb = voices[b];
+    if(stealing == QUIETEST && va.volume != vb.volume)
+        return va.volume < vb.volume;
+    return va.press_order < vb.press_order;
+}
+
+void voice_allocator::heap_push(unsigned id)
+{
+    voices[id].list = HELD;
+    held.push_back(id);
+    heap_move(held.size()-1, id);
+    heap_sift(held.size()-1);
+}
+
+void voice_allocator::heap_move(unsigned pos, unsigned id)
+{
+    held[pos] = id;
+    voices[id].index = pos;
+}
+
+void voice_allocator::heap_sift(unsigned pos)
+{
+    unsigned id = held[pos];
+    // Up
+    while(pos > 0)
+    {
+        unsigned parent = (pos - 1) / 2;
+        if(!steal_before(id, held[parent])) break;
+        heap_move(pos, held[parent]);
+        pos = parent;
+    }
+    // Down
+    for(;;)
+    {
+        unsigned child = pos * 2 + 1;
+        if(child >= held.size()) break;
+        if(child + 1 < held.size() && steal_before(held[child+1], held[child]))
+            child++;
+        if(!steal_before(held[child], id)) break;
+        heap_move(pos, held[child]);
+        pos = child;
+    }
+    heap_move(pos, id);
+}
+
 instrument::instrument(uint64_t samplerate)
-:   base_frequency(440), volume_denom(1<<20), samplerate(samplerate)
+:   polyphony(1), base_frequency(440), volume_denom(1<<20),
+    samplerate(samplerate), filter_cutoff_mul(1.0), filter_resonance_mul(1.0)
 {
-    voices.resize(1, {false, false, 0, 0, 0, 0, 0});
+    voices.resize(1, {false, false, false, 0, 0, 0, 0, 0, 0, 0, 1, 1});
     adsr.set_volume(1.0f, 0.5f);
     set_volume(0.5f);
     set_max_volume_skip(32);
@@ -93,68 +342,109 @@ uint64_t instrument::get_samplerate() const
 
 instrument::voice_id instrument::press_voice(int semitone)
 {
-    uint64_t closest_release = UINT64_MAX;
-    voice_id closest_index = voices.size()-1;
-    for(size_t i = 0; i < voices.size(); ++i)
-    {
-        if(!voices[i].enabled)
-        {
-            closest_index = i;
-            break;
-        }
-        else
-        {
-            if(voices[i].release_timer < closest_release)
-            {
-                closest_release = voices[i].release_timer;
-                closest_index = i;
-            }
-        }
-    }
-
-    press_voice(closest_index, semitone);
-    return closest_index;
+    voice_id id = allocator.allocate(semitone);
+    press_voice(id, semitone);
+    return id;
 }
 
 void instrument::press_voice(voice_id id, int semitone, double volume)
 {
+    allocator.press(id, semitone, volume_denom * volume);
     voices[id].enabled = true;
     voices[id].pressed = true;
+    voices[id].culled = false;
     voices[id].press_timer = adsr.attack_length + adsr.decay_length;
     voices[id].release_timer = adsr.release_length;
     voices[id].semitone = semitone;
     voices[id].volume_num = volume_denom * volume;
     voices[id].volume = 0;
+    voices[id].key_volume = volume;
+    voices[id].bend = 0;
+    voices[id].amplitude = 1;
+    voices[id].frequency_ratio = exp2(semitone/12.0);
     reset_voice(id);
 }
 
 void instrument::set_voice_volume(voice_id id, double volume)
 {
-    voices[id].volume_num = volume_denom * volume;
+    voice& v = voices[id];
+    v.key_volume = volume;
+    v.volume_num = volume_denom * volume * v.amplitude;
+    allocator.set_volume(id, v.volume_num);
+}
+
+void instrument::set_voice_expression(
+    voice_id id, double bend, double amplitude
+){
+    voice& v = voices[id];
+    if(v.amplitude != amplitude)
+    {
+        v.amplitude = amplitude;
+        v.volume_num = volume_denom * v.key_volume * amplitude;
+        allocator.set_volume(id, v.volume_num);
+    }
+    if(v.bend != bend)
+    {
+        v.bend = bend;
+        v.frequency_ratio = exp2((v.semitone + bend)/12.0);
+        refresh_voice(id);
+    }
 }
 
 void instrument::release_voice(voice_id id)
 {
     voices[id].pressed = false;
+    // A voice culled while held is already silent.
+    if(voices[id].enabled) allocator.release(id);
+    else allocator.discard(id);
 }
 
 void instrument::release_all_voices()
 {
     for(auto& v: voices) v.pressed = false;
+    allocator.release_all();
+    for(voice_id id = 0; id < voices.size(); ++id)
+        if(!voices[id].enabled) allocator.discard(id);
 }
 
-void instrument::set_polyphony(unsigned n)
+void instrument::set_max_polyphony(unsigned n)
 {
+    if(n == 0) n = 1;
     handle_polyphony(n);
-    if(voices.size() == n) return;
-    voices.resize(n, {false, false, 0, 0, 0, 0, 0});
+    if(voices.size() != n)
+    {
+        voices.resize(n, {false, false, false, 0, 0, 0, 0, 0, 0, 0, 1, 1});
+        reset_allocator();
+    }
+    set_polyphony(polyphony);
 }
 
-unsigned instrument::get_polyphony() const
+unsigned instrument::get_max_polyphony() const
 {
     return voices.size();
 }
 
+void instrument::set_polyphony(unsigned n)
+{
+    polyphony = std::clamp(n, 1u, (unsigned)voices.size());
+    allocator.set_limit(polyphony);
+}
+
+unsigned instrument::get_polyphony() const
+{
+    return polyphony;
+}
+
+void instrument::set_voice_stealing(voice_allocator::policy policy)
+{
+    allocator.set_policy(policy);
+}
+
+voice_allocator::policy instrument::get_voice_stealing() const
+{
+    return allocator.get_policy();
+}
+
 void instrument::set_envelope(const envelope& adsr)
 {
     if(this->adsr == adsr) return;
@@ -188,7 +478,7 @@ void instrument::set_volume(double volume)
 
 void instrument::set_max_safe_volume()
 {
-    set_volume(1.0/voices.size());
+    set_volume(1.0/polyphony);
 }
 
 double instrument::get_volume() const
@@ -200,6 +490,10 @@ void instrument::set_max_volume_skip(double max_volume_skip)
 {
     this->max_volume_skip = max_volume_skip * volume_denom / samplerate;
     if(this->max_volume_skip <= 0) this->max_volume_skip = 1;
+    cull_volume_skip = std::max(
+        this->max_volume_skip,
+        (int64_t)(volume_denom / (CULL_FADE_TIME * samplerate))
+    );
 }
 
 void instrument::set_filter(filter&& f)
@@ -212,11 +506,17 @@ void instrument::clear_filter()
     used_filter.reset();
 }
 
+void instrument::set_filter_modulation(double cutoff_mul, double resonance_mul)
+{
+    filter_cutoff_mul = cutoff_mul;
+    filter_resonance_mul = resonance_mul;
+}
+
 void instrument::copy_state(const instrument& other)
 {
-    unsigned polyphony = voices.size();
+    unsigned pool_size = voices.size();
     voices = other.voices;
-    voices.resize(polyphony, {false, false, 0, 0, 0, 0, 0});
+    voices.resize(pool_size, {false, false, false, 0, 0, 0, 0, 0, 0, 0, 1, 1});
     for(voice& v: voices)
     {
         v.press_timer = samplerate * v.press_timer / other.samplerate;
@@ -228,15 +528,32 @@ void instrument::copy_state(const instrument& other)
     volume_num = other.volume_num;
     volume_denom = other.volume_denom;
     max_volume_skip = other.max_volume_skip;
+    filter_cutoff_mul = other.filter_cutoff_mul;
+    filter_resonance_mul = other.filter_resonance_mul;
 
     // Reset all voices
     for(voice_id id = 0; id < voices.size(); ++id)
         reset_voice(id);
+    reset_allocator();
+}
+
+bool instrument::is_silent() const
+{
+    for(const voice& v: voices)
+        if(v.enabled) return false;
+    return !used_filter || used_filter->is_silent();
+}
+
+void instrument::get_active_voices(std::vector<voice_id>& ids) const
+{
+    ids.clear();
+    for(voice_id id = 0; id < voices.size(); ++id)
+        if(voices[id].enabled) ids.push_back(id);
 }
 
 double instrument::get_frequency(voice_id id) const
 {
-    return base_frequency * pow(2.0, voices[id].semitone/12.0);
+    return base_frequency * voices[id].frequency_ratio;
 }
 
 void instrument::get_voice_volume(voice_id id, int64_t& num, int64_t& denom)
@@ -246,6 +563,28 @@ void instrument::get_voice_volume(voice_id id, int64_t& num, int64_t& denom)
     num = v.volume;
 }
 
+bool instrument::is_voice_pressed(voice_id id) const
+{
+    return voices[id].pressed;
+}
+
+void instrument::cull_voice(voice_id id)
+{
+    voices[id].culled = true;
+}
+
+bool instrument::is_voice_culled(voice_id id) const
+{
+    return voices[id].culled;
+}
+
+double instrument::get_envelope_level(voice_id id) const
+{
+    const voice& v = voices[id];
+    if(!v.enabled || adsr.peak_volume_num == 0) return 0.0;
+    return envelope_volume(v)/(double)adsr.peak_volume_num;
+}
+
 void instrument::update_voice_volume(voice& v)
 {
     if(!v.enabled)
@@ -254,6 +593,22 @@ void instrument::update_voice_volume(voice& v)
         return;
     }
 
+    if(v.culled)
+    {
+        v.volume = std::max(v.volume - cull_volume_skip, (int64_t)0);
+        return;
+    }
+
+    int64_t target_volume = v.volume_num * volume_num * envelope_volume(v)
+        / (volume_denom * adsr.volume_denom);
+    int64_t skip_size = target_volume - v.volume;
+    if(skip_size < -max_volume_skip) skip_size = -max_volume_skip;
+    if(skip_size > max_volume_skip) skip_size = max_volume_skip;
+    v.volume += skip_size;
+}
+
+int64_t instrument::envelope_volume(const voice& v) const
+{
     int64_t target_volume = 0;
 
     int64_t attack_timer = v.press_timer - adsr.decay_length;
@@ -283,12 +638,7 @@ void instrument::update_voice_volume(voice& v)
         );
     }
 
-    target_volume = v.volume_num * volume_num * target_volume
-        / (volume_denom * adsr.volume_denom);
-    int64_t skip_size = target_volume - v.volume;
-    if(skip_size < -max_volume_skip) skip_size = -max_volume_skip;
-    if(skip_size > max_volume_skip) skip_size = max_volume_skip;
-    v.volume += skip_size;
+    return target_volume;
 }
 
 void instrument::step_voice(voice_id id)
@@ -296,7 +646,18 @@ void instrument::step_voice(voice_id id)
     voice& v = voices[id];
     if(!v.enabled) return;
 
-    if(v.pressed)
+    if(v.culled)
+    {
+        if(v.volume == 0)
+        {
+            v.enabled = false;
+            // Ignored by the allocator if the voice is still held, in which
+            // case releasing it frees it.
+            allocator.finish(id);
+            return;
+        }
+    }
+    else if(v.pressed)
     {
         if(v.press_timer) v.press_timer--;
     }
@@ -305,7 +666,11 @@ void instrument::step_voice(voice_id id)
         if(v.release_timer)
         {
             v.release_timer--;
-            if(v.release_timer == 0) v.enabled = false;
+            if(v.release_timer == 0)
+            {
+                v.enabled = false;
+                allocator.finish(id);
+            }
         }
     }
     update_voice_volume(v);
@@ -316,12 +681,35 @@ void instrument::apply_filter(int32_t* samples, unsigned sample_count)
     // TODO: Consider using try_mutex
     if(!used_filter) return;
 
-    for(unsigned i = 0; i < sample_count; ++i)
-        samples[i] = used_filter->push(samples[i]);
+    used_filter->set_modulation(filter_cutoff_mul, filter_resonance_mul);
+    used_filter->process(samples, sample_count);
+}
+
+void instrument::reset_allocator()
+{
+    allocator.resize(voices.size());
+    allocator.set_limit(polyphony);
+
+    // Voices that are further along their release are stolen first.
+    std::vector<voice_id> released;
+    for(voice_id id = 0; id < voices.size(); ++id)
+    {
+        const voice& v = voices[id];
+        if(!v.enabled) continue;
+        allocator.press(id, v.semitone, v.volume_num);
+        if(!v.pressed) released.push_back(id);
+    }
+    std::sort(
+        released.begin(), released.end(),
+        [&](voice_id a, voice_id b){
+            return voices[a].release_timer < voices[b].release_timer;
+        }
+    );
+    for(voice_id id: released) allocator.release(id);
 }
 
 void instrument::refresh_all_voices()
 {
     for(voice_id id = 0; id < voices.size(); ++id)
-        refresh_voice(id);
+        if(voices[id].enabled) refresh_voice(id);
 }
@@ -21,6 +21,8 @@
 #include <vector>
 #include <cstdint>
 #include <memory>
+#include <atomic>
+#include <unordered_map>
 #include "filter.hh"
 
 struct envelope
@@ -54,9 +56,104 @@ struct envelope
     uint64_t release_length;
 };
 
+// Picks voices for new notes without scanning. Free voices are kept in a
+// stack, released voices in a list in the order they were released, and held
+// voices in a heap ordered by the stealing policy. Released voices are always
+// stolen first, oldest release first, since they're the furthest along their
+// fade.
+class voice_allocator
+{
+public:
+    enum policy
+    {
+        OLDEST = 0,
+        QUIETEST,
+        // Retriggers the voice already playing the same note if there is one,
+        // otherwise like OLDEST.
+        SAME_NOTE
+    };
+
+    voice_allocator(unsigned voice_count = 1);
+
+    // Forgets all voices, they're free afterwards.
+    void resize(unsigned voice_count);
+    unsigned size() const;
+
+    // Most voices in use at once. Above this, voices are stolen even if
+    // others are free. Lowering it doesn't stop voices that are playing.
+    void set_limit(unsigned limit);
+    unsigned get_limit() const;
+
+    void set_policy(policy p);
+    policy get_policy() const;
+
+    // Returns the voice to use for a new note. Call press() for it next.
+    unsigned allocate(int semitone);
+    void press(unsigned id, int semitone, int64_t volume);
+    void set_volume(unsigned id, int64_t volume);
+    void release(unsigned id);
+    void release_all();
+    // Frees a voice that fell silent while it was held, so that finish() was
+    // ignored.
+    void discard(unsigned id);
+    // Marks a voice as silent. This is the only method that may be called
+    // from the audio thread while the others are used elsewhere.
+    void finish(unsigned id);
+
+private:
+    enum voice_list
+    {
+        FREE = 0,
+        HELD,
+        RELEASED
+    };
+
+    static constexpr unsigned NONE = ~0u;
+
+    struct voice
+    {
+        voice_list list;
+        int semitone;
+        int64_t volume;
+        uint64_t press_order;
+        // Position in free or held, or neighbours in the released list.
+        unsigned index;
+        unsigned prev, next;
+    };
+
+    void receive_finished();
+    void unlink(unsigned id);
+    void push_free(unsigned id);
+    void push_released(unsigned id);
+
+    bool steal_before(unsigned a, unsigned b) const;
+    void heap_push(unsigned id);
+    void heap_move(unsigned pos, unsigned id);
+    void heap_sift(unsigned pos);
+
+    std::vector<voice> voices;
+    std::vector<unsigned> free, held;
+    unsigned released_head, released_tail;
+    // Most recent voice of each semitone, for SAME_NOTE. May be outdated,
+    // so it's checked before use.
+    std::unordered_map<int, unsigned> note_voices;
+    uint64_t press_counter;
+    unsigned limit;
+    policy stealing;
+
+    // Single producer, single consumer. Only finish() writes finished_head,
+    // only receive_finished() writes finished_tail.
+    std::vector<unsigned> finished;
+    std::atomic_uint finished_head, finished_tail;
+};
+
 class instrument
 {
 public:
+    static constexpr unsigned DEFAULT_MAX_POLYPHONY = 128;
+    // Culled voices fade out over this many seconds from full volume.
+    static constexpr double CULL_FADE_TIME = 0.005;
+
     instrument(uint64_t samplerate);
     virtual ~instrument();
 
@@ -68,18 +165,36 @@ public:
     uint64_t get_samplerate() const;
 
     voice_id press_voice(int semitone);
-    void press_voice(voice_id id, int semitone, double volume = 1.0);
-    void set_voice_volume(voice_id id, double volume = 1.0);
-    void release_voice(voice_id id);
-    void release_all_voices();
-    // Makes sure all updates are applied to voices.
+    virtual void press_voice(voice_id id, int semitone, double volume = 1.0);
+    virtual void set_voice_volume(voice_id id, double volume = 1.0);
+    // Expression of a single voice on top of its key and volume, like the
+    // per-note pitch bend and pressure of MPE. bend is in semitones and
+    // amplitude multiplies the volume. Pressing the voice resets both.
+    virtual void set_voice_expression(
+        voice_id id, double bend, double amplitude = 1.0
+    );
+    virtual void release_voice(voice_id id);
+    virtual void release_all_voices();
+    // Makes sure all updates are applied to voices. Silent voices are
+    // skipped, they're refreshed when pressed.
     void refresh_all_voices();
 
+    // Allocates the voice pool, which resets all voices. Call this before
+    // playing.
+    void set_max_polyphony(unsigned n = DEFAULT_MAX_POLYPHONY);
+    unsigned get_max_polyphony() const;
+
+    // Limits how many voices of the pool are used at once. Can be changed
+    // while playing, nothing is reallocated.
     void set_polyphony(unsigned n = 16);
     unsigned get_polyphony() const;
 
+    // Which voice is replaced when all are in use.
+    void set_voice_stealing(voice_allocator::policy policy);
+    voice_allocator::policy get_voice_stealing() const;
+
     void set_envelope(const envelope& adsr);
-    envelope get_envelope() const;
+    virtual envelope get_envelope() const;
 
     void set_volume(double volume);
     void set_max_safe_volume();
@@ -90,9 +205,16 @@ public:
 
     void set_filter(filter&& f);
     void clear_filter();
+    // Multipliers for the cutoff frequency and resonance of the filter, can be
+    // changed freely without redesigning it.
+    void set_filter_modulation(double cutoff_mul, double resonance_mul);
 
     void copy_state(const instrument& other);
 
+    // True if no voice is sounding and the filter has rung out. Call from
+    // the thread calling synthesize().
+    virtual bool is_silent() const;
+
     virtual void synthesize(int32_t* samples, unsigned sample_count) = 0;
 
 protected:
@@ -100,15 +222,31 @@ protected:
     {
         bool enabled;
         bool pressed;
+        bool culled;
         uint64_t press_timer;
         uint64_t release_timer;
         int semitone;
         int64_t volume_num;
         int64_t volume; // Used for limiting volume jumps
+        double key_volume;
+        double bend;
+        double amplitude;
+        // Cached 2^((semitone+bend)/12), so that retuning is cheap.
+        double frequency_ratio;
     };
 
+    // Lists the voices that are currently sounding, in increasing order.
+    // Doesn't allocate if ids has room for the whole pool.
+    void get_active_voices(std::vector<voice_id>& ids) const;
     double get_frequency(voice_id id) const;
     void get_voice_volume(voice_id id, int64_t& num, int64_t& denom);
+    bool is_voice_pressed(voice_id id) const;
+    // Fades the voice out quickly and stops it, even if it's still held.
+    // Call from the thread calling synthesize().
+    void cull_voice(voice_id id);
+    bool is_voice_culled(voice_id id) const;
+    // Current level of the voice's envelope, 0 to 1 relative to the peak.
+    double get_envelope_level(voice_id id) const;
     void step_voice(voice_id id);
     void apply_filter(int32_t* samples, unsigned sample_count);
 
@@ -119,15 +257,22 @@ protected:
 private:
     // If this is too slow, consider generating a table from the envelope
     void update_voice_volume(voice& v);
+    int64_t envelope_volume(const voice& v) const;
+    // Rebuilds the allocator after voices are replaced.
+    void reset_allocator();
 
     std::vector<voice> voices;
+    voice_allocator allocator;
+    unsigned polyphony;
     envelope adsr;
     double base_frequency;
     int64_t volume_num, volume_denom;
     int64_t max_volume_skip;
+    int64_t cull_volume_skip;
     uint64_t samplerate;
 
     std::unique_ptr<filter> used_filter;
+    double filter_cutoff_mul, filter_resonance_mul;
 };
 
 #endif
@@ -19,19 +19,32 @@
 #include "instrument_state.hh"
 #include "helpers.hh"
 
+static const char* const voice_stealing_strings[] = {
+    "OLDEST", "QUIETEST", "SAME_NOTE"
+};
+
 instrument_state::instrument_state(uint64_t samplerate)
-: name("New synth"), polyphony(6), tuning_frequency(440.0), write_lock(false)
+:   name("New synth"), polyphony(6), voice_stealing(voice_allocator::OLDEST),
+    unison(1), unison_detune(10.0), tuning_frequency(440.0), write_lock(false),
+    lowest_key(INT_MIN), highest_key(INT_MAX)
 {
     adsr.set_volume(1.0f, 0.5f);
     adsr.set_curve(0.07f, 0.2f, 0.05f, samplerate);
 }
 
-fm_instrument* instrument_state::create_instrument(uint64_t samplerate) const
+fm_instrument* instrument_state::create_instrument(
+    uint64_t samplerate,
+    unsigned oversampling
+) const
 {
     fm_instrument* res = new fm_instrument(samplerate);
     res->set_synth(synth);
+    res->set_voice_filter(voice_filter);
     res->set_volume(1.0/polyphony);
     res->set_polyphony(polyphony);
+    res->set_voice_stealing(voice_stealing);
+    res->set_unison(unison, unison_detune);
+    res->set_oversampling(oversampling);
 
     return res;
 }
@@ -41,6 +54,9 @@ json instrument_state::serialize(uint64_t samplerate) const
     json j;
     j["name"] = name;
     j["polyphony"] = polyphony;
+    j["voice_stealing"] = voice_stealing_strings[(unsigned)voice_stealing];
+    j["unison"] = unison;
+    j["unison_detune"] = unison_detune;
     j["synth"] = synth.serialize();
     j["tuning_frequency"] = tuning_frequency;
 
@@ -54,6 +70,21 @@ json instrument_state::serialize(uint64_t samplerate) const
     j["envelope"] = e;
 
     j["filter"] = filter.serialize();
+    j["voice_filter"] = voice_filter.serialize();
+    j["effects"] = effects.serialize();
+
+    j["lowest_key"] = lowest_key;
+    j["highest_key"] = highest_key;
+    j["layers"] = json::array();
+    for(const layer& l: layers)
+    {
+        j["layers"].push_back({
+            {"name", l.name},
+            {"lowest_key", l.lowest_key},
+            {"highest_key", l.highest_key},
+            {"threaded", l.threaded}
+        });
+    }
 
     return j;
 }
@@ -65,6 +96,15 @@ bool instrument_state::deserialize(const json& j, uint64_t samplerate)
     {
         j.at("name").get_to(name);
         j.at("polyphony").get_to(polyphony);
+        std::string stealing_str = j.value("voice_stealing", "OLDEST");
+        int stealing_i = find_string_arg(
+            stealing_str.c_str(), voice_stealing_strings,
+            sizeof(voice_stealing_strings)/sizeof(*voice_stealing_strings)
+        );
+        voice_stealing = stealing_i < 0 ?
+            voice_allocator::OLDEST : (voice_allocator::policy)stealing_i;
+        unison = j.value("unison", 1u);
+        unison_detune = j.value("unison_detune", 10.0);
         synth.deserialize(j.at("synth"));
         tuning_frequency = j.value("tuning_frequency", 440.0);
 
@@ -83,6 +123,29 @@ bool instrument_state::deserialize(const json& j, uint64_t samplerate)
 
         if(j.count("filter")) filter.deserialize(j.at("filter"));
         else filter = filter_state();
+
+        if(j.count("voice_filter"))
+            voice_filter.deserialize(j.at("voice_filter"));
+        else voice_filter = voice_filter_state();
+
+        if(j.count("effects")) effects.deserialize(j.at("effects"));
+        else effects = effects_state();
+
+        lowest_key = j.value("lowest_key", INT_MIN);
+        highest_key = j.value("highest_key", INT_MAX);
+        layers.clear();
+        if(j.count("layers"))
+        {
+            for(const json& l: j.at("layers"))
+            {
+                layers.push_back({
+                    l.at("name").get<std::string>(),
+                    l.value("lowest_key", INT_MIN),
+                    l.value("highest_key", INT_MAX),
+                    l.value("threaded", false)
+                });
+            }
+        }
     }
     catch(...)
     {
@@ -21,21 +21,43 @@
 #include "fm.hh"
 #include "io.hh"
 #include "filter.hh"
+#include "effects.hh"
+#include <climits>
+#include <vector>
 
 struct instrument_state
 {
+    // Another instrument preset played along with this one. Key ranges are in
+    // semitones from A4, INT_MIN and INT_MAX leave that end of the range open.
+    struct layer
+    {
+        std::string name;
+        int lowest_key, highest_key;
+        bool threaded;
+    };
+
     std::string name;
     envelope adsr;
     unsigned polyphony;
+    voice_allocator::policy voice_stealing;
+    unsigned unison;
+    double unison_detune; // In cents
     fm_synth synth;
     double tuning_frequency;
     bool write_lock;
     fs::path path;
     filter_state filter;
+    voice_filter_state voice_filter;
+    effects_state effects;
+    int lowest_key, highest_key;
+    std::vector<layer> layers;
 
     instrument_state(uint64_t samplerate = 44100);
 
-    fm_instrument* create_instrument(uint64_t samplerate) const;
+    fm_instrument* create_instrument(
+        uint64_t samplerate,
+        unsigned oversampling = 1
+    ) const;
 
     // Samplerate is only used here for ADSR length conversions.
     json serialize(uint64_t samplerate) const;
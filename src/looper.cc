@@ -229,6 +229,13 @@ void looper::set_record_align(bool align_on_finish)
 
 void looper::apply(int32_t* o, unsigned long framecount)
 {
+    // Only the beat needs to keep going.
+    if(is_silent())
+    {
+        loop_t += framecount;
+        return;
+    }
+
     // Handle loop recording
     for(unsigned j = 0; j < loops.size(); ++j)
     {
@@ -299,6 +306,17 @@ void looper::apply(int32_t* o, unsigned long framecount)
     loop_t += framecount;
 }
 
+bool looper::is_silent() const
+{
+    for(const loop& l: loops)
+    {
+        if(l.state == PLAYING || l.volume_num != 0) return false;
+        if(l.state == RECORDING || l.state == FINISHING_RECORDING)
+            return false;
+    }
+    return true;
+}
+
 void looper::set_max_volume_skip(double skip)
 {
     max_volume_skip = skip * volume_denom;
@@ -75,6 +75,8 @@ public:
     void set_record_align(bool align_on_finish);
 
     void apply(int32_t* o, unsigned long framecount);
+    // True if no loop is recording or audible.
+    bool is_silent() const;
 
     void set_max_volume_skip(double skip = 0.0001);
 
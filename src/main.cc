@@ -73,6 +73,10 @@ int main(int argc, char** argv)
                     app.render();
                     ms_since_last_render = 0;
                 }
+                // While nothing is playing, SDL input still wakes us up
+                // immediately, but other controllers are checked less often.
+                // That can only delay the first note.
+                else if(app.is_idle()) SDL_WaitEventTimeout(nullptr, 5);
                 // Play nice with other programs despite checking input really
                 // quickly
                 else SDL_Delay(1);
@@ -22,11 +22,33 @@
 
 options::options()
 : system_index(-1), device_index(-1), samplerate(44100), target_latency(0.030),
-  recording_format(encoder::WAV), recording_quality(90),
+  block_size(64), oversampling(1), recording_format(encoder::WAV),
+  recording_quality(90),
   initial_window_width(800), initial_window_height(600),
-  start_loop_on_sound(false), align_loop_record(true)
+  start_loop_on_sound(false), align_loop_record(true), adaptive_latency(false),
+  cpu_budget(0.8), sine_fallback(false)
 {}
 
+std::string options::get_device_key() const
+{
+    if(system_index < 0) return "Auto";
+    std::string key = audio_output::get_available_systems()[system_index];
+    key += "/";
+    key += audio_output::get_available_devices(system_index)[
+        device_index < 0 ? 0 : device_index
+    ];
+    return key;
+}
+
+bool options::use_calibrated_latency()
+{
+    auto it = calibrated_latencies.find(get_device_key());
+    if(it == calibrated_latencies.end()) return false;
+    target_latency = it->second.target_latency;
+    block_size = it->second.block_size;
+    return true;
+}
+
 json options::serialize() const
 {
     json j;
@@ -38,12 +60,26 @@ json options::serialize() const
         audio_output::get_available_devices(system_index)[device_index];
     j["samplerate"] = samplerate;
     j["target_latency"] = target_latency;
+    j["block_size"] = block_size;
+    j["oversampling"] = oversampling;
     j["recording_format"] = encoder::format_strings[(int)recording_format];
     j["recording_quality"] = recording_quality;
     j["initial_window_width"] = initial_window_width;
     j["initial_window_height"] = initial_window_height;
     j["start_loop_on_sound"] = start_loop_on_sound;
     j["align_loop_record"] = align_loop_record;
+    j["adaptive_latency"] = adaptive_latency;
+    j["cpu_budget"] = cpu_budget;
+    j["sine_fallback"] = sine_fallback;
+
+    j["calibrated_latencies"] = json::object();
+    for(const auto& pair: calibrated_latencies)
+    {
+        j["calibrated_latencies"][pair.first] = {
+            {"target_latency", pair.second.target_latency},
+            {"block_size", pair.second.block_size}
+        };
+    }
     return j;
 }
 
@@ -53,12 +89,18 @@ bool options::deserialize(const json& j)
     device_index = -1;
     samplerate = 44100;
     target_latency = 0.030;
+    block_size = 64;
+    oversampling = 1;
     recording_format = encoder::WAV;
     recording_quality = 90;
     initial_window_width = 800;
     initial_window_height = 600;
     start_loop_on_sound = false;
     align_loop_record = true;
+    adaptive_latency = false;
+    cpu_budget = 0.8;
+    sine_fallback = false;
+    calibrated_latencies.clear();
 
     try
     {
@@ -89,6 +131,8 @@ bool options::deserialize(const json& j)
 
         j.at("samplerate").get_to(samplerate);
         j.at("target_latency").get_to(target_latency);
+        block_size = j.value("block_size", 64);
+        oversampling = j.value("oversampling", 1);
         recording_quality = j.value("recording_quality", 90.0);
 
         std::string format_str = j.value("recording_format", "WAV");
@@ -102,6 +146,19 @@ bool options::deserialize(const json& j)
         initial_window_height = j.value("initial_window_height", 600);
         start_loop_on_sound = j.value("start_loop_on_sound", false);
         align_loop_record = j.value("align_loop_record", true);
+        adaptive_latency = j.value("adaptive_latency", false);
+        cpu_budget = j.value("cpu_budget", 0.8);
+        sine_fallback = j.value("sine_fallback", false);
+
+        if(j.count("calibrated_latencies"))
+        {
+            for(auto& c: j.at("calibrated_latencies").items())
+            {
+                device_latency& l = calibrated_latencies[c.key()];
+                c.value().at("target_latency").get_to(l.target_latency);
+                c.value().at("block_size").get_to(l.block_size);
+            }
+        }
     }
     catch(...)
     {
@@ -113,5 +170,32 @@ bool options::deserialize(const json& j)
 
 bool options::operator!=(const options& other) const
 {
-    return memcmp(this, &other, sizeof(options)) != 0;
+    if(calibrated_latencies.size() != other.calibrated_latencies.size())
+        return true;
+    for(const auto& pair: calibrated_latencies)
+    {
+        auto it = other.calibrated_latencies.find(pair.first);
+        if(
+            it == other.calibrated_latencies.end() ||
+            it->second.target_latency != pair.second.target_latency ||
+            it->second.block_size != pair.second.block_size
+        ) return true;
+    }
+
+    return
+        system_index != other.system_index ||
+        device_index != other.device_index ||
+        samplerate != other.samplerate ||
+        target_latency != other.target_latency ||
+        block_size != other.block_size ||
+        oversampling != other.oversampling ||
+        recording_format != other.recording_format ||
+        recording_quality != other.recording_quality ||
+        initial_window_width != other.initial_window_width ||
+        initial_window_height != other.initial_window_height ||
+        start_loop_on_sound != other.start_loop_on_sound ||
+        align_loop_record != other.align_loop_record ||
+        adaptive_latency != other.adaptive_latency ||
+        cpu_budget != other.cpu_budget ||
+        sine_fallback != other.sine_fallback;
 }
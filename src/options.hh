@@ -21,6 +21,8 @@
 #include "fm.hh"
 #include "io.hh"
 #include "encoder.hh"
+#include <map>
+#include <string>
 
 struct options
 {
@@ -30,12 +32,39 @@ struct options
     int device_index;
     uint64_t samplerate;
     double target_latency;
+    unsigned block_size;
+    // The instrument is rendered at this multiple of the samplerate and
+    // decimated, 1, 2 or 4.
+    unsigned oversampling;
     encoder::format recording_format;
     double recording_quality;
     unsigned initial_window_width;
     unsigned initial_window_height;
     bool start_loop_on_sound;
     bool align_loop_record;
+    // If set, latency is increased at runtime when the audio callback keeps
+    // missing its deadline, and lowered back once it has been stable. The
+    // adapted latency isn't stored in target_latency.
+    bool adaptive_latency;
+    // Fraction of the render time budget that the instrument may use before
+    // it starts culling voices, 0 to disable.
+    double cpu_budget;
+    // If set, the instrument may play plain sines instead of the patch when
+    // it's over the budget.
+    bool sine_fallback;
+
+    struct device_latency
+    {
+        double target_latency;
+        unsigned block_size;
+    };
+    // Results of latency calibration, keyed by get_device_key().
+    std::map<std::string, device_latency> calibrated_latencies;
+
+    std::string get_device_key() const;
+    // Sets target latency and block size from calibration results for the
+    // current device, if there are any. Returns false if there were none.
+    bool use_calibrated_latency();
 
     json serialize() const;
     bool deserialize(const json& j);
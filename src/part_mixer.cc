@@ -0,0 +1,379 @@
+/*
+    Copyright 2019 Julius Ikkala
+
+    This file is part of CafeFM.
+
+    CafeFM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CafeFM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "part_mixer.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
+// post() only makes a system call if the worker is waiting, and never
+// blocks.
+class part_mixer::semaphore
+{
+public:
+    semaphore()
+    {
+#ifdef _WIN32
+        handle = CreateSemaphore(nullptr, 0, LONG_MAX, nullptr);
+        if(!handle) throw std::runtime_error("Unable to create semaphore");
+#elif defined(__APPLE__)
+        handle = dispatch_semaphore_create(0);
+        if(!handle) throw std::runtime_error("Unable to create semaphore");
+#else
+        if(sem_init(&handle, 0, 0))
+            throw std::runtime_error("Unable to create semaphore");
+#endif
+    }
+
+    ~semaphore()
+    {
+#ifdef _WIN32
+        CloseHandle(handle);
+#elif defined(__APPLE__)
+        dispatch_release(handle);
+#else
+        sem_destroy(&handle);
+#endif
+    }
+
+    void post()
+    {
+#ifdef _WIN32
+        ReleaseSemaphore(handle, 1, nullptr);
+#elif defined(__APPLE__)
+        dispatch_semaphore_signal(handle);
+#else
+        sem_post(&handle);
+#endif
+    }
+
+    void wait()
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handle, INFINITE);
+#elif defined(__APPLE__)
+        dispatch_semaphore_wait(handle, DISPATCH_TIME_FOREVER);
+#else
+        while(sem_wait(&handle) && errno == EINTR);
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE handle;
+#elif defined(__APPLE__)
+    dispatch_semaphore_t handle;
+#else
+    sem_t handle;
+#endif
+};
+
+part_mixer::part_mixer(uint64_t samplerate)
+:   instrument(samplerate)
+{
+    // Keys never finish, since they're not stepped. Released keys are
+    // reused first, so only keys that are held at once need room.
+    set_max_polyphony();
+    set_polyphony(get_max_polyphony());
+}
+
+part_mixer::~part_mixer()
+{
+    clear_parts();
+}
+
+unsigned part_mixer::add_part(
+    instrument& ins,
+    int lowest_key,
+    int highest_key,
+    bool threaded
+){
+    if(ins.get_samplerate() != get_samplerate())
+        throw std::runtime_error(
+            "Part samplerate doesn't match the mixer!"
+        );
+
+    std::unique_ptr<part> p(new part);
+    p->ins = &ins;
+    p->lowest_key = lowest_key;
+    p->highest_key = highest_key;
+    p->key_voices.resize(get_max_polyphony(), NONE);
+    p->voice_keys.resize(ins.get_max_polyphony(), NONE);
+    p->buffer.resize(MAX_BLOCK);
+    p->requested = 0;
+    p->written = 0;
+    p->read = 0;
+    p->quit = false;
+    if(threaded) start_worker(*p);
+    parts.emplace_back(std::move(p));
+    return parts.size() - 1;
+}
+
+void part_mixer::clear_parts()
+{
+    for(auto& p: parts) stop_worker(*p);
+    parts.clear();
+}
+
+unsigned part_mixer::get_part_count() const
+{
+    return parts.size();
+}
+
+void part_mixer::set_part_range(
+    unsigned index,
+    int lowest_key,
+    int highest_key
+){
+    parts[index]->lowest_key = lowest_key;
+    parts[index]->highest_key = highest_key;
+}
+
+void part_mixer::copy_state(const part_mixer& other)
+{
+    instrument::copy_state(other);
+    for(unsigned i = 0; i < parts.size() && i < other.parts.size(); ++i)
+    {
+        part& p = *parts[i];
+        const part& o = *other.parts[i];
+        std::fill(p.key_voices.begin(), p.key_voices.end(), NONE);
+        std::fill(p.voice_keys.begin(), p.voice_keys.end(), NONE);
+        for(voice_id id = 0; id < o.key_voices.size(); ++id)
+        {
+            voice_id v = o.key_voices[id];
+            if(
+                v == NONE || id >= p.key_voices.size() ||
+                v >= p.voice_keys.size()
+            ) continue;
+            p.key_voices[id] = v;
+            p.voice_keys[v] = id;
+        }
+    }
+}
+
+void part_mixer::press_voice(voice_id id, int semitone, double volume)
+{
+    instrument::press_voice(id, semitone, volume);
+    for(auto& ptr: parts)
+    {
+        part& p = *ptr;
+        // The key may have been stolen while it was still playing.
+        release_key(p, id);
+        if(semitone < p.lowest_key || semitone > p.highest_key) continue;
+
+        voice_id v = p.ins->press_voice(semitone);
+        p.ins->set_voice_volume(v, volume);
+        if(p.voice_keys[v] != NONE) p.key_voices[p.voice_keys[v]] = NONE;
+        p.key_voices[id] = v;
+        p.voice_keys[v] = id;
+    }
+}
+
+void part_mixer::set_voice_volume(voice_id id, double volume)
+{
+    instrument::set_voice_volume(id, volume);
+    for(auto& p: parts)
+    {
+        voice_id v = p->key_voices[id];
+        if(v != NONE) p->ins->set_voice_volume(v, volume);
+    }
+}
+
+void part_mixer::set_voice_expression(
+    voice_id id, double bend, double amplitude
+){
+    instrument::set_voice_expression(id, bend, amplitude);
+    for(auto& p: parts)
+    {
+        voice_id v = p->key_voices[id];
+        if(v != NONE) p->ins->set_voice_expression(v, bend, amplitude);
+    }
+}
+
+void part_mixer::release_voice(voice_id id)
+{
+    instrument::release_voice(id);
+    for(auto& p: parts) release_key(*p, id);
+}
+
+void part_mixer::release_all_voices()
+{
+    instrument::release_all_voices();
+    for(auto& p: parts)
+    {
+        p->ins->release_all_voices();
+        std::fill(p->key_voices.begin(), p->key_voices.end(), NONE);
+        std::fill(p->voice_keys.begin(), p->voice_keys.end(), NONE);
+    }
+}
+
+bool part_mixer::is_silent() const
+{
+    for(auto& p: parts)
+    {
+        if(!p->ins->is_silent()) return false;
+        if(p->worker && p->written != p->read) return false;
+    }
+    return true;
+}
+
+envelope part_mixer::get_envelope() const
+{
+    envelope longest = instrument::get_envelope();
+    bool found = false;
+    for(auto& p: parts)
+    {
+        envelope e = p->ins->get_envelope();
+        if(!found || e.release_length > longest.release_length)
+            longest = e;
+        found = true;
+    }
+    return longest;
+}
+
+void part_mixer::synthesize(int32_t* samples, unsigned sample_count)
+{
+    for(unsigned offset = 0; offset < sample_count; offset += MAX_BLOCK)
+    {
+        render(
+            samples + offset,
+            std::min(sample_count - offset, MAX_BLOCK)
+        );
+    }
+}
+
+void part_mixer::refresh_voice(voice_id) {}
+void part_mixer::reset_voice(voice_id) {}
+
+void part_mixer::handle_polyphony(unsigned n)
+{
+    for(auto& p: parts) p->key_voices.resize(n, NONE);
+}
+
+void part_mixer::start_worker(part& p)
+{
+    p.quit = false;
+    p.requested = 0;
+    p.written = 0;
+    p.read = 0;
+    p.ring.resize(RING_SIZE);
+    p.wake.reset(new semaphore);
+    p.worker.reset(new std::thread(run_worker, &p));
+}
+
+void part_mixer::stop_worker(part& p)
+{
+    if(!p.worker) return;
+    p.quit = true;
+    p.wake->post();
+    p.worker->join();
+    p.worker.reset();
+    p.wake.reset();
+}
+
+void part_mixer::run_worker(part* p)
+{
+    for(;;)
+    {
+        p->wake->wait();
+        if(p->quit) return;
+        for(;;)
+        {
+            unsigned requested = p->requested.load(std::memory_order_acquire);
+            unsigned written = p->written.load(std::memory_order_relaxed);
+            if(written == requested) break;
+
+            unsigned count = std::min(requested - written, MAX_BLOCK);
+            p->ins->synthesize(p->buffer.data(), count);
+            for(unsigned i = 0; i < count; ++i)
+                p->ring[(written + i) % RING_SIZE] = p->buffer[i];
+            p->written.store(written + count, std::memory_order_release);
+        }
+    }
+}
+
+void part_mixer::release_key(part& p, voice_id id)
+{
+    voice_id v = p.key_voices[id];
+    if(v == NONE) return;
+    p.ins->release_voice(v);
+    p.voice_keys[v] = NONE;
+    p.key_voices[id] = NONE;
+}
+
+void part_mixer::render(int32_t* samples, unsigned sample_count)
+{
+    // Threaded parts are asked for the next block first, so that they render
+    // it while the others render this one here.
+    for(auto& p: parts)
+    {
+        if(!p->worker) continue;
+        unsigned target = p->read + 2 * sample_count;
+        unsigned requested = p->requested.load(std::memory_order_relaxed);
+        if((int)(target - requested) <= 0) continue;
+        p->requested.store(target, std::memory_order_release);
+        p->wake->post();
+    }
+
+    std::fill(samples, samples + sample_count, 0);
+    auto mix = [&](const int32_t* buffer, unsigned count){
+        for(unsigned i = 0; i < count; ++i)
+        {
+            samples[i] = std::clamp(
+                (int64_t)samples[i] + buffer[i],
+                (int64_t)INT32_MIN, (int64_t)INT32_MAX
+            );
+        }
+    };
+
+    bool first = true;
+    for(auto& p: parts)
+    {
+        if(p->worker) continue;
+        // The first part can render straight into the output.
+        if(first) p->ins->synthesize(samples, sample_count);
+        else
+        {
+            p->ins->synthesize(p->buffer.data(), sample_count);
+            mix(p->buffer.data(), sample_count);
+        }
+        first = false;
+    }
+
+    // Plays what the workers have rendered so far, without waiting.
+    for(auto& p: parts)
+    {
+        if(!p->worker) continue;
+        unsigned written = p->written.load(std::memory_order_acquire);
+        unsigned count = std::min(written - p->read, sample_count);
+        for(unsigned i = 0; i < count; ++i)
+            p->buffer[i] = p->ring[(p->read + i) % RING_SIZE];
+        mix(p->buffer.data(), count);
+        p->read += count;
+    }
+}
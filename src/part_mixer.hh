@@ -0,0 +1,128 @@
+/*
+    Copyright 2019 Julius Ikkala
+
+    This file is part of CafeFM.
+
+    CafeFM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    CafeFM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CafeFM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CAFEFM_PART_MIXER_HH
+#define CAFEFM_PART_MIXER_HH
+#include "instrument.hh"
+#include <climits>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+// Plays several instruments as one. Each part only plays the keys in its
+// range, so parts with overlapping ranges are layered and parts with
+// separate ranges split the keyboard. The voices of the mixer are keys, and
+// each key plays one voice in every part its semitone falls on.
+class part_mixer: public instrument
+{
+public:
+    // Longer blocks are rendered in pieces.
+    static constexpr unsigned MAX_BLOCK = 1024;
+
+    part_mixer(uint64_t samplerate);
+    ~part_mixer();
+
+    // Parts can't be added or removed while the mixer is playing. The
+    // instruments aren't owned by the mixer and must have the mixer's
+    // samplerate. A threaded part renders on a worker thread of its own, in
+    // parallel with the other parts. It's rendered one block ahead and played
+    // a block late, so the audio thread never waits for the worker. If the
+    // worker falls behind, the part plays what it has and the rest of its
+    // audio follows later instead of being dropped.
+    unsigned add_part(
+        instrument& ins,
+        int lowest_key = INT_MIN,
+        int highest_key = INT_MAX,
+        bool threaded = false
+    );
+    void clear_parts();
+    unsigned get_part_count() const;
+
+    // Can be changed while playing. Only affects keys pressed afterwards.
+    void set_part_range(unsigned index, int lowest_key, int highest_key);
+
+    // Also copies the voices that keys play in each part. The instruments of
+    // the parts should have copied the state of the other mixer's parts at
+    // the same indices.
+    void copy_state(const part_mixer& other);
+
+    using instrument::press_voice;
+    void press_voice(voice_id id, int semitone, double volume = 1.0) override;
+    void set_voice_volume(voice_id id, double volume = 1.0) override;
+    void set_voice_expression(
+        voice_id id, double bend, double amplitude = 1.0
+    ) override;
+    void release_voice(voice_id id) override;
+    void release_all_voices() override;
+
+    bool is_silent() const override;
+    // The envelope of the part with the longest release.
+    envelope get_envelope() const override;
+
+    void synthesize(int32_t* samples, unsigned sample_count) override;
+
+protected:
+    void refresh_voice(voice_id id) override;
+    void reset_voice(voice_id id) override;
+    void handle_polyphony(unsigned n) override;
+
+private:
+    static constexpr voice_id NONE = ~0u;
+    // Holds the block being played and the one rendered ahead. A power of
+    // two, so that the wrapping positions index it consistently.
+    static constexpr unsigned RING_SIZE = 4 * MAX_BLOCK;
+
+    class semaphore;
+
+    struct part
+    {
+        instrument* ins;
+        int lowest_key, highest_key;
+        // The voice of the part that each key plays, and the key that plays
+        // each voice of the part. A voice stolen by another key is removed
+        // from the old key, so that releasing it doesn't cut the new note.
+        std::vector<voice_id> key_voices;
+        std::vector<voice_id> voice_keys;
+        std::vector<int32_t> buffer;
+
+        // The worker renders into the ring until written reaches requested,
+        // and the audio thread plays from read up to written. The positions
+        // count samples and wrap around. Waking the worker doesn't lock
+        // anything, so the audio thread can't be blocked by it.
+        std::unique_ptr<std::thread> worker;
+        std::unique_ptr<semaphore> wake;
+        std::vector<int32_t> ring;
+        std::atomic_uint requested;
+        std::atomic_uint written;
+        unsigned read;
+        std::atomic_bool quit;
+    };
+
+    void start_worker(part& p);
+    void stop_worker(part& p);
+    static void run_worker(part* p);
+
+    // Stops the voice played by the key, if any.
+    void release_key(part& p, voice_id id);
+    void render(int32_t* samples, unsigned sample_count);
+
+    std::vector<std::unique_ptr<part>> parts;
+};
+
+#endif